@@ -34,6 +34,19 @@ struct AABB
     p_max = v_max(p_max, other.p_max);
   }
 
+  // Shrink to the part that overlaps another box. The box is empty
+  // afterwards if the two do not overlap.
+  void intersect_AABB(const AABB& other)
+  {
+    p_min = v_max(p_min, other.p_min);
+    p_max = v_min(p_max, other.p_max);
+  }
+
+  bool is_empty() const
+  {
+    return p_min[0] > p_max[0] || p_min[1] > p_max[1] || p_min[2] > p_max[2];
+  }
+
   bool intersects(const AABB& other) const
   {
     for(unsigned int i = 0; i < 3; ++i)
@@ -42,6 +55,28 @@ struct AABB
     return true;
   }
 
+  // Slab test against a ray given by origin and reciprocal direction.
+  // On a hit, t_near is moved to the distance where the ray enters the box.
+  bool intersects(const CGLA::Vec3f& origin, const CGLA::Vec3f& inv_dir, float& t_near, float t_far) const
+  {
+    for(unsigned int i = 0; i < 3; ++i)
+    {
+      float t0 = (p_min[i] - origin[i])*inv_dir[i];
+      float t1 = (p_max[i] - origin[i])*inv_dir[i];
+      if(t0 > t1)
+      {
+        float tmp = t0;
+        t0 = t1;
+        t1 = tmp;
+      }
+      t_near = t0 > t_near ? t0 : t_near;
+      t_far = t1 < t_far ? t1 : t_far;
+      if(t_near > t_far)
+        return false;
+    }
+    return true;
+  }
+
   float area() const
   {
     const CGLA::Vec3f d = get_diagonal();
@@ -4,6 +4,8 @@
 #ifndef ACCOBJ_H
 #define ACCOBJ_H
 
+#include <vector>
+#include <algorithm>
 #include "AABB.h"
 #include "Object3D.h"
 
@@ -19,4 +21,46 @@ struct AccObj
   AABB bbox;
 };
 
+/// Storage for the objects of an accelerator. Objects are taken from a few
+/// large blocks and released all at once, and their addresses stay valid
+/// as more objects are added.
+class AccObjPool
+{
+public:
+  AccObjPool() : used(0), capacity(0) { }
+  ~AccObjPool() { clear(); }
+
+  // Space for count consecutive objects
+  AccObj* allocate(unsigned int count)
+  {
+    if(used + count > capacity)
+    {
+      capacity = std::max(count, BLOCK_SIZE);
+      blocks.push_back(new AccObj[capacity]);
+      used = 0;
+    }
+    AccObj* objects = blocks.back() + used;
+    used += count;
+    return objects;
+  }
+
+  void clear()
+  {
+    for(unsigned int i = 0; i < blocks.size(); ++i)
+      delete [] blocks[i];
+    std::vector<AccObj*>().swap(blocks);
+    used = capacity = 0;
+  }
+
+  static const unsigned int BLOCK_SIZE = 1 << 16;   // Minimum number of objects in a block
+
+private:
+  AccObjPool(const AccObjPool&);
+  AccObjPool& operator=(const AccObjPool&);
+
+  std::vector<AccObj*> blocks;
+  unsigned int used;       // objects taken from the last block
+  unsigned int capacity;   // size of the last block
+};
+
 #endif // ACCOBJ_H
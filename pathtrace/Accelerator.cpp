@@ -2,72 +2,281 @@
 // Copyright (c) DTU Informatics 2011
 
 #include <vector>
+#include <map>
+#include <algorithm>
+#include "CGLA/Vec3f.h"
 #include "Ray.h"
+#include "RayPacket.h"
+#include "AABB.h"
 #include "AccObj.h"
 #include "Object3D.h"
 #include "Plane.h"
+#include "TriangleStore.h"
+#include "Morton.h"
+#include "AcceleratorCache.h"
 #include "Accelerator.h"
 
 using namespace std;
+using namespace CGLA;
 
-Accelerator::~Accelerator()
+namespace
 {
-  for(unsigned int i = 0; i < primitives.size(); ++i)
-    delete primitives[i];
+  const unsigned int ORIGIN_BITS = 4;                     // Bits per axis of the quantized ray origins used for sorting batches
+  const unsigned int NO_OF_KEYS = 8 << 3*ORIGIN_BITS;     // Direction octants times origin cells
+  const unsigned int COUNTING_SORT_SIZE = NO_OF_KEYS/16;  // Smaller batches are sorted by comparison
+
+  // Order in which to trace a batch of rays. Rays are sorted by the octant
+  // of their direction and then along a Morton curve through a grid over
+  // their origins. A counting sort keeps this cheap compared to tracing
+  // for large batches. Small batches are sorted by comparison instead,
+  // since clearing the counts of all keys would take longer.
+  void sort_rays(const vector<Ray>& rays, vector<unsigned int>& order)
+  {
+    AABB bbox;
+    for(unsigned int i = 0; i < rays.size(); ++i)
+      bbox.add_point(rays[i].origin);
+    MortonGrid grid(bbox, ORIGIN_BITS);
+
+    vector<unsigned int> keys(rays.size());
+    for(unsigned int i = 0; i < rays.size(); ++i)
+    {
+      const Ray& r = rays[i];
+      unsigned int octant = (r.direction[0] < 0.0f ? 1 : 0) | (r.direction[1] < 0.0f ? 2 : 0) | (r.direction[2] < 0.0f ? 4 : 0);
+      keys[i] = (octant << 3*ORIGIN_BITS) | grid.get_code(r.origin);
+    }
+
+    order.resize(rays.size());
+    if(rays.size() < COUNTING_SORT_SIZE)
+    {
+      // Each key is paired with its ray index, which also keeps the order stable
+      vector<unsigned long long> sorted(rays.size());
+      for(unsigned int i = 0; i < rays.size(); ++i)
+        sorted[i] = static_cast<unsigned long long>(keys[i]) << 32 | i;
+      sort(sorted.begin(), sorted.end());
+      for(unsigned int i = 0; i < rays.size(); ++i)
+        order[i] = static_cast<unsigned int>(sorted[i]);
+      return;
+    }
+
+    vector<unsigned int> offsets(NO_OF_KEYS + 1, 0);
+    for(unsigned int i = 0; i < rays.size(); ++i)
+      ++offsets[keys[i] + 1];
+    for(unsigned int k = 1; k <= NO_OF_KEYS; ++k)
+      offsets[k] += offsets[k - 1];
+    for(unsigned int i = 0; i < rays.size(); ++i)
+      order[offsets[keys[i]]++] = i;
+  }
+}
+
+void Accelerator::init(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes)
+{
+  add_primitives(geometry, scene_planes);
+  triangles.build(primitives);
+  built_sah_cost = get_sah_cost();
 }
 
-void Accelerator::init(const vector<const TriMesh*>& geometry, const vector<const Plane*>& scene_planes)
+void Accelerator::add_primitives(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes)
 {
   for(unsigned int i = 0; i < geometry.size(); ++i)
   {
-    const TriMesh* obj = geometry[i];
+    const Object3D* obj = geometry[i];
     unsigned int no_of_prims = primitives.size();
-    primitives.resize(no_of_prims + obj->get_no_of_primitives());
-    for(unsigned int j = 0; j < obj->get_no_of_primitives(); ++j)
-      primitives[j + no_of_prims] = new AccObj(obj, j);
+    int no_of_obj_prims = obj->get_no_of_primitives();
+    primitives.resize(no_of_prims + no_of_obj_prims);
+    AccObj* objects = no_of_obj_prims > 0 ? prim_pool.allocate(no_of_obj_prims) : 0;
+    #pragma omp parallel for
+    for(int j = 0; j < no_of_obj_prims; ++j)
+    {
+      objects[j] = AccObj(obj, j);
+      primitives[j + no_of_prims] = &objects[j];
+    }
   }
   planes = scene_planes;
 }
 
-bool Accelerator::closest_hit(Ray& r) const
+void Accelerator::refit()
 {
-  closest_plane(r);
+  int no_of_prims = primitives.size();
+  #pragma omp parallel for
+  for(int i = 0; i < no_of_prims; ++i)
+    primitives[i]->bbox = primitives[i]->geometry->get_primitive_bbox(primitives[i]->prim_idx);
+  triangles.update();
+}
+
+float Accelerator::get_sah_cost() const
+{
+  return SAH_INTERSECTION_COST*primitives.size();
+}
+
+size_t Accelerator::get_memory_usage() const
+{
+  return primitives.capacity()*sizeof(AccObj*) + primitives.size()*sizeof(AccObj) + triangles.get_memory_usage()
+         + planes.capacity()*sizeof(const Plane*);
+}
+
+bool Accelerator::load(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes, CacheReader& in)
+{
+  Accelerator::init(geometry, scene_planes);
+  return true;
+}
+
+void Accelerator::save_objects(CacheWriter& out, const vector<AccObj*>& objects) const
+{
+  // Objects are stored by their position in the primitives array, which
+  // is the same for any accelerator initialized with the same geometry.
+  // References duplicated by the build follow the original primitives.
+  map<const Object3D*, unsigned int> first_prim;
   for(unsigned int i = 0; i < primitives.size(); ++i)
+    if(primitives[i]->prim_idx == 0)
+      first_prim.insert(make_pair(primitives[i]->geometry, i));
+  vector<unsigned int> indices(objects.size());
+  for(unsigned int i = 0; i < objects.size(); ++i)
+    indices[i] = first_prim[objects[i]->geometry] + objects[i]->prim_idx;
+  out.write(indices);
+}
+
+bool Accelerator::load_objects(CacheReader& in, vector<AccObj*>& objects) const
+{
+  vector<unsigned int> indices;
+  if(!in.read(indices))
+    return false;
+  objects.resize(indices.size());
+  for(unsigned int i = 0; i < indices.size(); ++i)
   {
-    AccObj* obj = primitives[i];
-    if(obj->geometry->intersect(r, obj->prim_idx))
-      r.tmax = r.dist;
+    if(indices[i] >= primitives.size())
+      return false;
+    objects[i] = primitives[indices[i]];
   }
+  return true;
+}
+
+bool Accelerator::closest_hit(Ray& r) const
+{
+  closest_plane(r);
+  unsigned int hit_idx;
+  if(closest_primitive(r, hit_idx))
+    finalize_hit(r, hit_idx);
   if(r.has_hit)
     r.hit_pos = r.origin + r.dist*r.direction;  
   return r.has_hit;
 }
 
+bool Accelerator::closest_primitive(Ray& r, unsigned int& hit_idx) const
+{
+  return triangles.intersect_range(r, 0, triangles.size(), hit_idx);
+}
+
 bool Accelerator::any_hit(Ray& r) const
 {
-  if(!any_plane(r))
+  r.has_hit = occluded(r);
+  return r.has_hit;
+}
+
+bool Accelerator::occluded(const Ray& r, unsigned int* occluder) const
+{
+  if(any_plane(r) || hits_occluder(r, occluder))
+    return true;
+  unsigned int hit_idx;
+  if(!triangles.occludes_range(r, 0, triangles.size(), hit_idx))
+    return false;
+  if(occluder)
+    *occluder = hit_idx;
+  return true;
+}
+
+void Accelerator::closest_hits(RayPacket& packet) const
+{
+  for(unsigned int i = 0; i < packet.size; ++i)
+    closest_hit(packet.rays[i]);
+}
+
+void Accelerator::intersect_batch(vector<Ray>& rays) const
+{
+  // Runs of sorted rays from a common origin, such as camera rays, are
+  // coherent enough to be traced as packets. Packet traversal is slower
+  // than single rays for the diverging rays of other runs.
+  vector<unsigned int> order;
+  sort_rays(rays, order);
+  RayPacket packet;
+  for(unsigned int first = 0; first < order.size(); first += PACKET_SIZE)
   {
-    unsigned int i = 0;
-    while(i < primitives.size() && !r.has_hit)
+    unsigned int size = min(PACKET_SIZE, static_cast<unsigned int>(order.size()) - first);
+    const Vec3f& origin = rays[order[first]].origin;
+    bool coherent = size > 1;
+    for(unsigned int i = 1; i < size && coherent; ++i)
+      coherent = rays[order[first + i]].origin == origin;
+    if(!coherent)
     {
-      AccObj* obj = primitives[i++];
-      obj->geometry->intersect(r, obj->prim_idx);
+      for(unsigned int i = 0; i < size; ++i)
+        closest_hit(rays[order[first + i]]);
+      continue;
     }
+    packet.size = size;
+    for(unsigned int i = 0; i < size; ++i)
+      packet.rays[i] = rays[order[first + i]];
+    closest_hits(packet);
+    for(unsigned int i = 0; i < size; ++i)
+      rays[order[first + i]] = packet.rays[i];
   }
-  return r.has_hit;
+}
+
+void Accelerator::occluded_batch(const vector<Ray>& rays, vector<bool>& hits) const
+{
+  // Neighbouring rays in the sorted order are often blocked by the same
+  // object, so the occluder of one ray is tested first for the next
+  vector<unsigned int> order;
+  sort_rays(rays, order);
+  hits.resize(rays.size());
+  unsigned int occluder = triangles.size();
+  for(unsigned int i = 0; i < order.size(); ++i)
+    hits[order[i]] = occluded(rays[order[i]], &occluder);
+}
+
+unsigned int Accelerator::all_hits(const Ray& r, vector<Ray>& hits, unsigned int max_hits) const
+{
+  HitList list(r.tmax, max_hits);
+  for(unsigned int i = 0; i < planes.size(); ++i)
+  {
+    Ray tmp = r;
+    tmp.tmax = list.get_tmax();
+    if(planes[i]->is_visible_to(r.type) && planes[i]->intersect(tmp, 0))
+      list.add(tmp);
+  }
+  collect_hits(r, list);
+
+  // Only the hits that were kept get their remaining attributes
+  hits.resize(list.size());
+  for(unsigned int i = 0; i < list.size(); ++i)
+  {
+    Ray& hit = hits[i];
+    hit = list[i];
+    if(list.get_primitive(i) != HIT_FINALIZED)
+      triangles.finalize_hit(hit, list.get_primitive(i));
+    hit.hit_pos = hit.origin + hit.dist*hit.direction;
+  }
+  return hits.size();
+}
+
+void Accelerator::collect_hits(const Ray& r, HitList& hits) const
+{
+  for(unsigned int i = 0; i < triangles.size(); ++i)
+    triangles.add_hits(r, i, hits);
 }
 
 void Accelerator::closest_plane(Ray& r) const
 {
   for(unsigned int i = 0; i < planes.size(); ++i)
-    if(planes[i]->intersect(r, 0))
+    if(planes[i]->is_visible_to(r.type) && planes[i]->intersect(r, 0))
       r.tmax = r.dist;
 }
 
-bool Accelerator::any_plane(Ray& r) const
+bool Accelerator::any_plane(const Ray& r) const
 {
+  if(planes.empty())
+    return false;
+  Ray tmp = r;
   for(unsigned int i = 0; i < planes.size(); ++i)
-    if(planes[i]->intersect(r, 0))
+    if(planes[i]->is_visible_to(r.type) && planes[i]->intersect(tmp, 0))
       return true;
   return false;
 }
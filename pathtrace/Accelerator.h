@@ -6,24 +6,113 @@
 
 #include <vector>
 #include "Ray.h"
+#include "RayPacket.h"
+#include "HitList.h"
 #include "AccObj.h"
 #include "Object3D.h"
 #include "Plane.h"
+#include "TriangleStore.h"
+#include "AcceleratorCache.h"
+
+// Relative costs of a traversal step and a primitive intersection used
+// when estimating the quality of an acceleration structure
+const float SAH_TRAVERSAL_COST = 1.0f;
+const float SAH_INTERSECTION_COST = 1.0f;
 
 class Accelerator
 {
 public:
-  virtual ~Accelerator();
-  virtual void init(const std::vector<const TriMesh*>& geometry, const std::vector<const Plane*>& scene_planes);
+  Accelerator() : built_sah_cost(0.0f) { }
+  virtual ~Accelerator() { }
+  virtual void init(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& scene_planes);
   virtual bool closest_hit(Ray& r) const;
-  virtual bool any_hit(Ray& r) const;
+
+  // Marks the ray as hit if anything occludes it. Only has_hit is set.
+  bool any_hit(Ray& r) const;
+
+  virtual void closest_hits(RayPacket& packet) const;
+
+  // The closest hit in two steps, for callers that only need the hit
+  // attributes of some of the hits, such as instances. closest_primitive
+  // tests the primitives but not the planes, sets the attributes that
+  // intersect sets, and sets hit_idx to the primitive hit. finalize_hit
+  // computes the other attributes and sets hit_face_id again.
+  virtual bool closest_primitive(Ray& r, unsigned int& hit_idx) const;
+  virtual void finalize_hit(Ray& r, unsigned int hit_idx) const { triangles.finalize_hit(r, hit_idx); }
+
+  // Queries for streams of rays, such as the secondary rays of a set of
+  // paths. The rays are traced grouped by direction octant and origin, so
+  // that rays following each other visit the same parts of the structure.
+  // Hits are returned in the rays as by closest_hit, and hits[i] tells
+  // whether rays[i] is occluded. The rays of a batch are traced by the
+  // calling thread.
+  void intersect_batch(std::vector<Ray>& rays) const;
+  void occluded_batch(const std::vector<Ray>& rays, std::vector<bool>& hits) const;
+
+  // All hits between tmin and tmax sorted along the ray and found in a
+  // single traversal, for following a ray through media and stacks of
+  // interfaces. Only the max_hits closest hits are kept unless max_hits is
+  // 0. The hits are copies of r with the attributes set by closest_hit.
+  // Returns the number of hits.
+  unsigned int all_hits(const Ray& r, std::vector<Ray>& hits, unsigned int max_hits = 0) const;
+
+  // Occlusion query for shadow rays. Stops at the first hit between tmin
+  // and tmax and computes no hit attributes. If occluder is given, the
+  // object it refers to is tested first, and it is set to the object
+  // found to block the ray.
+  virtual bool occluded(const Ray& r, unsigned int* occluder = 0) const;
+
+  // Update the structure after the geometry it was built for has been
+  // transformed or deformed. The topology of the structure is kept.
+  virtual void refit();
+
+  // Expected cost of a ray query according to the surface area heuristic
+  virtual float get_sah_cost() const;
+
+  // Ratio of the current cost to the cost right after the last full build.
+  // Refitting lets this grow as the bounds start to overlap.
+  float get_sah_cost_growth() const { return built_sah_cost > 0.0f ? get_sah_cost()/built_sah_cost : 1.0f; }
+
+  // Bytes held by the structure and its copy of the primitives. The
+  // triangle store has a slot for every reference from a leaf, so
+  // structures that duplicate references or pad leaves have more slots
+  // than primitives.
+  virtual size_t get_memory_usage() const;
+  unsigned int get_no_of_slots() const { return triangles.size(); }
+
+  // Cache files. Only the structure built over the primitives is stored.
+  // Loading recreates the primitives from the same geometry as init and
+  // returns false if the stored structure does not fit them.
+  virtual void save(CacheWriter& out) const { }
+  virtual bool load(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& scene_planes, CacheReader& in);
 
 protected:
+  // Add the hits with the primitives of the structure to the list. Hits
+  // beyond hits.get_tmax() can be skipped. Objects referenced by several
+  // leaves may be added more than once.
+  virtual void collect_hits(const Ray& r, HitList& hits) const;
+
+  // Create the primitives of the geometry without building the triangle
+  // store. Accelerators that store the triangles in the order of their
+  // leaves call this instead of init and build the store themselves.
+  void add_primitives(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& scene_planes);
+
   void closest_plane(Ray& r) const;
-  bool any_plane(Ray& r) const;
+  bool any_plane(const Ray& r) const;
+  bool hits_occluder(const Ray& r, const unsigned int* occluder) const
+  {
+    return occluder && *occluder < triangles.size() && triangles.occludes(r, *occluder);
+  }
+  void save_objects(CacheWriter& out, const std::vector<AccObj*>& objects) const;
+  bool load_objects(CacheReader& in, std::vector<AccObj*>& objects) const;
 
-  std::vector<AccObj*> primitives;
+  std::vector<AccObj*> primitives;   // objects held by prim_pool
+  AccObjPool prim_pool;
   std::vector<const Plane*> planes;
+  float built_sah_cost;
+
+  // Primitives in the order used by the leaves of the accelerator
+  TriangleStore triangles;
 };
 
 #endif // ACCELERATOR_H
\ No newline at end of file
@@ -0,0 +1,180 @@
+// 02576 Rendering Framework
+// Binary files for keeping built acceleration structures between runs.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <cstdio>
+#ifdef _WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <windows.h>
+  #include <process.h>
+#else
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+#include "TriMesh.h"
+#include "Accelerator.h"
+#include "AcceleratorCache.h"
+
+using namespace std;
+
+namespace
+{
+  const unsigned int CACHE_MAGIC = 0x43414250;   // "PBAC" in a little endian file
+}
+
+void CacheHash::add(const void* data, size_t size)
+{
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for(size_t i = 0; i < size; ++i)
+  {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+}
+
+void CacheHash::add_mesh(const TriMesh* mesh)
+{
+  // Transforms are applied to the vertices when meshes are loaded
+  const IndexedFaceSet& geometry = mesh->geometry;
+  unsigned int no_of_vertices = geometry.no_vertices();
+  unsigned int no_of_faces = geometry.no_faces();
+  add(no_of_vertices);
+  add(no_of_faces);
+  if(no_of_vertices > 0)
+    add(&geometry.vertex(0), no_of_vertices*sizeof(CGLA::Vec3f));
+  if(no_of_faces > 0)
+    add(&geometry.face(0), no_of_faces*sizeof(CGLA::Vec3i));
+}
+
+string CacheHash::get_string() const
+{
+  ostringstream s;
+  s << hex << setw(16) << setfill('0') << h;
+  return s.str();
+}
+
+bool MappedFile::open(const string& filename)
+{
+  close();
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if(file == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER file_size;
+  HANDLE mapping = 0;
+  if(GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+    mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+  CloseHandle(file);
+  if(!mapping)
+    return false;
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if(!view)
+  {
+    CloseHandle(mapping);
+    return false;
+  }
+  data = static_cast<const char*>(view);
+  size = static_cast<size_t>(file_size.QuadPart);
+  handle = mapping;
+#else
+  int file = ::open(filename.c_str(), O_RDONLY);
+  if(file < 0)
+    return false;
+  struct stat file_stat;
+  void* view = MAP_FAILED;
+  if(fstat(file, &file_stat) == 0 && file_stat.st_size > 0)
+    view = mmap(0, file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  ::close(file);
+  if(view == MAP_FAILED)
+    return false;
+  data = static_cast<const char*>(view);
+  size = file_stat.st_size;
+#endif
+  return true;
+}
+
+void MappedFile::close()
+{
+  if(!data)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(data);
+  CloseHandle(static_cast<HANDLE>(handle));
+#else
+  munmap(const_cast<char*>(data), size);
+#endif
+  data = 0;
+  size = 0;
+  handle = 0;
+}
+
+bool load_accelerator(const string& filename, unsigned long long hash, Accelerator* acc,
+                      const vector<const Object3D*>& geometry, const vector<const Plane*>& planes)
+{
+  MappedFile file;
+  if(!file.open(filename))
+    return false;
+
+  CacheReader in(file.get_data(), file.get_size());
+  unsigned int magic, version;
+  unsigned long long file_hash;
+  if(!in.read(magic) || !in.read(version) || !in.read(file_hash))
+    return false;
+  if(magic != CACHE_MAGIC || version != ACC_CACHE_VERSION || file_hash != hash)
+    return false;
+  return acc->load(geometry, planes, in);
+}
+
+bool save_accelerator(const string& filename, unsigned long long hash, const Accelerator* acc)
+{
+  string temp_filename = get_temp_filename(filename);
+  {
+    ofstream out(temp_filename.c_str(), ios::binary);
+    if(!out)
+      return false;
+    CacheWriter writer(out);
+    writer.write(CACHE_MAGIC);
+    writer.write(ACC_CACHE_VERSION);
+    writer.write(hash);
+    acc->save(writer);
+    if(!out)
+    {
+      out.close();
+      remove(temp_filename.c_str());
+      return false;
+    }
+  }
+  return replace_file(temp_filename, filename);
+}
+
+string get_temp_filename(const string& filename)
+{
+#ifdef _WIN32
+  int pid = _getpid();
+#else
+  int pid = getpid();
+#endif
+  ostringstream s;
+  s << filename << "." << pid << ".tmp";
+  return s.str();
+}
+
+bool replace_file(const string& temp_filename, const string& filename)
+{
+#ifdef _WIN32
+  bool moved = MoveFileExA(temp_filename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  bool moved = rename(temp_filename.c_str(), filename.c_str()) == 0;
+#endif
+  if(!moved)
+    remove(temp_filename.c_str());
+  return moved;
+}
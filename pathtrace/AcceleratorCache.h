@@ -0,0 +1,136 @@
+// 02576 Rendering Framework
+// Binary files for keeping built acceleration structures between runs.
+// Copyright (c) DTU Compute 2013
+
+#ifndef ACCELERATORCACHE_H
+#define ACCELERATORCACHE_H
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstring>
+#include <cstddef>
+
+class TriMesh;
+class Object3D;
+class Plane;
+class Accelerator;
+
+// Increase when the layout of the stored structures changes
+const unsigned int ACC_CACHE_VERSION = 2;
+
+/// 64-bit FNV-1a hash of everything that determines the result of
+/// building an acceleration structure
+class CacheHash
+{
+public:
+  CacheHash() : h(14695981039346656037ULL) { }
+
+  void add(const void* data, size_t size);
+  template<class T> void add(const T& value) { add(&value, sizeof(T)); }
+  void add_mesh(const TriMesh* mesh);
+
+  unsigned long long get() const { return h; }
+  std::string get_string() const;
+
+private:
+  unsigned long long h;
+};
+
+/// Read-only memory mapping of a file
+class MappedFile
+{
+public:
+  MappedFile() : data(0), size(0), handle(0) { }
+  ~MappedFile() { close(); }
+
+  bool open(const std::string& filename);
+  void close();
+
+  const char* get_data() const { return data; }
+  size_t get_size() const { return size; }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const char* data;
+  size_t size;
+  void* handle;
+};
+
+/// Bounds checked reading of the values and arrays written by CacheWriter.
+/// All reads fail once one of them has failed.
+class CacheReader
+{
+public:
+  CacheReader(const char* data, size_t size) : pos(data), end(data + size) { }
+
+  template<class T> bool read(T& value)
+  {
+    if(!pos || static_cast<size_t>(end - pos) < sizeof(T))
+      return fail();
+    memcpy(&value, pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+
+  template<class T> bool read(std::vector<T>& values)
+  {
+    unsigned long long count;
+    unsigned int element_size;
+    if(!read(count) || !read(element_size) || element_size != sizeof(T) || count > (end - pos)/sizeof(T))
+      return fail();
+    values.resize(static_cast<size_t>(count));
+    if(count > 0)
+      memcpy(&values[0], pos, values.size()*sizeof(T));
+    pos += values.size()*sizeof(T);
+    return true;
+  }
+
+private:
+  bool fail() { pos = 0; return false; }
+
+  const char* pos;
+  const char* end;
+};
+
+/// Writes values and arrays of plain structures in binary form
+class CacheWriter
+{
+public:
+  CacheWriter(std::ostream& output) : out(output) { }
+
+  template<class T> void write(const T& value)
+  {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template<class T> void write(const std::vector<T>& values)
+  {
+    write(static_cast<unsigned long long>(values.size()));
+    write(static_cast<unsigned int>(sizeof(T)));
+    if(!values.empty())
+      out.write(reinterpret_cast<const char*>(&values[0]), values.size()*sizeof(T));
+  }
+
+private:
+  std::ostream& out;
+};
+
+// Restore an accelerator for the given geometry from a cache file. Returns
+// false if the file is missing, stale, or damaged. The accelerator must then
+// be initialized normally.
+bool load_accelerator(const std::string& filename, unsigned long long hash, Accelerator* acc,
+                      const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes);
+
+// Write the structure of a built accelerator to a cache file
+bool save_accelerator(const std::string& filename, unsigned long long hash, const Accelerator* acc);
+
+// Cache files are written to a temporary file whose name is unique to the
+// process and then moved into place, so that processes writing the same
+// entry never mix their output and readers never see a partial file.
+std::string get_temp_filename(const std::string& filename);
+bool replace_file(const std::string& temp_filename, const std::string& filename);
+
+#endif // ACCELERATORCACHE_H
@@ -93,7 +93,8 @@ bool AreaLight::sample(const Vec3f& pos, Vec3f& dir, Vec3f& L) const
   {
     Ray shadowRay(pos, dir);
     shadowRay.tmax = lightDistance - 0.1111f;
-    inShadow = tracer->trace(shadowRay);
+    shadowRay.type = ray_shadow;
+    inShadow = tracer->trace_shadow(shadowRay, get_occluder());
   }
 
   return !inShadow;
@@ -175,7 +176,8 @@ bool AreaLight::simpleSample(const Vec3f& pos, Vec3f& dir, Vec3f& L) const
   {
     Ray shadowRay(pos, dir);
     shadowRay.tmax = lightDistance - 0.1111f;
-    inShadow = tracer->trace(shadowRay);
+    shadowRay.type = ray_shadow;
+    inShadow = tracer->trace_shadow(shadowRay, get_occluder());
   }
 
   return !inShadow;
@@ -245,6 +247,7 @@ bool AreaLight::emit(Ray& r, Vec3f& Phi) const
   //r.direction = lightDirection / lightDistance;
   r.origin = lightPosition;
   r.direction = sample_cosine_weighted(lightNormal);
+  r.type = ray_photon;
 
   // Trace ray
   bool hit = tracer->trace(r);
@@ -0,0 +1,122 @@
+// 02576 Rendering Framework
+// Binned evaluation of the surface area heuristic for BVH builds.
+// Copyright (c) DTU Compute 2013
+
+#ifndef BINNEDSAH_H
+#define BINNEDSAH_H
+
+#include <algorithm>
+#include "CGLA/Vec3f.h"
+#include "AABB.h"
+#include "AccObj.h"
+
+const unsigned int SAH_BINS = 16;   // Number of bins per axis in SAH evaluation
+
+/// Objects whose centroid falls in a slab of the centroid bounds of a node
+struct SahBin
+{
+  SahBin() : count(0) { }
+
+  AABB bbox;
+  unsigned int count;
+};
+
+/// Best object partitioning among the bin boundaries of all three axes
+struct ObjectSplit
+{
+  ObjectSplit() : axis(-1), bin(0), cost(1.0e27f) { }
+
+  int axis;
+  unsigned int bin;
+  float cost;
+  AABB left_bbox, right_bbox;
+};
+
+// Predicate for partitioning objects according to the bin of their centroid
+struct InLeftBins
+{
+  InLeftBins(unsigned int split_axis, unsigned int split_bin, float bin_min, float bin_scale)
+    : axis(split_axis), bin(split_bin), c_min(bin_min), scale(bin_scale)
+  { }
+
+  bool operator()(const AccObj* obj) const
+  {
+    unsigned int b = static_cast<unsigned int>((obj->bbox.get_center()[axis] - c_min)*scale);
+    return std::min(b, SAH_BINS - 1) < bin;
+  }
+
+  unsigned int axis, bin;
+  float c_min, scale;
+};
+
+// Ordering of objects according to their centroid along an axis
+struct CentroidLess
+{
+  CentroidLess(unsigned int split_axis) : axis(split_axis) { }
+
+  bool operator()(const AccObj* a, const AccObj* b) const
+  {
+    return a->bbox.get_center()[axis] < b->bbox.get_center()[axis];
+  }
+
+  unsigned int axis;
+};
+
+// Add an object to the bins of the axes along which the centroids are spread out
+inline void add_to_bins(const AccObj* obj, const AABB& centroid_bbox, const CGLA::Vec3f& extent, SahBin bins[][SAH_BINS])
+{
+  CGLA::Vec3f c = obj->bbox.get_center();
+  for(unsigned int axis = 0; axis < 3; ++axis)
+  {
+    if(extent[axis] <= 0.0f)
+      continue;
+    unsigned int b = static_cast<unsigned int>((c[axis] - centroid_bbox.p_min[axis])*(SAH_BINS/extent[axis]));
+    b = std::min(b, SAH_BINS - 1);
+    ++bins[axis][b].count;
+    bins[axis][b].bbox.add_AABB(obj->bbox);
+  }
+}
+
+inline void find_object_split(const SahBin bins[][SAH_BINS], const CGLA::Vec3f& extent, ObjectSplit& split)
+{
+  for(unsigned int axis = 0; axis < 3; ++axis)
+  {
+    if(extent[axis] <= 0.0f)
+      continue;
+
+    // Sweep from the right to get bounds and counts for the right side of each split
+    AABB right_bbox[SAH_BINS];
+    unsigned int right_count[SAH_BINS];
+    unsigned int right_sum = 0;
+    for(unsigned int b = SAH_BINS - 1; b > 0; --b)
+    {
+      right_bbox[b] = bins[axis][b].bbox;
+      if(b < SAH_BINS - 1)
+        right_bbox[b].add_AABB(right_bbox[b + 1]);
+      right_sum += bins[axis][b].count;
+      right_count[b] = right_sum;
+    }
+
+    // Sweep from the left and evaluate the cost of splitting in front of bin b
+    AABB left_bbox;
+    unsigned int left_sum = 0;
+    for(unsigned int b = 1; b < SAH_BINS; ++b)
+    {
+      left_bbox.add_AABB(bins[axis][b - 1].bbox);
+      left_sum += bins[axis][b - 1].count;
+      if(left_sum == 0 || right_count[b] == 0)
+        continue;
+      float cost = left_sum*left_bbox.area() + right_count[b]*right_bbox[b].area();
+      if(cost < split.cost)
+      {
+        split.cost = cost;
+        split.axis = axis;
+        split.bin = b;
+        split.left_bbox = left_bbox;
+        split.right_bbox = right_bbox[b];
+      }
+    }
+  }
+}
+
+#endif // BINNEDSAH_H
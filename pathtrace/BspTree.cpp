@@ -5,79 +5,342 @@
 // Copyright (c) DTU Informatics 2011
 
 #include <vector>
+#include <algorithm>
 #include "Ray.h"
 #include "AccObj.h"
 #include "AABB.h"
+#include "CGLA/Vec3f.h"
+#include "CGLA/Vec3i.h"
 #include "TriMesh.h"
+#include "AcceleratorCache.h"
 #include "BspTree.h"
 
 using namespace std;
+using namespace CGLA;
 
 namespace
 {
   const float f_eps = 1.0e-6f;  
   const float d_eps = 1.0e-12f;
+  const unsigned int STACK_SIZE = 64;   // Traversal stack size (bounds the tree depth)
+
+  const float EMPTY_BONUS = 0.8f;         // Cost factor favouring splits that cut off empty space
+
+  struct StackEntry
+  {
+    unsigned int node;
+    float tmin, tmax;
+  };
+
+  enum ObjectSide { side_both, side_left, side_right };
+
+  struct EventLess
+  {
+    bool operator()(const SweepEvent& a, const SweepEvent& b) const
+    {
+      if(a.pos != b.pos)
+        return a.pos < b.pos;
+      if(a.axis != b.axis)
+        return a.axis < b.axis;
+      return a.type < b.type;
+    }
+  };
+
+  void add_events(vector<SweepEvent>& events, unsigned int obj, const AABB& bbox)
+  {
+    for(unsigned int axis = 0; axis < 3; ++axis)
+    {
+      SweepEvent e;
+      e.obj = obj;
+      e.axis = axis;
+      e.pos = bbox.p_min[axis];
+      if(bbox.p_min[axis] == bbox.p_max[axis])
+      {
+        e.type = sweep_planar;
+        events.push_back(e);
+        continue;
+      }
+      e.type = sweep_start;
+      events.push_back(e);
+      e.type = sweep_end;
+      e.pos = bbox.p_max[axis];
+      events.push_back(e);
+    }
+  }
+
+  // Cost of splitting a cell with the given numbers of objects on each side
+  float split_cost(const AABB& voxel, float inv_area, unsigned int axis, float pos, unsigned int left_count, unsigned int right_count)
+  {
+    CGLA::Vec3f extent = voxel.get_diagonal();
+    float cap_area = extent[(axis + 1)%3]*extent[(axis + 2)%3];
+    float perimeter = extent[(axis + 1)%3] + extent[(axis + 2)%3];
+    float left_area = 2.0f*(cap_area + (pos - voxel.p_min[axis])*perimeter);
+    float right_area = 2.0f*(cap_area + (voxel.p_max[axis] - pos)*perimeter);
+    float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST*inv_area*(left_area*left_count + right_area*right_count);
+    return left_count == 0 || right_count == 0 ? EMPTY_BONUS*cost : cost;
+  }
+
+  // Bounds of the part of a primitive inside a cell. Triangles of meshes
+  // are clipped exactly, other primitives by their bounding box.
+  class PrimitiveClipper
+  {
+  public:
+    PrimitiveClipper(const vector<AccObj*>& prims) : primitives(prims), last_object(0), last_mesh(0) { }
+
+    AABB operator()(unsigned int obj_idx, const AABB& voxel)
+    {
+      const AccObj* obj = primitives[obj_idx];
+      AABB bounds = obj->bbox;
+      bounds.intersect_AABB(voxel);
+      if(obj->geometry != last_object)
+      {
+        last_object = obj->geometry;
+        last_mesh = dynamic_cast<const TriMesh*>(last_object);
+      }
+      if(!last_mesh || bounds.is_empty())
+        return bounds;
+
+      // Clip the triangle against the six planes of the cell
+      const Vec3i& face = last_mesh->geometry.face(obj->prim_idx);
+      Vec3f polygon[2][9];
+      for(unsigned int i = 0; i < 3; ++i)
+        polygon[0][i] = last_mesh->geometry.vertex(face[i]);
+      unsigned int n = 3;
+      unsigned int current = 0;
+      for(unsigned int axis = 0; axis < 3; ++axis)
+        for(unsigned int side = 0; side < 2; ++side)
+        {
+          float d = side == 0 ? voxel.p_min[axis] : voxel.p_max[axis];
+          const Vec3f* in = polygon[current];
+          Vec3f* out = polygon[1 - current];
+          unsigned int m = 0;
+          for(unsigned int i = 0; i < n; ++i)
+          {
+            const Vec3f& p = in[i];
+            const Vec3f& q = in[(i + 1)%n];
+            bool p_inside = side == 0 ? p[axis] >= d : p[axis] <= d;
+            bool q_inside = side == 0 ? q[axis] >= d : q[axis] <= d;
+            if(p_inside)
+              out[m++] = p;
+            if(p_inside != q_inside)
+            {
+              Vec3f x = p + (q - p)*((d - p[axis])/(q[axis] - p[axis]));
+              x[axis] = d;
+              out[m++] = x;
+            }
+          }
+          n = m;
+          current = 1 - current;
+          if(n == 0)
+            return AABB();
+        }
+      AABB clipped;
+      for(unsigned int i = 0; i < n; ++i)
+        clipped.add_point(polygon[current][i]);
+      clipped.intersect_AABB(bounds);
+      return clipped;
+    }
+
+  private:
+    const vector<AccObj*>& primitives;
+    const Object3D* last_object;
+    const TriMesh* last_mesh;
+  };
 }
 
-BspTree::~BspTree()
+void BspTree::init(const vector<const Object3D*>& geometry, const std::vector<const Plane*>& scene_planes)
 {
-  delete_node(root);
+  nodes.clear();
+  add_primitives(geometry, scene_planes);
+  build();
 }
 
-void BspTree::init(const vector<const TriMesh*>& geometry, const std::vector<const Plane*>& scene_planes)
+void BspTree::refit()
 {
-  root = new BspNode;
-  Accelerator::init(geometry, scene_planes);
-  for(unsigned int i = 0; i < geometry.size(); ++i)
-    bbox.add_AABB(geometry[i]->compute_bbox());
-  vector<AccObj*> objects = primitives;
-  subdivide_node(*root, bbox, 0, objects);
+  // Split planes at fixed positions cannot follow the geometry, so the
+  // tree is rebuilt over the updated primitives
+  Accelerator::refit();
+  build();
 }
 
-bool BspTree::closest_hit(Ray& r) const
+float BspTree::get_sah_cost() const
 {
-  closest_plane(r);
-  intersect_node(r, *root);
-  if(r.has_hit)
-    r.hit_pos = r.origin + r.dist*r.direction;  
-  return r.has_hit;
+  if(nodes.empty())
+    return Accelerator::get_sah_cost();
+  return get_sah_cost(0, bbox)/bbox.area();
 }
 
-bool BspTree::any_hit(Ray& r) const
+size_t BspTree::get_memory_usage() const
 {
-  if(any_plane(r))
-    return true;
+  return Accelerator::get_memory_usage() + nodes.capacity()*sizeof(BspNode) + tree_objects.capacity()*sizeof(unsigned int);
+}
+
+void BspTree::save(CacheWriter& out) const
+{
+  out.write(bbox);
+  out.write(nodes);
+  out.write(tree_objects);
+}
+
+bool BspTree::load(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes, CacheReader& in)
+{
+  nodes.clear();
+  add_primitives(geometry, scene_planes);
+  if(!in.read(bbox) || !in.read(nodes) || !in.read(tree_objects))
+    return false;
+  for(unsigned int i = 0; i < tree_objects.size(); ++i)
+    if(tree_objects[i] >= primitives.size() && tree_objects[i] != NO_PRIMITIVE)
+      return false;
+  if(!check_nodes())
+    return false;
+  pack_leaves();
+  built_sah_cost = get_sah_cost();
+  return true;
+}
+
+bool BspTree::check_nodes() const
+{
+  // Nodes read from a cache file must form a tree that traversal can walk
+  // without leaving the arrays. Children follow their parent, so the walk
+  // ends, and a valid tree visits every node once. Built trees always have
+  // a root, which traversal reads without checking.
+  if(nodes.empty())
+    return false;
+  vector< pair<unsigned int, unsigned int> > stack(1, make_pair(0u, 0u));
+  unsigned int visited = 0;
+  while(!stack.empty())
+  {
+    unsigned int node_idx = stack.back().first;
+    unsigned int level = stack.back().second;
+    stack.pop_back();
+    if(++visited > nodes.size())
+      return false;
+    const BspNode& node = nodes[node_idx];
+    if(node.axis_leaf() == bsp_leaf)
+    {
+      if(node.id > tree_objects.size() || node.count() > tree_objects.size() - node.id)
+        return false;
+      continue;
+    }
+    unsigned int right = node.right_child();
+    if(level + 1 >= STACK_SIZE || right <= node_idx + 1 || right >= nodes.size())
+      return false;
+    stack.push_back(make_pair(node_idx + 1, level + 1));
+    stack.push_back(make_pair(right, level + 1));
+  }
+  return true;
+}
+
+void BspTree::build()
+{
+  bbox.reset();
+  for(unsigned int i = 0; i < primitives.size(); ++i)
+    bbox.add_AABB(primitives[i]->bbox);
+  max_level = min(max_level, STACK_SIZE - 1);
+  nodes.clear();
+  tree_objects.clear();
+  nodes.push_back(BspNode());
+
+  // The objects or events of the nodes on the path being built are kept in
+  // one stack, so building does not allocate memory for every node
+  if(event_sweep)
+  {
+    // Events are sorted once here and kept sorted when they are
+    // distributed to the children
+    build_events.reserve(12*primitives.size());
+    for(unsigned int i = 0; i < primitives.size(); ++i)
+      add_events(build_events, i, primitives[i]->bbox);
+    sort(build_events.begin(), build_events.end(), EventLess());
+    object_side.resize(primitives.size());
+    subdivide_sweep(0, bbox, 0, 0, build_events.size(), primitives.size());
+    vector<unsigned char>().swap(object_side);
+    vector<SweepEvent>().swap(build_events);
+    vector<SweepEvent>().swap(side_events);
+    vector<SweepEvent>().swap(split_events[0]);
+    vector<SweepEvent>().swap(split_events[1]);
+  }
   else
-    return intersect_node(r, *root);
+  {
+    build_objects.reserve(2*primitives.size());
+    build_objects.resize(primitives.size());
+    for(unsigned int i = 0; i < primitives.size(); ++i)
+      build_objects[i] = i;
+    subdivide_node(0, bbox, 0, 0, primitives.size());
+    vector<unsigned int>().swap(build_objects);
+  }
+  pack_leaves();
+  built_sah_cost = get_sah_cost();
+}
+
+void BspTree::begin_leaf(unsigned int node_idx, unsigned int count)
+{
+  if(count > 0)
+    tree_objects.resize((tree_objects.size() + 3) & ~3u, NO_PRIMITIVE);
+  nodes[node_idx].init_leaf(tree_objects.size(), count);
+}
+
+void BspTree::pack_leaves()
+{
+  // Objects referenced by several leaves are stored once for each
+  vector<AccObj*> leaf_objects(tree_objects.size(), static_cast<AccObj*>(0));
+  for(unsigned int i = 0; i < tree_objects.size(); ++i)
+    if(tree_objects[i] != NO_PRIMITIVE)
+      leaf_objects[i] = primitives[tree_objects[i]];
+  triangles.build(leaf_objects);
+}
+
+float BspTree::get_sah_cost(unsigned int node_idx, const AABB& node_bbox) const
+{
+  const BspNode& node = nodes[node_idx];
+  BspNodeType axis = node.axis_leaf();
+  if(axis == bsp_leaf)
+    return SAH_INTERSECTION_COST*node.count()*node_bbox.area();
+
+  // Planes placed next to the objects of a cell may lie outside it
+  float plane = min(max(node.plane, node_bbox.p_min[axis]), node_bbox.p_max[axis]);
+  AABB left_bbox = node_bbox;
+  AABB right_bbox = node_bbox;
+  left_bbox.p_max[axis] = plane;
+  right_bbox.p_min[axis] = plane;
+  return SAH_TRAVERSAL_COST*node_bbox.area() 
+         + get_sah_cost(node_idx + 1, left_bbox) + get_sah_cost(node.right_child(), right_bbox);
 }
 
-void BspTree::subdivide_node(BspNode& node, AABB& bbox, unsigned int level, vector<AccObj*>& objects) 
+bool BspTree::closest_primitive(Ray& r, unsigned int& hit_idx) const
+{
+  return intersect_nodes(r, false, hit_idx);
+}
+
+bool BspTree::occluded(const Ray& r, unsigned int* occluder) const
+{
+  if(any_plane(r) || hits_occluder(r, occluder))
+    return true;
+  // The traversal records hits in the ray and therefore works on a copy
+  Ray tmp = r;
+  unsigned int hit_idx;
+  if(!intersect_nodes(tmp, true, hit_idx))
+    return false;
+  if(occluder)
+    *occluder = hit_idx;
+  return true;
+}
+
+void BspTree::subdivide_node(unsigned int node_idx, AABB& bbox, unsigned int level, unsigned int first, unsigned int count) 
 {
   const int TESTS = 4;
   
-  if(objects.size() <= max_objects || level == max_level) 
+  // The objects of the node are build_objects[first, first + count)
+  if(count <= max_objects || level == max_level) 
   {
-    node.axis_leaf = bsp_leaf; // Means that this is a leaf
-    node.id = tree_objects.size();
-    node.count = objects.size();
-    
-    tree_objects.resize(tree_objects.size() + objects.size());
-    for(unsigned int i = 0; i < objects.size(); ++i) 
-      tree_objects[node.id + i] = objects[i];
+    begin_leaf(node_idx, count);
+    tree_objects.insert(tree_objects.end(), build_objects.begin() + first, build_objects.begin() + first + count);
   } 
   else 
   {
     bool right_zero=false;
     bool left_zero=false;
     unsigned int i;
-    BspNode* left_node  = new BspNode;
-    BspNode* right_node = new BspNode;
-    vector<AccObj*> left_objects;
-    vector<AccObj*> right_objects;
     
-    node.left = left_node;
-    node.right = right_node;
-
     int new_axis = -1;
     double min_cost = 1.0e27;
     int new_pos = -1;      
@@ -92,7 +355,6 @@ void BspTree::subdivide_node(BspNode& node, AABB& bbox, unsigned int level, vect
         float max_corner = bbox.p_max[i];
         float min_corner = bbox.p_min[i];
         float center = (max_corner - min_corner)*k/static_cast<float>(TESTS) + min_corner;
-        node.plane = center;
         
         left_bbox.p_max[i] = center; 
         right_bbox.p_min[i] = center; 
@@ -100,9 +362,9 @@ void BspTree::subdivide_node(BspNode& node, AABB& bbox, unsigned int level, vect
         // Try putting the triangles in the left and right boxes
         int left_count = 0;
         int right_count = 0;
-        for(unsigned int j = 0; j < objects.size(); ++j) 
+        for(unsigned int j = 0; j < count; ++j) 
         {
-          AccObj* obj = objects[j];
+          const AccObj* obj = primitives[build_objects[first + j]];
           left_count += left_bbox.intersects(obj->bbox);
           right_count += right_bbox.intersects(obj->bbox);
         }
@@ -118,16 +380,14 @@ void BspTree::subdivide_node(BspNode& node, AABB& bbox, unsigned int level, vect
         }
       }
     }
-    node.axis_leaf = static_cast<BspNodeType>(new_axis);
-    left_node->axis_leaf = static_cast<BspNodeType>(-1); 
-    right_node->axis_leaf = static_cast<BspNodeType>(-1); 
+    BspNodeType axis = static_cast<BspNodeType>(new_axis);
 
     // Now chose the right splitting plane
     AABB left_bbox = bbox;
     AABB right_bbox = bbox;
 
-    float max_corner = bbox.p_max[node.axis_leaf];
-    float min_corner = bbox.p_min[node.axis_leaf];
+    float max_corner = bbox.p_max[axis];
+    float min_corner = bbox.p_min[axis];
     float size = max_corner - min_corner;
     float center = size*new_pos/static_cast<float>(TESTS) + min_corner;
     float diff = f_eps < size/8.0f ? size/8.0f : f_eps;
@@ -136,10 +396,10 @@ void BspTree::subdivide_node(BspNode& node, AABB& bbox, unsigned int level, vect
     {
       // Find min position of all triangle vertices and place the center there
       center = max_corner;
-      for(unsigned int j = 0; j < objects.size(); ++j) 
+      for(unsigned int j = 0; j < count; ++j) 
       {
-        AccObj* obj = objects[j];
-        float obj_min_corner = obj->bbox.p_min[node.axis_leaf];
+        const AccObj* obj = primitives[build_objects[first + j]];
+        float obj_min_corner = obj->bbox.p_min[axis];
         if(obj_min_corner < center)
           center = obj_min_corner;
       }
@@ -149,106 +409,363 @@ void BspTree::subdivide_node(BspNode& node, AABB& bbox, unsigned int level, vect
     {
       // Find max position of all triangle vertices and place the center there
       center = min_corner;
-      for(unsigned int j=0;j<objects.size();j++) 
+      for(unsigned int j = 0; j < count; ++j) 
       {
-        AccObj* obj = objects[j];
-        float obj_max_corner = obj->bbox.p_max[node.axis_leaf];
+        const AccObj* obj = primitives[build_objects[first + j]];
+        float obj_max_corner = obj->bbox.p_max[axis];
         if (obj_max_corner > center)
           center = obj_max_corner;
       }
       center += diff;
     }
 
-    node.plane = center;
-    left_bbox.p_max[node.axis_leaf] = center; 
-    right_bbox.p_min[node.axis_leaf] = center; 
+    nodes[node_idx].init_interior(axis, center);
+    left_bbox.p_max[axis] = center; 
+    right_bbox.p_min[axis] = center; 
           
-    // Now put the triangles in the right and left node
-    for(i = 0; i < objects.size(); ++i) 
-    {
-      AccObj* obj = objects[i];
-      if(left_bbox.intersects(obj->bbox)) 
-        left_objects.push_back(obj);
-      if(right_bbox.intersects(obj->bbox)) 
-        right_objects.push_back(obj);
+    // Now put the triangles of the left and then the right node on top
+    // of the build stack, where they stay until both subtrees are built
+    unsigned int left_first = build_objects.size();
+    for(i = 0; i < count; ++i) 
+    {
+      unsigned int obj_idx = build_objects[first + i];
+      if(left_bbox.intersects(primitives[obj_idx]->bbox)) 
+        build_objects.push_back(obj_idx);
     }
+    unsigned int right_first = build_objects.size();
+    for(i = 0; i < count; ++i) 
+    {
+      unsigned int obj_idx = build_objects[first + i];
+      if(right_bbox.intersects(primitives[obj_idx]->bbox)) 
+        build_objects.push_back(obj_idx);
+    }
+    unsigned int right_last = build_objects.size();
   //if (left_zero||right_zero)
-  //  cout << left_objects.size() << "," << right_objects.size() << "," << level << endl;
+  //  cout << right_first - left_first << "," << right_last - right_first << "," << level << endl;
 
-    objects.clear();
-    subdivide_node(*left_node, left_bbox, level + 1, left_objects);
-    subdivide_node(*right_node, right_bbox, level + 1, right_objects);
+    // The left child follows its parent in the node array
+    unsigned int left_idx = nodes.size();
+    nodes.push_back(BspNode());
+    subdivide_node(left_idx, left_bbox, level + 1, left_first, right_first - left_first);
+    unsigned int right_idx = nodes.size();
+    nodes.push_back(BspNode());
+    nodes[node_idx].set_right_child(right_idx);
+    subdivide_node(right_idx, right_bbox, level + 1, right_first, right_last - right_first);
+    build_objects.resize(left_first);
   }
 }
 
-bool BspTree::intersect_node(Ray& ray, const BspNode& node) const 
+void BspTree::subdivide_sweep(unsigned int node_idx, const AABB& voxel, unsigned int level, unsigned int first, unsigned int size, unsigned int count)
 {
-  if(node.axis_leaf == bsp_leaf) 
+  // The events of the node are build_events[first, first + size). They are
+  // read through a pointer until events are added to the build stack.
+  const SweepEvent* events = &build_events[first];
+
+  // Sweep the events of all three axes, keeping the number of objects to
+  // the left of, in, and to the right of the candidate plane on each axis
+  float area = voxel.area();
+  float best_cost = SAH_INTERSECTION_COST*count;
+  int best_axis = -1;
+  float best_pos = 0.0f;
+  bool planar_left = false;
+  if(level < max_level && count > 0 && area > 0.0f)
   {
-    bool found = false; 
-    for(unsigned int i = 0; i < node.count; ++i) 
+    float inv_area = 1.0f/area;
+    unsigned int left_count[3] = { 0, 0, 0 };
+    unsigned int right_count[3] = { count, count, count };
+    for(unsigned int i = 0; i < size; )
     {
-      const AccObj* obj = tree_objects[node.id + i];
-      if(obj->geometry->intersect(ray, obj->prim_idx))
+      unsigned int axis = events[i].axis;
+      float pos = events[i].pos;
+      unsigned int ending = 0, planar = 0, starting = 0;
+      while(i < size && events[i].axis == axis && events[i].pos == pos && events[i].type == sweep_end)
+        ++ending, ++i;
+      while(i < size && events[i].axis == axis && events[i].pos == pos && events[i].type == sweep_planar)
+        ++planar, ++i;
+      while(i < size && events[i].axis == axis && events[i].pos == pos && events[i].type == sweep_start)
+        ++starting, ++i;
+
+      right_count[axis] -= planar + ending;
+      if(pos > voxel.p_min[axis] && pos < voxel.p_max[axis])
       {
-        ray.tmax = ray.dist;
-        found = true;
+        // Objects in the plane go to the side where they cost the least
+        float cost_left = split_cost(voxel, inv_area, axis, pos, left_count[axis] + planar, right_count[axis]);
+        float cost_right = split_cost(voxel, inv_area, axis, pos, left_count[axis], right_count[axis] + planar);
+        if(cost_left < best_cost || cost_right < best_cost)
+        {
+          best_cost = min(cost_left, cost_right);
+          best_axis = axis;
+          best_pos = pos;
+          planar_left = cost_left < cost_right;
+        }
       }
+      left_count[axis] += starting + planar;
     }
-    return found;
-  } 
-  else 
+  }
+
+  if(best_axis < 0)
   {
-    BspNode *near_node;
-    BspNode *far_node;
-    float axis_direction = ray.direction[node.axis_leaf];
-    float axis_origin = ray.origin[node.axis_leaf];
-    if(axis_direction >= 0.0f) 
-    {
-      near_node = node.left;
-      far_node = node.right;
-    } 
-    else 
+    // Every object has a start or planar event on each axis
+    begin_leaf(node_idx, count);
+    for(unsigned int i = 0; i < size; ++i)
+      if(events[i].axis == 0 && events[i].type != sweep_end)
+        tree_objects.push_back(events[i].obj);
+    return;
+  }
+
+  // Classify the objects by their events on the split axis
+  unsigned int axis = best_axis;
+  for(unsigned int i = 0; i < size; ++i)
+    if(events[i].axis == axis && events[i].type != sweep_end)
+      object_side[events[i].obj] = side_both;
+  for(unsigned int i = 0; i < size; ++i)
+  {
+    const SweepEvent& e = events[i];
+    if(e.axis != axis)
+      continue;
+    if(e.type == sweep_end && e.pos <= best_pos)
+      object_side[e.obj] = side_left;
+    else if(e.type == sweep_start && e.pos >= best_pos)
+      object_side[e.obj] = side_right;
+    else if(e.type == sweep_planar)
     {
-      near_node = node.right;
-      far_node = node.left;
+      if(e.pos < best_pos || (e.pos == best_pos && planar_left))
+        object_side[e.obj] = side_left;
+      else
+        object_side[e.obj] = side_right;
     }
+  }
 
-    // In order to avoid instability
-    float t;
-    if(fabs(axis_direction) < d_eps)
-      t = (node.plane - axis_origin)/d_eps; // intersect node plane;
+  // Events of objects on one side stay sorted. Objects on both sides get
+  // new events from their parts in each cell, which are sorted and merged
+  // in. The events of the left and then the right cell are put on top of
+  // the build stack, and the scratch lists keep their memory between nodes.
+  AABB left_voxel = voxel;
+  AABB right_voxel = voxel;
+  left_voxel.p_max[axis] = best_pos;
+  right_voxel.p_min[axis] = best_pos;
+  PrimitiveClipper clip(primitives);
+  split_events[0].clear();
+  split_events[1].clear();
+  unsigned int left_count = 0, right_count = 0;
+  for(unsigned int i = 0; i < size; ++i)
+  {
+    const SweepEvent& e = events[i];
+    if(e.axis != axis || e.type == sweep_end)
+      continue;
+    unsigned char side = object_side[e.obj];
+    if(side == side_left)
+      ++left_count;
+    else if(side == side_right)
+      ++right_count;
     else
-      t = (node.plane - axis_origin)/axis_direction; // intersect node plane;
-    
-    if(t > ray.tmax) 
-      return intersect_node(ray, *near_node);      
-    else if(t < ray.tmin) 
-      return intersect_node(ray, *far_node);
-    else 
     {
-      float t_max = ray.tmax;
-      ray.tmax = t;
-      if(intersect_node(ray, *near_node))
+      AABB left_part = clip(e.obj, left_voxel);
+      AABB right_part = clip(e.obj, right_voxel);
+      if(left_part.is_empty() && right_part.is_empty())
+      {
+        // Clipping lost the object to rounding, so keep it on both sides
+        left_part = right_part = primitives[e.obj]->bbox;
+        left_part.intersect_AABB(left_voxel);
+        right_part.intersect_AABB(right_voxel);
+      }
+      if(!left_part.is_empty())
+      {
+        add_events(split_events[0], e.obj, left_part);
+        ++left_count;
+      }
+      if(!right_part.is_empty())
+      {
+        add_events(split_events[1], e.obj, right_part);
+        ++right_count;
+      }
+    }
+  }
+  unsigned int child_first[2], child_size[2];
+  for(unsigned int k = 0; k < 2; ++k)
+  {
+    unsigned char side = k == 0 ? side_left : side_right;
+    side_events.clear();
+    for(unsigned int i = 0; i < size; ++i)
+      if(object_side[build_events[first + i].obj] == side)
+        side_events.push_back(build_events[first + i]);
+    sort(split_events[k].begin(), split_events[k].end(), EventLess());
+    child_first[k] = build_events.size();
+    child_size[k] = side_events.size() + split_events[k].size();
+    build_events.resize(child_first[k] + child_size[k]);
+    merge(side_events.begin(), side_events.end(), split_events[k].begin(), split_events[k].end(), 
+          build_events.begin() + child_first[k], EventLess());
+  }
+
+  // The left child follows its parent in the node array
+  nodes[node_idx].init_interior(static_cast<BspNodeType>(axis), best_pos);
+  unsigned int left_idx = nodes.size();
+  nodes.push_back(BspNode());
+  subdivide_sweep(left_idx, left_voxel, level + 1, child_first[0], child_size[0], left_count);
+  unsigned int right_idx = nodes.size();
+  nodes.push_back(BspNode());
+  nodes[node_idx].set_right_child(right_idx);
+  subdivide_sweep(right_idx, right_voxel, level + 1, child_first[1], child_size[1], right_count);
+  build_events.resize(child_first[0]);
+}
+
+bool BspTree::intersect_nodes(Ray& ray, bool stop_at_any_hit, unsigned int& hit_idx) const 
+{
+  // Leaves accept hits anywhere along the ray, so an object referenced by
+  // several leaves only needs to be tested in the first of them. The
+  // closest hit is known once it lies within the cell being visited.
+  BspMailbox* mailbox = get_mailbox();
+  if(mailbox)
+    mailbox->begin_ray();
+  StackEntry stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  unsigned int node_idx = 0;
+  float t_min = ray.tmin;
+  float t_max = ray.tmax;
+  bool found = false;
+  for(;;)
+  {
+    const BspNode& node = nodes[node_idx];
+    BspNodeType axis = node.axis_leaf();
+    if(axis == bsp_leaf) 
+    {
+      // The objects of the leaf are tested a block of four at a time
+      unsigned int end = node.id + node.count();
+      for(unsigned int first = node.id; first < end; first += 4) 
+      {
+        unsigned int lanes = 0;
+        for(unsigned int k = 0; k < 4 && first + k < end; ++k)
+          if(!mailbox || !mailbox->visited(tree_objects[first + k]))
+            lanes |= 1u << k;
+        if(triangles.intersect_block(ray, first >> 2, lanes, hit_idx))
+        {
+          found = true;
+          if(stop_at_any_hit)
+            return true;
+        }
+      }
+      if(found && ray.tmax <= t_max)
+        return true;
+      if(stack_size == 0)
+        return found;
+      --stack_size;
+      node_idx = stack[stack_size].node;
+      t_min = stack[stack_size].tmin;
+      t_max = stack[stack_size].tmax;
+      if(found && ray.tmax < t_min)
         return true;
+    } 
+    else 
+    {
+      unsigned int near_node;
+      unsigned int far_node;
+      float axis_direction = ray.direction[axis];
+      float axis_origin = ray.origin[axis];
+      if(axis_direction >= 0.0f) 
+      {
+        near_node = node_idx + 1;
+        far_node = node.right_child();
+      } 
+      else 
+      {
+        near_node = node.right_child();
+        far_node = node_idx + 1;
+      }
+
+      // In order to avoid instability
+      float t;
+      if(fabs(axis_direction) < d_eps)
+        t = (node.plane - axis_origin)/d_eps; // intersect node plane;
       else
+        t = (node.plane - axis_origin)/axis_direction; // intersect node plane;
+    
+      if(t > t_max) 
+        node_idx = near_node;
+      else if(t < t_min) 
+        node_idx = far_node;
+      else 
       {
-        ray.tmin = t;
-        ray.tmax = t_max;
-        return intersect_node(ray, *far_node);
+        // Visit the near cell first and remember the far cell
+        stack[stack_size].node = far_node;
+        stack[stack_size].tmin = t;
+        stack[stack_size].tmax = t_max;
+        ++stack_size;
+        node_idx = near_node;
+        t_max = t;
       }
     }
   }
 }
 
-void BspTree::delete_node(BspNode *node) 
+void BspTree::collect_hits(const Ray& r, HitList& hits) const
 {
-  if(node)
+  // Cells are visited front to back and objects are tested for hits along
+  // the whole ray, so the search ends with the first cell reaching past
+  // the end of the list
+  if(nodes.empty())
+    return;
+  BspMailbox* mailbox = get_mailbox();
+  if(mailbox)
+    mailbox->begin_ray();
+  StackEntry stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  unsigned int node_idx = 0;
+  float t_min = r.tmin;
+  float t_max = r.tmax;
+  for(;;)
   {
-    if(node->left)
-      delete_node(node->left);
-    if(node->right)
-      delete_node(node->right);
-    delete node;
+    const BspNode& node = nodes[node_idx];
+    BspNodeType axis = node.axis_leaf();
+    if(axis == bsp_leaf)
+    {
+      for(unsigned int i = node.id; i < node.id + node.count(); ++i)
+      {
+        if(mailbox && mailbox->visited(tree_objects[i]))
+          continue;
+        triangles.add_hits(r, i, hits);
+      }
+      if(hits.get_tmax() <= t_max || stack_size == 0)
+        return;
+      --stack_size;
+      node_idx = stack[stack_size].node;
+      t_min = stack[stack_size].tmin;
+      t_max = stack[stack_size].tmax;
+      if(hits.get_tmax() < t_min)
+        return;
+    }
+    else
+    {
+      unsigned int near_node;
+      unsigned int far_node;
+      if(r.direction[axis] >= 0.0f)
+      {
+        near_node = node_idx + 1;
+        far_node = node.right_child();
+      }
+      else
+      {
+        near_node = node.right_child();
+        far_node = node_idx + 1;
+      }
+      float t;
+      if(fabs(r.direction[axis]) < d_eps)
+        t = (node.plane - r.origin[axis])/d_eps;
+      else
+        t = (node.plane - r.origin[axis])/r.direction[axis];
+
+      if(t > t_max)
+        node_idx = near_node;
+      else if(t < t_min)
+        node_idx = far_node;
+      else
+      {
+        stack[stack_size].node = far_node;
+        stack[stack_size].tmin = t;
+        stack[stack_size].tmax = t_max;
+        ++stack_size;
+        node_idx = near_node;
+        t_max = t;
+      }
+    }
   }
 }
@@ -7,49 +7,146 @@
 #define BSPTREE_H
 
 #include <vector>
+#include <algorithm>
 #include "Ray.h"
 #include "AccObj.h"
 #include "TriMesh.h"
 #include "AABB.h"
 #include "Plane.h"
 #include "Accelerator.h"
+#include "Threads.h"
 
 enum BspNodeType { bsp_x_axis, bsp_y_axis, bsp_z_axis, bsp_leaf };
 
+// Nodes are stored in a linear array in depth-first order. The left child of
+// an interior node is the following node, the index of the right child is
+// kept in the upper bits of the flags.
 struct BspNode 
 {
-  BspNode() : left(0), right(0) { }
-
-  BspNodeType axis_leaf; // 00 = axis 0, 01 = axis 1, 10 = axis 2, 11 = leaf
-  float plane;
-  BspNode *left, *right;
-  unsigned int id;
-  unsigned int count;
-  unsigned int ref;
+  void init_leaf(unsigned int first, unsigned int count) { id = first; flags = (count << 2) | bsp_leaf; }
+  void init_interior(BspNodeType axis, float split) { plane = split; flags = axis; }
+  void set_right_child(unsigned int idx) { flags |= idx << 2; }
+
+  BspNodeType axis_leaf() const { return static_cast<BspNodeType>(flags & 3); }
+  unsigned int count() const { return flags >> 2; }
+  unsigned int right_child() const { return flags >> 2; }
+
+  union
+  {
+    float plane;        // position of the split plane (interior nodes)
+    unsigned int id;    // offset of the first object in tree_objects and the triangle store (leaves)
+  };
+  unsigned int flags;   // 00 = axis 0, 01 = axis 1, 10 = axis 2, 11 = leaf, upper 30 bits: count or right child
+};
+
+// Candidate split planes of the sweep builder. At equal positions, ending
+// objects come before objects lying in the plane and starting objects.
+enum SweepEventType { sweep_end, sweep_planar, sweep_start };
+
+struct SweepEvent
+{
+  float pos;
+  unsigned int obj;
+  unsigned short axis;
+  unsigned short type;
+};
+
+/// Primitives tested by the current ray of a thread, stored by ray ID in a
+/// small direct-mapped table. The trailing cache line of padding keeps the
+/// mailboxes of two threads out of any one line.
+struct BspMailbox
+{
+  enum { SIZE = 64 };
+
+  BspMailbox() : ray_id(0)
+  {
+    std::fill(ids, ids + SIZE, 0u);
+    std::fill(prims, prims + SIZE, 0u);
+  }
+
+  void begin_ray()
+  {
+    if(++ray_id == 0)
+    {
+      std::fill(ids, ids + SIZE, 0u);
+      ray_id = 1;
+    }
+  }
+
+  // True if the primitive was already tested by the current ray
+  bool visited(unsigned int prim)
+  {
+    unsigned int slot = prim & (SIZE - 1);
+    if(ids[slot] == ray_id && prims[slot] == prim)
+      return true;
+    ids[slot] = ray_id;
+    prims[slot] = prim;
+    return false;
+  }
+
+  unsigned int ray_id;
+  unsigned int ids[SIZE];
+  unsigned int prims[SIZE];
+  char padding[CACHE_LINE_SIZE];
 };
 
 class BspTree : public Accelerator
 {
 public:
   BspTree(unsigned int max_objects_in_leaf = 4, unsigned int max_levels_in_tree = 20) 
-    : root(0), max_objects(max_objects_in_leaf), max_level(max_levels_in_tree) 
+    : max_objects(max_objects_in_leaf), max_level(max_levels_in_tree), event_sweep(false), mailboxes(get_max_threads())
   { }
 
-  virtual ~BspTree();
-  virtual void init(const std::vector<const TriMesh*>& geometry, const std::vector<const Plane*>& planes);
-  virtual bool closest_hit(Ray& r) const;
-  virtual bool any_hit(Ray& r) const;
+  // Build by sweeping the SAH over every primitive boundary (O(N log N))
+  // instead of testing three planes per axis. Straddling triangles are
+  // clipped to the cells, and leaves are made where splitting does not pay
+  // off, so the level limit only bounds the depth.
+  void enable_event_sweep() { event_sweep = true; }
+
+  virtual void init(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes);
+  virtual bool closest_primitive(Ray& r, unsigned int& hit_idx) const;
+  virtual bool occluded(const Ray& r, unsigned int* occluder = 0) const;
+  virtual void refit();
+  virtual float get_sah_cost() const;
+  virtual size_t get_memory_usage() const;
+  virtual void save(CacheWriter& out) const;
+  virtual bool load(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes, CacheReader& in);
 
 private:
-  void subdivide_node(BspNode& node, AABB& bbox, unsigned int level, std::vector<AccObj*>& objects);
-  bool intersect_node(Ray& ray, const BspNode& node) const;
-  void delete_node(BspNode *node);
+  void build();
+  void begin_leaf(unsigned int node_idx, unsigned int count);
+  void pack_leaves();
+  bool check_nodes() const;
+  float get_sah_cost(unsigned int node_idx, const AABB& node_bbox) const;
+  void subdivide_node(unsigned int node_idx, AABB& bbox, unsigned int level, unsigned int first, unsigned int count);
+  void subdivide_sweep(unsigned int node_idx, const AABB& voxel, unsigned int level, unsigned int first, unsigned int size, unsigned int count);
+  bool intersect_nodes(Ray& r, bool stop_at_any_hit, unsigned int& hit_idx) const;
+  virtual void collect_hits(const Ray& r, HitList& hits) const;
 
-  std::vector<AccObj*> tree_objects;
-  BspNode* root;
+  // Mailbox of the calling thread
+  BspMailbox* get_mailbox() const
+  {
+    unsigned int thread = get_thread_num();
+    return thread < mailboxes.size() ? &mailboxes[thread] : 0;
+  }
+
+  // The objects of each leaf start at a block boundary of the triangle
+  // store, which holds them in the same order. Unused slots are
+  // NO_PRIMITIVE.
+  std::vector<BspNode> nodes;
+  std::vector<unsigned int> tree_objects;
   AABB bbox;
   unsigned int max_objects;
   unsigned int max_level;
+  bool event_sweep;
+
+  // Build stacks and scratch lists, released after building
+  std::vector<unsigned int> build_objects;
+  std::vector<SweepEvent> build_events;
+  std::vector<SweepEvent> side_events;
+  std::vector<SweepEvent> split_events[2];
+  std::vector<unsigned char> object_side;   // classification of objects while building
+  mutable std::vector<BspMailbox> mailboxes;
 };
 
 #endif // BSPTREE_H
\ No newline at end of file
@@ -0,0 +1,674 @@
+// 02576 Rendering Framework
+// Four-wide bounding volume hierarchy collapsed from a binary BVH.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "CGLA/CGLA.h"
+#include "CGLA/Vec3f.h"
+#include "Ray.h"
+#include "AccObj.h"
+#include "AABB.h"
+#include "AcceleratorCache.h"
+#include "BvhTree.h"
+#include "Simd.h"
+#include "Bvh4Tree.h"
+
+#ifdef _OPENMP
+  #if _OPENMP >= 200805
+    #define BVH_PARALLEL_BUILD   // OpenMP 3.0 tasks are available
+  #endif
+#endif
+
+using namespace std;
+using namespace CGLA;
+
+namespace
+{
+  const unsigned int STACK_SIZE = 256;   // Traversal stack size (three entries per level plus one)
+  const unsigned int TASK_LEVELS = 4;    // Number of levels below the root where refitting spawns tasks
+
+  struct StackEntry
+  {
+    unsigned int idx;     // wide node index, or first object of a leaf
+    unsigned int count;   // number of objects in a leaf, 0 for wide nodes
+    float t;              // distance at which the ray enters the bounds
+  };
+
+  struct PacketStackEntry
+  {
+    unsigned int idx;       // wide node index, or first object of a leaf
+    unsigned int count;     // number of objects in a leaf, 0 for wide nodes
+    unsigned int ray_mask;  // rays of the packet that hit the bounds
+    float t;                // nearest distance at which one of the rays enters the bounds
+  };
+
+  inline AABB get_child_bbox(const Bvh4Node& node, unsigned int c)
+  {
+    return AABB(Vec3f(node.bounds[0][0][c], node.bounds[0][1][c], node.bounds[0][2][c]),
+                Vec3f(node.bounds[1][0][c], node.bounds[1][1][c], node.bounds[1][2][c]));
+  }
+
+  inline void set_child_bbox(Bvh4Node& node, unsigned int c, const AABB& bbox)
+  {
+    for(unsigned int i = 0; i < 3; ++i)
+    {
+      node.bounds[0][i][c] = bbox.p_min[i];
+      node.bounds[1][i][c] = bbox.p_max[i];
+    }
+  }
+
+  // Test the ray against the bounds of all children of a node at once. Returns
+  // a bit mask with the children that were hit and stores their entry distances.
+  inline unsigned int intersect_children(const Bvh4Node& node, const RayBoxData& ray, float tmin, float tmax, float t_near[4])
+  {
+    return intersect_boxes(node.bounds, ray, tmin, tmax, t_near) & ((1u << node.no_of_children) - 1);
+  }
+
+  // Intervals containing the origins, reciprocal directions, and distance
+  // ranges of all rays in a packet. Interval arithmetic on these gives a
+  // conservative slab test that rejects boxes missed by the whole packet.
+  struct PacketBoxData
+  {
+    // Returns false if the rays do not share direction signs, as the
+    // intervals are then unbounded and cannot be used for culling
+    bool set(const RayBoxData* rays, const RayPacket& packet)
+    {
+      tmin = BIG;
+      tmax = 0.0f;
+      for(unsigned int i = 0; i < 3; ++i)
+      {
+        origin_min[i] = inv_dir_min[i] = BIG;
+        origin_max[i] = inv_dir_max[i] = -BIG;
+        near_side[i] = rays[0].near_side[i];
+      }
+      for(unsigned int k = 0; k < packet.size; ++k)
+      {
+        const RayBoxData& ray = rays[k];
+        for(unsigned int i = 0; i < 3; ++i)
+        {
+          if(ray.near_side[i] != near_side[i] || !(fabs(ray.inv_dir[i]) < BIG))
+            return false;
+          origin_min[i] = min(origin_min[i], ray.origin[i]);
+          origin_max[i] = max(origin_max[i], ray.origin[i]);
+          inv_dir_min[i] = min(inv_dir_min[i], ray.inv_dir[i]);
+          inv_dir_max[i] = max(inv_dir_max[i], ray.inv_dir[i]);
+        }
+        tmin = min(tmin, packet.rays[k].tmin);
+      }
+      return true;
+    }
+
+    float origin_min[3], origin_max[3];
+    float inv_dir_min[3], inv_dir_max[3];
+    unsigned int near_side[3];
+    float tmin, tmax;
+  };
+
+#ifdef USE_SSE
+  // Smallest and largest product of the intervals [a_lo, a_hi] and [b_lo, b_hi]
+  inline __m128 interval_mul_min(__m128 a_lo, __m128 a_hi, __m128 b_lo, __m128 b_hi)
+  {
+    return _mm_min_ps(_mm_min_ps(_mm_mul_ps(a_lo, b_lo), _mm_mul_ps(a_lo, b_hi)),
+                      _mm_min_ps(_mm_mul_ps(a_hi, b_lo), _mm_mul_ps(a_hi, b_hi)));
+  }
+
+  inline __m128 interval_mul_max(__m128 a_lo, __m128 a_hi, __m128 b_lo, __m128 b_hi)
+  {
+    return _mm_max_ps(_mm_max_ps(_mm_mul_ps(a_lo, b_lo), _mm_mul_ps(a_lo, b_hi)),
+                      _mm_max_ps(_mm_mul_ps(a_hi, b_lo), _mm_mul_ps(a_hi, b_hi)));
+  }
+#else
+  inline float interval_mul_min(float a_lo, float a_hi, float b_lo, float b_hi)
+  {
+    return min(min(a_lo*b_lo, a_lo*b_hi), min(a_hi*b_lo, a_hi*b_hi));
+  }
+
+  inline float interval_mul_max(float a_lo, float a_hi, float b_lo, float b_hi)
+  {
+    return max(max(a_lo*b_lo, a_lo*b_hi), max(a_hi*b_lo, a_hi*b_hi));
+  }
+#endif
+
+  // Returns a bit mask with the children whose bounds may be hit by a ray in
+  // the packet and stores the nearest distances at which a ray may enter them.
+  inline unsigned int cull_children(const Bvh4Node& node, const PacketBoxData& packet, float t_near[4])
+  {
+    unsigned int mask;
+#ifdef USE_SSE
+    __m128 t0 = _mm_set1_ps(packet.tmin);
+    __m128 t1 = _mm_set1_ps(packet.tmax);
+    for(unsigned int i = 0; i < 3; ++i)
+    {
+      __m128 origin_min = _mm_set1_ps(packet.origin_min[i]);
+      __m128 origin_max = _mm_set1_ps(packet.origin_max[i]);
+      __m128 inv_dir_min = _mm_set1_ps(packet.inv_dir_min[i]);
+      __m128 inv_dir_max = _mm_set1_ps(packet.inv_dir_max[i]);
+      __m128 near_bound = _mm_loadu_ps(node.bounds[packet.near_side[i]][i]);
+      __m128 far_bound = _mm_loadu_ps(node.bounds[1 - packet.near_side[i]][i]);
+      __m128 t_enter = interval_mul_min(_mm_sub_ps(near_bound, origin_max), _mm_sub_ps(near_bound, origin_min), inv_dir_min, inv_dir_max);
+      __m128 t_exit = interval_mul_max(_mm_sub_ps(far_bound, origin_max), _mm_sub_ps(far_bound, origin_min), inv_dir_min, inv_dir_max);
+      t0 = _mm_max_ps(t_enter, t0);
+      t1 = _mm_min_ps(t_exit, t1);
+    }
+    _mm_storeu_ps(t_near, t0);
+    mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    mask = 0;
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      float t0 = packet.tmin;
+      float t1 = packet.tmax;
+      for(unsigned int i = 0; i < 3; ++i)
+      {
+        float near_bound = node.bounds[packet.near_side[i]][i][c];
+        float far_bound = node.bounds[1 - packet.near_side[i]][i][c];
+        t0 = max(t0, interval_mul_min(near_bound - packet.origin_max[i], near_bound - packet.origin_min[i], packet.inv_dir_min[i], packet.inv_dir_max[i]));
+        t1 = min(t1, interval_mul_max(far_bound - packet.origin_max[i], far_bound - packet.origin_min[i], packet.inv_dir_min[i], packet.inv_dir_max[i]));
+      }
+      t_near[c] = t0;
+      mask |= (t0 <= t1) << c;
+    }
+#endif
+    return mask & ((1u << node.no_of_children) - 1);
+  }
+}
+
+void Bvh4Tree::init(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes)
+{
+  wide_nodes.clear();
+  BvhTree::init(geometry, scene_planes);
+  if(nodes.empty())
+    return;
+
+  wide_nodes.reserve(nodes.size()/2 + 1);
+  collapse_node(0);
+  update_wide_visibility(0);
+
+  // Traversal only needs the wide nodes
+  vector<BvhNode>().swap(nodes);
+  built_sah_cost = get_sah_cost();
+}
+
+void Bvh4Tree::refit()
+{
+  Accelerator::refit();
+  if(wide_nodes.empty())
+    return;
+
+  #pragma omp parallel
+  {
+    #pragma omp single
+    refit_wide_node(0, 0);
+  }
+  update_wide_visibility(0);
+}
+
+float Bvh4Tree::get_sah_cost() const
+{
+  if(wide_nodes.empty())
+    return BvhTree::get_sah_cost();
+
+  // A wide node costs one traversal step for testing all its children
+  float cost = 0.0f;
+  float root_area = 0.0f;
+  for(unsigned int i = 0; i < wide_nodes.size(); ++i)
+  {
+    const Bvh4Node& node = wide_nodes[i];
+    AABB bbox;
+    for(unsigned int c = 0; c < node.no_of_children; ++c)
+    {
+      AABB child_bbox = get_child_bbox(node, c);
+      bbox.add_AABB(child_bbox);
+      if(node.count[c] > 0)
+        cost += SAH_INTERSECTION_COST*node.count[c]*child_bbox.area();
+    }
+    cost += SAH_TRAVERSAL_COST*bbox.area();
+    if(i == 0)
+      root_area = bbox.area();
+  }
+  return cost/root_area;
+}
+
+size_t Bvh4Tree::get_memory_usage() const
+{
+  return BvhTree::get_memory_usage() + wide_nodes.capacity()*sizeof(Bvh4Node);
+}
+
+bool Bvh4Tree::closest_primitive(Ray& r, unsigned int& hit_idx) const
+{
+  return intersect_wide_nodes(r, hit_idx);
+}
+
+bool Bvh4Tree::occluded(const Ray& r, unsigned int* occluder) const
+{
+  if(any_plane(r) || hits_occluder(r, occluder))
+    return true;
+  unsigned int hit_idx;
+  if(!occlude_wide_nodes(r, hit_idx))
+    return false;
+  if(occluder)
+    *occluder = hit_idx;
+  return true;
+}
+
+void Bvh4Tree::closest_hits(RayPacket& packet) const
+{
+  // Rays without a hit in the tree keep an index past the stored objects
+  unsigned int hit_idx[PACKET_SIZE];
+  for(unsigned int i = 0; i < packet.size; ++i)
+  {
+    closest_plane(packet.rays[i]);
+    hit_idx[i] = triangles.size();
+  }
+  intersect_wide_nodes(packet, hit_idx);
+  for(unsigned int i = 0; i < packet.size; ++i)
+  {
+    Ray& r = packet.rays[i];
+    if(hit_idx[i] < triangles.size())
+      triangles.finalize_hit(r, hit_idx[i]);
+    if(r.has_hit)
+      r.hit_pos = r.origin + r.dist*r.direction;
+  }
+}
+
+unsigned int Bvh4Tree::collapse_node(unsigned int node_idx)
+{
+  // Replace the interior child with the largest surface area by its
+  // children until the node has four children or only leaves are left
+  unsigned int children[4];
+  unsigned int n = 0;
+  const BvhNode& node = nodes[node_idx];
+  if(node.count > 0)
+    children[n++] = node_idx;
+  else
+  {
+    children[n++] = node_idx + 1;
+    children[n++] = node.offset;
+    while(n < 4)
+    {
+      int largest = -1;
+      float largest_area = -1.0f;
+      for(unsigned int i = 0; i < n; ++i)
+      {
+        const BvhNode& child = nodes[children[i]];
+        if(child.count == 0 && child.bbox.area() > largest_area)
+        {
+          largest = i;
+          largest_area = child.bbox.area();
+        }
+      }
+      if(largest < 0)
+        break;
+      unsigned int opened = children[largest];
+      children[largest] = opened + 1;
+      children[n++] = nodes[opened].offset;
+    }
+  }
+
+  unsigned int wide_idx = wide_nodes.size();
+  wide_nodes.push_back(Bvh4Node());
+  Bvh4Node wide;
+  wide.no_of_children = n;
+  for(unsigned int c = 0; c < 4; ++c)
+  {
+    // Unused slots get an empty box
+    set_child_bbox(wide, c, c < n ? nodes[children[c]].bbox : AABB());
+    wide.child[c] = 0;
+    wide.count[c] = 0;
+    if(c < n)
+    {
+      const BvhNode& child = nodes[children[c]];
+      if(child.count > 0)
+      {
+        wide.child[c] = child.offset;
+        wide.count[c] = child.count;
+      }
+      else
+        wide.child[c] = collapse_node(children[c]);
+    }
+  }
+  wide_nodes[wide_idx] = wide;
+  return wide_idx;
+}
+
+void Bvh4Tree::save(CacheWriter& out) const
+{
+  out.write(wide_nodes);
+  save_objects(out, tree_objects);
+}
+
+bool Bvh4Tree::load(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes, CacheReader& in)
+{
+  add_primitives(geometry, scene_planes);
+  if(!in.read(wide_nodes) || !load_objects(in, tree_objects) || tree_objects.size() < primitives.size() || !check_wide_nodes())
+    return false;
+  triangles.build(tree_objects);
+  if(!wide_nodes.empty())
+    update_wide_visibility(0);
+  built_sah_cost = get_sah_cost();
+  return true;
+}
+
+bool Bvh4Tree::check_wide_nodes() const
+{
+  // As BvhTree::check_nodes. Traversal keeps up to three entries per level.
+  if(wide_nodes.empty())
+    return true;
+  vector< pair<unsigned int, unsigned int> > stack(1, make_pair(0u, 0u));
+  unsigned int visited = 0;
+  while(!stack.empty())
+  {
+    unsigned int wide_idx = stack.back().first;
+    unsigned int level = stack.back().second;
+    stack.pop_back();
+    if(++visited > wide_nodes.size())
+      return false;
+    const Bvh4Node& node = wide_nodes[wide_idx];
+    if(node.no_of_children < 1 || node.no_of_children > 4 || 3*(level + 1) + 1 > STACK_SIZE)
+      return false;
+    for(unsigned int c = 0; c < node.no_of_children; ++c)
+    {
+      if(node.count[c] > 0)
+      {
+        if(node.child[c] > tree_objects.size() || node.count[c] > tree_objects.size() - node.child[c])
+          return false;
+      }
+      else if(node.child[c] <= wide_idx || node.child[c] >= wide_nodes.size())
+        return false;
+      else
+        stack.push_back(make_pair(node.child[c], level + 1));
+    }
+  }
+  return true;
+}
+
+AABB Bvh4Tree::refit_wide_node(unsigned int wide_idx, unsigned int level)
+{
+  // Children are refitted before their parent. The first levels
+  // refit their interior children in separate tasks.
+  Bvh4Node& node = wide_nodes[wide_idx];
+  AABB child_bbox[4];
+  for(unsigned int c = 0; c < node.no_of_children; ++c)
+  {
+    if(node.count[c] > 0)
+    {
+      for(unsigned int i = 0; i < node.count[c]; ++i)
+        child_bbox[c].add_AABB(tree_objects[node.child[c] + i]->bbox);
+    }
+#ifdef BVH_PARALLEL_BUILD
+    else if(level < TASK_LEVELS)
+    {
+      #pragma omp task firstprivate(c) shared(child_bbox)
+      child_bbox[c] = refit_wide_node(node.child[c], level + 1);
+    }
+#endif
+    else
+      child_bbox[c] = refit_wide_node(node.child[c], level + 1);
+  }
+#ifdef BVH_PARALLEL_BUILD
+  #pragma omp taskwait
+#endif
+
+  AABB bbox;
+  for(unsigned int c = 0; c < node.no_of_children; ++c)
+  {
+    set_child_bbox(node, c, child_bbox[c]);
+    bbox.add_AABB(child_bbox[c]);
+  }
+  return bbox;
+}
+
+unsigned int Bvh4Tree::update_wide_visibility(unsigned int wide_idx)
+{
+  Bvh4Node& node = wide_nodes[wide_idx];
+  unsigned int visibility = 0;
+  unsigned int packed = 0;
+  for(unsigned int c = 0; c < node.no_of_children; ++c)
+  {
+    unsigned int child_visibility = node.count[c] > 0 ? triangles.get_visibility(node.child[c], node.count[c])
+                                                       : update_wide_visibility(node.child[c]);
+    packed |= pack_visibility(child_visibility, c);
+    visibility |= child_visibility;
+  }
+  node.visibility = packed;
+  return visibility;
+}
+
+bool Bvh4Tree::intersect_wide_nodes(Ray& r, unsigned int& hit_idx) const
+{
+  if(wide_nodes.empty())
+    return false;
+
+  RayBoxData ray_data(r);
+  StackEntry stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  stack[stack_size].idx = 0;
+  stack[stack_size].count = 0;
+  stack[stack_size].t = r.tmin;
+  ++stack_size;
+
+  bool found = false;
+  while(stack_size > 0)
+  {
+    const StackEntry entry = stack[--stack_size];
+    if(entry.t > r.tmax)
+      continue;
+
+    if(entry.count > 0)
+    {
+      if(triangles.intersect_range(r, entry.idx, entry.count, hit_idx))
+        found = true;
+      continue;
+    }
+
+    const Bvh4Node& node = wide_nodes[entry.idx];
+    float t_near[4];
+    unsigned int mask = intersect_children(node, ray_data, r.tmin, r.tmax, t_near) & get_visible_lanes(node.visibility, r.type);
+
+    // Push the children that were hit sorted so that the nearest is on top
+    unsigned int first = stack_size;
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      if(!(mask & (1u << c)))
+        continue;
+      StackEntry child;
+      child.idx = node.child[c];
+      child.count = node.count[c];
+      child.t = t_near[c];
+      unsigned int j = stack_size++;
+      while(j > first && stack[j - 1].t < child.t)
+      {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      stack[j] = child;
+    }
+  }
+  return found;
+}
+
+bool Bvh4Tree::occlude_wide_nodes(const Ray& r, unsigned int& hit_idx) const
+{
+  if(wide_nodes.empty())
+    return false;
+
+  // Any hit will do, so leaves are tested as soon as their bounds are hit
+  // and interior children are pushed without sorting
+  RayBoxData ray_data(r);
+  unsigned int stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  stack[stack_size++] = 0;
+  while(stack_size > 0)
+  {
+    const Bvh4Node& node = wide_nodes[stack[--stack_size]];
+    float t_near[4];
+    unsigned int mask = intersect_children(node, ray_data, r.tmin, r.tmax, t_near) & get_visible_lanes(node.visibility, r.type);
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      if(!(mask & (1u << c)))
+        continue;
+      if(node.count[c] == 0)
+      {
+        stack[stack_size++] = node.child[c];
+        continue;
+      }
+      if(triangles.occludes_range(r, node.child[c], node.count[c], hit_idx))
+        return true;
+    }
+  }
+  return false;
+}
+
+void Bvh4Tree::intersect_wide_nodes(RayPacket& packet, unsigned int* hit_idx) const
+{
+  if(wide_nodes.empty() || packet.size == 0)
+    return;
+
+  RayBoxData ray_data[PACKET_SIZE];
+  for(unsigned int k = 0; k < packet.size; ++k)
+    ray_data[k].set(packet.rays[k]);
+  PacketBoxData packet_data;
+  bool coherent = packet_data.set(ray_data, packet);
+
+  // Children are entered if they are visible to any ray type in the packet
+  unsigned int packet_types = 0;
+  for(unsigned int k = 0; k < packet.size; ++k)
+    packet_types |= 1u << packet.rays[k].type;
+
+  PacketStackEntry stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  stack[stack_size].idx = 0;
+  stack[stack_size].count = 0;
+  stack[stack_size].ray_mask = (1u << packet.size) - 1;
+  stack[stack_size].t = 0.0f;
+  ++stack_size;
+
+  while(stack_size > 0)
+  {
+    const PacketStackEntry entry = stack[--stack_size];
+
+    // Skip the bounds if all rays entering them already have a closer hit
+    float tmax = 0.0f;
+    for(unsigned int k = 0; k < packet.size; ++k)
+      if(entry.ray_mask & (1u << k))
+        tmax = max(tmax, packet.rays[k].tmax);
+    if(entry.t > tmax)
+      continue;
+
+    if(entry.count > 0)
+    {
+      for(unsigned int k = 0; k < packet.size; ++k)
+        if(entry.ray_mask & (1u << k))
+          triangles.intersect_range(packet.rays[k], entry.idx, entry.count, hit_idx[k]);
+      continue;
+    }
+
+    const Bvh4Node& node = wide_nodes[entry.idx];
+    unsigned int ray_masks[4] = { 0, 0, 0, 0 };
+    float t_first[4] = { BIG, BIG, BIG, BIG };
+    unsigned int candidates = get_lanes_visible_to_any(node.visibility, packet_types);
+    if(coherent)
+    {
+      // The whole packet descends into the interior children that the
+      // interval test cannot reject. Only leaves are tested per ray.
+      packet_data.tmax = tmax;
+      candidates &= cull_children(node, packet_data, t_first);
+      for(unsigned int c = 0; c < 4; ++c)
+        if((candidates & (1u << c)) && node.count[c] == 0)
+        {
+          ray_masks[c] = entry.ray_mask;
+          candidates &= ~(1u << c);
+        }
+        else
+          t_first[c] = BIG;
+    }
+
+    // Find the rays hitting each remaining child and the nearest entry distance
+    for(unsigned int k = 0; candidates != 0 && k < packet.size; ++k)
+    {
+      if(!(entry.ray_mask & (1u << k)))
+        continue;
+      const Ray& r = packet.rays[k];
+      float t_near[4];
+      unsigned int mask = intersect_children(node, ray_data[k], r.tmin, r.tmax, t_near) & candidates;
+      for(unsigned int c = 0; c < 4; ++c)
+        if(mask & (1u << c))
+        {
+          ray_masks[c] |= 1u << k;
+          t_first[c] = min(t_first[c], t_near[c]);
+        }
+    }
+
+    // Push the children that were hit sorted so that the nearest is on top
+    unsigned int first = stack_size;
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      if(ray_masks[c] == 0)
+        continue;
+      PacketStackEntry child;
+      child.idx = node.child[c];
+      child.count = node.count[c];
+      child.ray_mask = ray_masks[c];
+      child.t = t_first[c];
+      unsigned int j = stack_size++;
+      while(j > first && stack[j - 1].t < child.t)
+      {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      stack[j] = child;
+    }
+  }
+}
+
+void Bvh4Tree::collect_hits(const Ray& r, HitList& hits) const
+{
+  if(wide_nodes.empty())
+    return;
+
+  // Near children are visited first, so a list limited to the closest
+  // hits fills early and culls the nodes beyond its last hit
+  RayBoxData ray_data(r);
+  StackEntry stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  stack[stack_size].idx = 0;
+  stack[stack_size].count = 0;
+  stack[stack_size].t = r.tmin;
+  ++stack_size;
+  while(stack_size > 0)
+  {
+    const StackEntry entry = stack[--stack_size];
+    if(entry.t > hits.get_tmax())
+      continue;
+
+    if(entry.count > 0)
+    {
+      for(unsigned int i = 0; i < entry.count; ++i)
+        triangles.add_hits(r, entry.idx + i, hits);
+      continue;
+    }
+
+    const Bvh4Node& node = wide_nodes[entry.idx];
+    float t_near[4];
+    unsigned int mask = intersect_children(node, ray_data, r.tmin, hits.get_tmax(), t_near) & get_visible_lanes(node.visibility, r.type);
+    unsigned int first = stack_size;
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      if(!(mask & (1u << c)))
+        continue;
+      StackEntry child;
+      child.idx = node.child[c];
+      child.count = node.count[c];
+      child.t = t_near[c];
+      unsigned int j = stack_size++;
+      while(j > first && stack[j - 1].t < child.t)
+      {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      stack[j] = child;
+    }
+  }
+}
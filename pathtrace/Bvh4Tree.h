@@ -0,0 +1,118 @@
+// 02576 Rendering Framework
+// Four-wide bounding volume hierarchy collapsed from a binary BVH.
+// Copyright (c) DTU Compute 2013
+
+#ifndef BVH4TREE_H
+#define BVH4TREE_H
+
+#include <vector>
+#include "Ray.h"
+#include "RayPacket.h"
+#include "TriMesh.h"
+#include "Plane.h"
+#include "BvhTree.h"
+#include "Simd.h"
+
+/// Node with up to four children. The child bounds are stored as structure
+/// of arrays so that one SSE register holds the same bound of all children.
+struct Bvh4Node
+{
+  float bounds[2][3][4];       // [min/max][axis][child]
+  unsigned int child[4];       // node index of interior child, first object of leaf child
+  unsigned short count[4];     // number of objects in leaf child (0 for interior children)
+  unsigned short no_of_children;
+  unsigned short visibility;   // ray types that can hit objects in each child, packed as in TriangleStore
+};
+
+/// Ray data shared by all box tests during a traversal
+struct RayBoxData
+{
+  RayBoxData() { }
+  RayBoxData(const Ray& r) { set(r); }
+
+  void set(const Ray& r)
+  {
+    for(unsigned int i = 0; i < 3; ++i)
+    {
+      origin[i] = r.origin[i];
+      inv_dir[i] = 1.0f/r.direction[i];
+      near_side[i] = inv_dir[i] < 0.0f ? 1 : 0;
+    }
+  }
+
+  float origin[3];
+  float inv_dir[3];
+  unsigned int near_side[3];
+};
+
+/// Test a ray against four boxes stored as [min/max][axis][box]. Returns
+/// a bit mask with the boxes that were hit and stores their entry distances.
+inline unsigned int intersect_boxes(const float bounds[2][3][4], const RayBoxData& ray, float tmin, float tmax, float t_near[4])
+{
+#ifdef USE_SSE
+  __m128 t0 = _mm_set1_ps(tmin);
+  __m128 t1 = _mm_set1_ps(tmax);
+  for(unsigned int i = 0; i < 3; ++i)
+  {
+    __m128 origin = _mm_set1_ps(ray.origin[i]);
+    __m128 inv_dir = _mm_set1_ps(ray.inv_dir[i]);
+    __m128 t_enter = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[ray.near_side[i]][i]), origin), inv_dir);
+    __m128 t_exit = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[1 - ray.near_side[i]][i]), origin), inv_dir);
+    t0 = _mm_max_ps(t_enter, t0);
+    t1 = _mm_min_ps(t_exit, t1);
+  }
+  _mm_storeu_ps(t_near, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  unsigned int mask = 0;
+  for(unsigned int c = 0; c < 4; ++c)
+  {
+    float t0 = tmin;
+    float t1 = tmax;
+    for(unsigned int i = 0; i < 3; ++i)
+    {
+      float t_enter = (bounds[ray.near_side[i]][i][c] - ray.origin[i])*ray.inv_dir[i];
+      float t_exit = (bounds[1 - ray.near_side[i]][i][c] - ray.origin[i])*ray.inv_dir[i];
+      t0 = t_enter > t0 ? t_enter : t0;
+      t1 = t_exit < t1 ? t_exit : t1;
+    }
+    t_near[c] = t0;
+    mask |= (t0 <= t1) << c;
+  }
+  return mask;
+#endif
+}
+
+class Bvh4Tree : public BvhTree
+{
+public:
+  Bvh4Tree(unsigned int max_objects_in_leaf = 4, unsigned int max_levels_in_tree = 64)
+    : BvhTree(max_objects_in_leaf, max_levels_in_tree)
+  { }
+
+  virtual void init(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes);
+  virtual bool closest_primitive(Ray& r, unsigned int& hit_idx) const;
+  virtual bool occluded(const Ray& r, unsigned int* occluder = 0) const;
+  virtual void closest_hits(RayPacket& packet) const;
+  virtual void refit();
+  virtual float get_sah_cost() const;
+  virtual size_t get_memory_usage() const;
+  virtual void save(CacheWriter& out) const;
+  virtual bool load(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes, CacheReader& in);
+
+  unsigned int get_no_of_wide_nodes() const { return wide_nodes.size(); }
+
+protected:
+  unsigned int collapse_node(unsigned int node_idx);
+  AABB refit_wide_node(unsigned int wide_idx, unsigned int level);
+  unsigned int update_wide_visibility(unsigned int wide_idx);
+  bool check_wide_nodes() const;
+  bool intersect_wide_nodes(Ray& r, unsigned int& hit_idx) const;
+  bool occlude_wide_nodes(const Ray& r, unsigned int& hit_idx) const;
+  void intersect_wide_nodes(RayPacket& packet, unsigned int* hit_idx) const;
+  virtual void collect_hits(const Ray& r, HitList& hits) const;
+
+  std::vector<Bvh4Node> wide_nodes;
+};
+
+#endif // BVH4TREE_H
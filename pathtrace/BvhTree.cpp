@@ -0,0 +1,776 @@
+// 02576 Rendering Framework
+// Bounding volume hierarchy built using binned surface area heuristic splits.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include <algorithm>
+#include "CGLA/Vec3f.h"
+#include "Ray.h"
+#include "AccObj.h"
+#include "AABB.h"
+#include "BinnedSah.h"
+#include "TriMesh.h"
+#include "Timer.h"
+#include "AcceleratorCache.h"
+#include "BvhTree.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+  #if _OPENMP >= 200805
+    #define BVH_PARALLEL_BUILD   // OpenMP 3.0 tasks are available
+  #endif
+#endif
+
+using namespace std;
+using namespace CGLA;
+
+namespace
+{
+  const unsigned int STACK_SIZE = 128;        // Traversal stack size (bounds the tree depth)
+  const unsigned int TASK_SIZE = 4096;        // Minimum number of objects in a subtree built by a separate task
+  const unsigned int CHUNK_SIZE = 1 << 16;    // Objects per task when binning large nodes in parallel
+
+  void compute_bounds(const vector<AccObj*>& objects, unsigned int first, unsigned int last, AABB& bbox, AABB& centroid_bbox)
+  {
+#ifdef BVH_PARALLEL_BUILD
+    if(last - first > 2*CHUNK_SIZE)
+    {
+      unsigned int chunks = (last - first + CHUNK_SIZE - 1)/CHUNK_SIZE;
+      vector<AABB> chunk_bbox(chunks), chunk_centroid_bbox(chunks);
+      for(unsigned int c = 0; c < chunks; ++c)
+      {
+        #pragma omp task firstprivate(c) shared(objects, chunk_bbox, chunk_centroid_bbox)
+        compute_bounds(objects, first + c*CHUNK_SIZE, min(first + (c + 1)*CHUNK_SIZE, last), chunk_bbox[c], chunk_centroid_bbox[c]);
+      }
+      #pragma omp taskwait
+      for(unsigned int c = 0; c < chunks; ++c)
+      {
+        bbox.add_AABB(chunk_bbox[c]);
+        centroid_bbox.add_AABB(chunk_centroid_bbox[c]);
+      }
+      return;
+    }
+#endif
+    for(unsigned int i = first; i < last; ++i)
+    {
+      bbox.add_AABB(objects[i]->bbox);
+      centroid_bbox.add_point(objects[i]->bbox.get_center());
+    }
+  }
+
+  void bin_objects(const vector<AccObj*>& objects, unsigned int first, unsigned int last, const AABB& centroid_bbox, SahBin bins[][SAH_BINS])
+  {
+#ifdef BVH_PARALLEL_BUILD
+    if(last - first > 2*CHUNK_SIZE)
+    {
+      unsigned int chunks = (last - first + CHUNK_SIZE - 1)/CHUNK_SIZE;
+      vector<SahBin> chunk_bins(chunks*3*SAH_BINS);
+      for(unsigned int c = 0; c < chunks; ++c)
+      {
+        #pragma omp task firstprivate(c) shared(objects, chunk_bins, centroid_bbox)
+        bin_objects(objects, first + c*CHUNK_SIZE, min(first + (c + 1)*CHUNK_SIZE, last), centroid_bbox, 
+                    reinterpret_cast<SahBin(*)[SAH_BINS]>(&chunk_bins[c*3*SAH_BINS]));
+      }
+      #pragma omp taskwait
+      for(unsigned int c = 0; c < chunks; ++c)
+        for(unsigned int axis = 0; axis < 3; ++axis)
+          for(unsigned int b = 0; b < SAH_BINS; ++b)
+          {
+            const SahBin& chunk_bin = chunk_bins[(c*3 + axis)*SAH_BINS + b];
+            bins[axis][b].bbox.add_AABB(chunk_bin.bbox);
+            bins[axis][b].count += chunk_bin.count;
+          }
+      return;
+    }
+#endif
+    Vec3f extent = centroid_bbox.get_diagonal();
+    for(unsigned int i = first; i < last; ++i)
+      add_to_bins(objects[i], centroid_bbox, extent, bins);
+  }
+
+  // Spatial split bins count the references that start and end in them
+  struct SpatialBin
+  {
+    SpatialBin() : entries(0), exits(0) { }
+
+    AABB bbox;
+    unsigned int entries, exits;
+  };
+
+  // Bounds of the part of a reference that lies between two planes
+  // perpendicular to an axis. Triangles of meshes are clipped exactly,
+  // other primitives only by their bounding box.
+  class ReferenceClipper
+  {
+  public:
+    ReferenceClipper() : last_object(0), last_mesh(0) { }
+
+    AABB operator()(const AccObj* ref, unsigned int axis, float lo, float hi)
+    {
+      AABB slab = ref->bbox;
+      slab.p_min[axis] = max(slab.p_min[axis], lo);
+      slab.p_max[axis] = min(slab.p_max[axis], hi);
+      if(ref->geometry != last_object)
+      {
+        last_object = ref->geometry;
+        last_mesh = dynamic_cast<const TriMesh*>(last_object);
+      }
+      if(!last_mesh || slab.is_empty())
+        return slab;
+
+      const Vec3i& face = last_mesh->geometry.face(ref->prim_idx);
+      Vec3f v[3] = { last_mesh->geometry.vertex(face[0]), last_mesh->geometry.vertex(face[1]), last_mesh->geometry.vertex(face[2]) };
+      float planes[2] = { lo, hi };
+      AABB clipped;
+      for(unsigned int i = 0; i < 3; ++i)
+      {
+        const Vec3f& p = v[i];
+        const Vec3f& q = v[(i + 1)%3];
+        if(p[axis] >= lo && p[axis] <= hi)
+          clipped.add_point(p);
+        for(unsigned int k = 0; k < 2; ++k)
+        {
+          float d = planes[k];
+          if((p[axis] < d && q[axis] > d) || (p[axis] > d && q[axis] < d))
+          {
+            Vec3f x = p + (q - p)*((d - p[axis])/(q[axis] - p[axis]));
+            x[axis] = d;
+            clipped.add_point(x);
+          }
+        }
+      }
+      clipped.intersect_AABB(slab);
+      return clipped;
+    }
+
+  private:
+    const Object3D* last_object;
+    const TriMesh* last_mesh;
+  };
+}
+
+void BvhTree::init(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes)
+{
+  Timer timer;
+  timer.start();
+  add_primitives(geometry, scene_planes);
+  tree_objects = primitives;
+  timer.stop();
+  build_times = BvhBuildTimes();
+  build_times.primitives = timer.get_time();
+  build_times.threads = 1;
+#ifdef BVH_PARALLEL_BUILD
+  build_times.threads = omp_get_max_threads();
+#endif
+
+  nodes.clear();
+  if(tree_objects.empty())
+  {
+    triangles.build(tree_objects);
+    built_sah_cost = get_sah_cost();
+    return;
+  }
+
+  timer.start();
+  max_level = min(max_level, STACK_SIZE - 32);
+  vector<BvhNode> build_nodes;
+  if(spatial_splits)
+  {
+    // References are duplicated while building, so nodes are added in
+    // depth-first order as they are created and the build is serial
+    AABB bbox, centroid_bbox;
+    compute_bounds(tree_objects, 0, tree_objects.size(), bbox, centroid_bbox);
+    root_area = bbox.area();
+    split_budget = static_cast<unsigned int>(split_growth*tree_objects.size());
+    vector<AccObj*> refs;
+    refs.swap(tree_objects);
+    subdivide_spatial(refs, 0);
+  }
+  else
+  {
+    // Subtrees are built in disjoint slots of an array with room for the largest
+    // possible tree, which lets tasks write nodes without synchronization.
+    build_nodes.resize(2*tree_objects.size() - 1);
+    #pragma omp parallel
+    {
+      #pragma omp single
+      subdivide_node(build_nodes, 0, 0, tree_objects.size(), 0);
+    }
+  }
+  timer.stop();
+  build_times.hierarchy = timer.get_time();
+
+  // Compact the nodes into depth-first order without unused slots and
+  // store the triangles in the order they are referenced by the leaves
+  timer.start();
+  if(!build_nodes.empty())
+  {
+    nodes.reserve(build_nodes.size());
+    compact_node(build_nodes, 0);
+  }
+  vector<BvhNode>(nodes).swap(nodes);
+  triangles.build(tree_objects);
+  update_visibility(0);
+  built_sah_cost = get_sah_cost();
+  timer.stop();
+  build_times.compaction = timer.get_time();
+}
+
+bool BvhTree::closest_primitive(Ray& r, unsigned int& hit_idx) const
+{
+  return intersect_nodes(r, hit_idx);
+}
+
+bool BvhTree::occluded(const Ray& r, unsigned int* occluder) const
+{
+  if(any_plane(r) || hits_occluder(r, occluder))
+    return true;
+  unsigned int hit_idx;
+  if(!occlude_nodes(r, hit_idx))
+    return false;
+  if(occluder)
+    *occluder = hit_idx;
+  return true;
+}
+
+void BvhTree::subdivide_node(vector<BvhNode>& build_nodes, unsigned int node_idx, unsigned int first, unsigned int last, unsigned int level)
+{
+  unsigned int count = last - first;
+  AABB bbox, centroid_bbox;
+  compute_bounds(tree_objects, first, last, bbox, centroid_bbox);
+  BvhNode& node = build_nodes[node_idx];
+  node.bbox = bbox;
+
+  if(count <= max_objects || (level >= max_level && count <= 0xffff))
+  {
+    node.offset = first;
+    node.count = count;
+    node.axis = 0;
+    return;
+  }
+
+  // Find the split with the lowest SAH cost among the bin boundaries of all three axes
+  Vec3f extent = centroid_bbox.get_diagonal();
+  SahBin bins[3][SAH_BINS];
+  bin_objects(tree_objects, first, last, centroid_bbox, bins);
+  ObjectSplit split;
+  find_object_split(bins, extent, split);
+  int best_axis = split.axis;
+  unsigned int best_bin = split.bin;
+
+  unsigned int middle;
+  if(best_axis >= 0 && level < max_level)
+  {
+    InLeftBins in_left(best_axis, best_bin, centroid_bbox.p_min[best_axis], SAH_BINS/extent[best_axis]);
+    middle = partition(tree_objects.begin() + first, tree_objects.begin() + last, in_left) - tree_objects.begin();
+  }
+  else
+  {
+    // No useful split (coincident centroids or too deep), split at the median along the longest axis
+    unsigned int axis = extent[1] > extent[0] ? 1 : 0;
+    axis = extent[2] > extent[axis] ? 2 : axis;
+    best_axis = axis;
+    middle = first + count/2;
+    nth_element(tree_objects.begin() + first, tree_objects.begin() + middle, tree_objects.begin() + last, CentroidLess(axis));
+  }
+
+  // A subtree over n objects has at most 2n - 1 nodes. The left subtree takes the
+  // slots following its parent and the right subtree the slots after those.
+  unsigned int left_idx = node_idx + 1;
+  unsigned int right_idx = node_idx + 2*(middle - first);
+  node.axis = best_axis;
+  node.count = 0;
+  node.offset = right_idx;
+#ifdef BVH_PARALLEL_BUILD
+  if(count > TASK_SIZE)
+  {
+    #pragma omp task shared(build_nodes)
+    subdivide_node(build_nodes, left_idx, first, middle, level + 1);
+    subdivide_node(build_nodes, right_idx, middle, last, level + 1);
+    #pragma omp taskwait
+    return;
+  }
+#endif
+  subdivide_node(build_nodes, left_idx, first, middle, level + 1);
+  subdivide_node(build_nodes, right_idx, middle, last, level + 1);
+}
+
+void BvhTree::subdivide_spatial(vector<AccObj*>& refs, unsigned int level)
+{
+  unsigned int count = refs.size();
+  AABB bbox, centroid_bbox;
+  compute_bounds(refs, 0, count, bbox, centroid_bbox);
+  unsigned int node_idx = nodes.size();
+  nodes.push_back(BvhNode());
+  nodes[node_idx].bbox = bbox;
+  nodes[node_idx].count = 0;
+
+  if(count <= max_objects || (level >= max_level && count <= 0xffff))
+  {
+    nodes[node_idx].offset = tree_objects.size();
+    nodes[node_idx].count = count;
+    nodes[node_idx].axis = 0;
+    tree_objects.insert(tree_objects.end(), refs.begin(), refs.end());
+    return;
+  }
+
+  Vec3f extent = centroid_bbox.get_diagonal();
+  SahBin bins[3][SAH_BINS];
+  bin_objects(refs, 0, count, centroid_bbox, bins);
+  ObjectSplit split;
+  find_object_split(bins, extent, split);
+
+  // Splitting space only pays off where the children of the object split overlap
+  vector<AccObj*> left, right;
+  unsigned int axis = 0;
+  AABB split_overlap_bbox = split.left_bbox;
+  split_overlap_bbox.intersect_AABB(split.right_bbox);
+  if(level < max_level && split_budget > 0
+     && (split.axis < 0 || (!split_overlap_bbox.is_empty() && split_overlap_bbox.area() > split_overlap*root_area)))
+    split_space(refs, bbox, split.cost, left, right, axis);
+
+  if(left.empty())
+  {
+    unsigned int middle;
+    if(split.axis >= 0 && level < max_level)
+    {
+      axis = split.axis;
+      InLeftBins in_left(axis, split.bin, centroid_bbox.p_min[axis], SAH_BINS/extent[axis]);
+      middle = partition(refs.begin(), refs.end(), in_left) - refs.begin();
+    }
+    else
+    {
+      axis = extent[1] > extent[0] ? 1 : 0;
+      axis = extent[2] > extent[axis] ? 2 : axis;
+      middle = count/2;
+      nth_element(refs.begin(), refs.begin() + middle, refs.end(), CentroidLess(axis));
+    }
+    left.assign(refs.begin(), refs.begin() + middle);
+    right.assign(refs.begin() + middle, refs.end());
+  }
+  vector<AccObj*>().swap(refs);
+
+  nodes[node_idx].axis = axis;
+  subdivide_spatial(left, level + 1);
+  nodes[node_idx].offset = nodes.size();
+  subdivide_spatial(right, level + 1);
+}
+
+bool BvhTree::split_space(vector<AccObj*>& refs, const AABB& bbox, float object_cost, 
+                          vector<AccObj*>& left, vector<AccObj*>& right, unsigned int& split_axis)
+{
+  // Bin the parts of the references that fall in equally sized slabs of the node
+  ReferenceClipper clip;
+  Vec3f extent = bbox.get_diagonal();
+  SpatialBin bins[3][SAH_BINS];
+  for(unsigned int axis = 0; axis < 3; ++axis)
+  {
+    if(extent[axis] <= 0.0f)
+      continue;
+    float width = extent[axis]/SAH_BINS;
+    float scale = SAH_BINS/extent[axis];
+    for(unsigned int i = 0; i < refs.size(); ++i)
+    {
+      const AccObj* ref = refs[i];
+      unsigned int b0 = min(static_cast<unsigned int>((ref->bbox.p_min[axis] - bbox.p_min[axis])*scale), SAH_BINS - 1);
+      unsigned int b1 = min(static_cast<unsigned int>((ref->bbox.p_max[axis] - bbox.p_min[axis])*scale), SAH_BINS - 1);
+      ++bins[axis][b0].entries;
+      ++bins[axis][b1].exits;
+      if(b0 == b1)
+      {
+        bins[axis][b0].bbox.add_AABB(ref->bbox);
+        continue;
+      }
+      for(unsigned int b = b0; b <= b1; ++b)
+      {
+        float lo = bbox.p_min[axis] + b*width;
+        float hi = b == SAH_BINS - 1 ? bbox.p_max[axis] : lo + width;
+        bins[axis][b].bbox.add_AABB(clip(ref, axis, lo, hi));
+      }
+    }
+  }
+
+  // Sweep the bins as for object splits. References are counted on the
+  // left side of the slabs they enter and on the right side of those they leave.
+  float best_cost = object_cost;
+  int best_axis = -1;
+  unsigned int best_bin = 0;
+  AABB left_bbox, right_bbox;
+  unsigned int left_count = 0, right_count = 0;
+  for(unsigned int axis = 0; axis < 3; ++axis)
+  {
+    if(extent[axis] <= 0.0f)
+      continue;
+
+    AABB right_bboxes[SAH_BINS];
+    unsigned int right_counts[SAH_BINS];
+    unsigned int right_sum = 0;
+    for(unsigned int b = SAH_BINS - 1; b > 0; --b)
+    {
+      right_bboxes[b] = bins[axis][b].bbox;
+      if(b < SAH_BINS - 1)
+        right_bboxes[b].add_AABB(right_bboxes[b + 1]);
+      right_sum += bins[axis][b].exits;
+      right_counts[b] = right_sum;
+    }
+
+    AABB left_sweep;
+    unsigned int left_sum = 0;
+    for(unsigned int b = 1; b < SAH_BINS; ++b)
+    {
+      left_sweep.add_AABB(bins[axis][b - 1].bbox);
+      left_sum += bins[axis][b - 1].entries;
+      if(left_sum == 0 || right_counts[b] == 0)
+        continue;
+      float cost = left_sum*left_sweep.area() + right_counts[b]*right_bboxes[b].area();
+      if(cost < best_cost)
+      {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+        left_bbox = left_sweep;
+        right_bbox = right_bboxes[b];
+        left_count = left_sum;
+        right_count = right_counts[b];
+      }
+    }
+  }
+  if(best_axis < 0)
+    return false;
+
+  // Distribute the references. A reference crossing the split plane is
+  // only duplicated if that is cheaper than moving it to one side.
+  unsigned int axis = best_axis;
+  float pos = bbox.p_min[axis] + best_bin*(extent[axis]/SAH_BINS);
+  for(unsigned int i = 0; i < refs.size(); ++i)
+  {
+    AccObj* ref = refs[i];
+    if(ref->bbox.p_max[axis] <= pos)
+    {
+      left.push_back(ref);
+      continue;
+    }
+    if(ref->bbox.p_min[axis] >= pos)
+    {
+      right.push_back(ref);
+      continue;
+    }
+
+    AABB left_part = clip(ref, axis, ref->bbox.p_min[axis], pos);
+    AABB right_part = clip(ref, axis, pos, ref->bbox.p_max[axis]);
+    bool to_left = right_part.is_empty();
+    bool to_right = left_part.is_empty() && !to_left;
+    if(!to_left && !to_right)
+    {
+      AABB left_union = left_bbox;
+      AABB right_union = right_bbox;
+      left_union.add_AABB(ref->bbox);
+      right_union.add_AABB(ref->bbox);
+      float n_left = static_cast<float>(left_count);
+      float n_right = static_cast<float>(right_count);
+      float split_cost = n_left*left_bbox.area() + n_right*right_bbox.area();
+      float left_cost = n_left*left_union.area() + (n_right - 1.0f)*right_bbox.area();
+      float right_cost = (n_left - 1.0f)*left_bbox.area() + n_right*right_union.area();
+      if(split_budget == 0 || split_cost >= min(left_cost, right_cost))
+      {
+        to_left = left_cost <= right_cost;
+        to_right = !to_left;
+        left_part = right_part = ref->bbox;
+      }
+    }
+    else if(to_left && left_part.is_empty())
+      left_part = ref->bbox;
+
+    if(to_left)
+    {
+      ref->bbox = left_part;
+      left.push_back(ref);
+      left_bbox.add_AABB(left_part);
+      right_count = right_count > 0 ? right_count - 1 : 0;
+    }
+    else if(to_right)
+    {
+      ref->bbox = right_part;
+      right.push_back(ref);
+      right_bbox.add_AABB(right_part);
+      left_count = left_count > 0 ? left_count - 1 : 0;
+    }
+    else
+    {
+      AccObj* right_ref = prim_pool.allocate(1);
+      *right_ref = *ref;
+      ref->bbox = left_part;
+      right_ref->bbox = right_part;
+      left.push_back(ref);
+      right.push_back(right_ref);
+      primitives.push_back(right_ref);
+      --split_budget;
+    }
+  }
+  if(left.empty() || right.empty())
+  {
+    left.clear();
+    right.clear();
+    return false;
+  }
+  split_axis = axis;
+  return true;
+}
+
+unsigned int BvhTree::compact_node(const vector<BvhNode>& build_nodes, unsigned int build_idx)
+{
+  unsigned int node_idx = nodes.size();
+  nodes.push_back(build_nodes[build_idx]);
+  if(nodes[node_idx].count == 0)
+  {
+    compact_node(build_nodes, build_idx + 1);
+    nodes[node_idx].offset = compact_node(build_nodes, build_nodes[build_idx].offset);
+  }
+  return node_idx;
+}
+
+void BvhTree::refit()
+{
+  Accelerator::refit();
+  if(nodes.empty())
+    return;
+
+  #pragma omp parallel
+  {
+    #pragma omp single
+    refit_node(0);
+  }
+  update_visibility(0);
+}
+
+float BvhTree::get_sah_cost() const
+{
+  if(nodes.empty())
+    return Accelerator::get_sah_cost();
+
+  float cost = 0.0f;
+  for(unsigned int i = 0; i < nodes.size(); ++i)
+  {
+    const BvhNode& node = nodes[i];
+    if(node.count > 0)
+      cost += SAH_INTERSECTION_COST*node.count*node.bbox.area();
+    else
+      cost += SAH_TRAVERSAL_COST*node.bbox.area();
+  }
+  return cost/nodes[0].bbox.area();
+}
+
+size_t BvhTree::get_memory_usage() const
+{
+  return Accelerator::get_memory_usage() + nodes.capacity()*sizeof(BvhNode) + tree_objects.capacity()*sizeof(AccObj*);
+}
+
+void BvhTree::save(CacheWriter& out) const
+{
+  out.write(nodes);
+  save_objects(out, tree_objects);
+}
+
+bool BvhTree::load(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes, CacheReader& in)
+{
+  add_primitives(geometry, scene_planes);
+  if(!in.read(nodes) || !load_objects(in, tree_objects) || tree_objects.size() < primitives.size() || !check_nodes())
+    return false;
+  triangles.build(tree_objects);
+  if(!nodes.empty())
+    update_visibility(0);
+  built_sah_cost = get_sah_cost();
+  return true;
+}
+
+bool BvhTree::check_nodes() const
+{
+  // Nodes read from a cache file must form a tree that traversal can walk
+  // without leaving the arrays. Children follow their parent, so the walk
+  // ends, and a valid tree visits every node once.
+  if(nodes.empty())
+    return true;
+  vector< pair<unsigned int, unsigned int> > stack(1, make_pair(0u, 0u));
+  unsigned int visited = 0;
+  while(!stack.empty())
+  {
+    unsigned int node_idx = stack.back().first;
+    unsigned int level = stack.back().second;
+    stack.pop_back();
+    if(++visited > nodes.size())
+      return false;
+    const BvhNode& node = nodes[node_idx];
+    if(node.count > 0)
+    {
+      if(node.offset > tree_objects.size() || node.count > tree_objects.size() - node.offset)
+        return false;
+      continue;
+    }
+    if(node.axis > 2 || level + 1 >= STACK_SIZE || node.offset <= node_idx + 1 || node.offset >= nodes.size())
+      return false;
+    stack.push_back(make_pair(node_idx + 1, level + 1));
+    stack.push_back(make_pair(node.offset, level + 1));
+  }
+  return true;
+}
+
+void BvhTree::refit_node(unsigned int node_idx)
+{
+  // Children are refitted before their parent. Subtrees are large enough
+  // for a separate task if they span many nodes.
+  BvhNode& node = nodes[node_idx];
+  node.bbox.reset();
+  if(node.count > 0)
+  {
+    for(unsigned int i = 0; i < node.count; ++i)
+      node.bbox.add_AABB(tree_objects[node.offset + i]->bbox);
+    return;
+  }
+#ifdef BVH_PARALLEL_BUILD
+  if(node.offset - node_idx > 2*TASK_SIZE)
+  {
+    #pragma omp task
+    refit_node(node_idx + 1);
+    refit_node(node.offset);
+    #pragma omp taskwait
+  }
+  else
+#endif
+  {
+    refit_node(node_idx + 1);
+    refit_node(node.offset);
+  }
+  node.bbox.add_AABB(nodes[node_idx + 1].bbox);
+  node.bbox.add_AABB(nodes[node.offset].bbox);
+}
+
+unsigned int BvhTree::update_visibility(unsigned int node_idx)
+{
+  BvhNode& node = nodes[node_idx];
+  if(node.count > 0)
+    node.visibility = triangles.get_visibility(node.offset, node.count);
+  else
+  {
+    unsigned int left = update_visibility(node_idx + 1);
+    node.visibility = left | update_visibility(node.offset);
+  }
+  return node.visibility;
+}
+
+bool BvhTree::occlude_nodes(const Ray& r, unsigned int& hit_idx) const
+{
+  if(nodes.empty())
+    return false;
+
+  // Any hit will do, so children are visited in storage order
+  Vec3f inv_dir(1.0f/r.direction[0], 1.0f/r.direction[1], 1.0f/r.direction[2]);
+  unsigned int stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  unsigned int node_idx = 0;
+  for(;;)
+  {
+    const BvhNode& node = nodes[node_idx];
+    float t_near = r.tmin;
+    if(((node.visibility >> r.type) & 1) && node.bbox.intersects(r.origin, inv_dir, t_near, r.tmax))
+    {
+      if(node.count == 0)
+      {
+        stack[stack_size++] = node.offset;
+        node_idx = node_idx + 1;
+        continue;
+      }
+      if(triangles.occludes_range(r, node.offset, node.count, hit_idx))
+        return true;
+    }
+    if(stack_size == 0)
+      return false;
+    node_idx = stack[--stack_size];
+  }
+}
+
+bool BvhTree::intersect_nodes(Ray& r, unsigned int& hit_idx) const
+{
+  if(nodes.empty())
+    return false;
+
+  Vec3f inv_dir(1.0f/r.direction[0], 1.0f/r.direction[1], 1.0f/r.direction[2]);
+  unsigned int stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  unsigned int node_idx = 0;
+  bool found = false;
+  for(;;)
+  {
+    const BvhNode& node = nodes[node_idx];
+    float t_near = r.tmin;
+    if(((node.visibility >> r.type) & 1) && node.bbox.intersects(r.origin, inv_dir, t_near, r.tmax))
+    {
+      if(node.count > 0)
+      {
+        if(triangles.intersect_range(r, node.offset, node.count, hit_idx))
+          found = true;
+      }
+      else
+      {
+        // Descend into the child on the near side of the split first
+        if(r.direction[node.axis] < 0.0f)
+        {
+          stack[stack_size++] = node_idx + 1;
+          node_idx = node.offset;
+        }
+        else
+        {
+          stack[stack_size++] = node.offset;
+          node_idx = node_idx + 1;
+        }
+        continue;
+      }
+    }
+    if(stack_size == 0)
+      break;
+    node_idx = stack[--stack_size];
+  }
+  return found;
+}
+
+void BvhTree::collect_hits(const Ray& r, HitList& hits) const
+{
+  if(nodes.empty())
+    return;
+
+  // Near children are visited first, so a list limited to the closest
+  // hits fills early and culls the nodes beyond its last hit
+  Vec3f inv_dir(1.0f/r.direction[0], 1.0f/r.direction[1], 1.0f/r.direction[2]);
+  unsigned int stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  unsigned int node_idx = 0;
+  for(;;)
+  {
+    const BvhNode& node = nodes[node_idx];
+    float t_near = r.tmin;
+    if(((node.visibility >> r.type) & 1) && node.bbox.intersects(r.origin, inv_dir, t_near, hits.get_tmax()))
+    {
+      if(node.count > 0)
+      {
+        for(unsigned int i = 0; i < node.count; ++i)
+          triangles.add_hits(r, node.offset + i, hits);
+      }
+      else
+      {
+        if(r.direction[node.axis] < 0.0f)
+        {
+          stack[stack_size++] = node_idx + 1;
+          node_idx = node.offset;
+        }
+        else
+        {
+          stack[stack_size++] = node.offset;
+          node_idx = node_idx + 1;
+        }
+        continue;
+      }
+    }
+    if(stack_size == 0)
+      return;
+    node_idx = stack[--stack_size];
+  }
+}
@@ -0,0 +1,100 @@
+// 02576 Rendering Framework
+// Bounding volume hierarchy built using binned surface area heuristic splits.
+// Copyright (c) DTU Compute 2013
+
+#ifndef BVHTREE_H
+#define BVHTREE_H
+
+#include <vector>
+#include "Ray.h"
+#include "AccObj.h"
+#include "TriMesh.h"
+#include "AABB.h"
+#include "Plane.h"
+#include "Accelerator.h"
+
+/// Node of a BVH stored in depth-first order. The left child of an
+/// interior node is the node following it in the node array.
+struct BvhNode
+{
+  AABB bbox;
+  unsigned int offset;   // first object if leaf, index of right child otherwise
+  unsigned short count;  // number of objects in leaf (0 for interior nodes)
+  unsigned char axis;    // split axis of interior nodes
+  unsigned char visibility;   // mask of the ray types that can hit objects in the subtree
+};
+
+/// Wall clock seconds spent in the phases of a build. Threads is 0 if the
+/// tree was not built by init.
+struct BvhBuildTimes
+{
+  BvhBuildTimes() : primitives(0.0), hierarchy(0.0), compaction(0.0), threads(0) { }
+
+  double primitives;
+  double hierarchy;
+  double compaction;
+  int threads;
+};
+
+class BvhTree : public Accelerator
+{
+public:
+  BvhTree(unsigned int max_objects_in_leaf = 4, unsigned int max_levels_in_tree = 64)
+    : max_objects(max_objects_in_leaf), max_level(max_levels_in_tree), 
+      spatial_splits(false), split_overlap(0.0f), split_growth(0.0f), split_budget(0), root_area(0.0f)
+  { }
+
+  // Build with spatial splits as well as object splits (SBVH). Space is
+  // split where the children of the best object split overlap by more than
+  // overlap_threshold times the surface area of the root. References
+  // crossing a spatial split are clipped and duplicated until their number
+  // has grown by the fraction max_growth.
+  void enable_spatial_splits(float overlap_threshold = 1.0e-5f, float max_growth = 0.5f)
+  {
+    spatial_splits = true;
+    split_overlap = overlap_threshold;
+    split_growth = max_growth;
+  }
+
+  virtual void init(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes);
+  virtual bool closest_primitive(Ray& r, unsigned int& hit_idx) const;
+  virtual bool occluded(const Ray& r, unsigned int* occluder = 0) const;
+  virtual void refit();
+  virtual float get_sah_cost() const;
+  virtual size_t get_memory_usage() const;
+  virtual void save(CacheWriter& out) const;
+  virtual bool load(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes, CacheReader& in);
+
+  unsigned int get_no_of_nodes() const { return nodes.size(); }
+  const BvhBuildTimes& get_build_times() const { return build_times; }
+
+protected:
+  void subdivide_node(std::vector<BvhNode>& build_nodes, unsigned int node_idx, unsigned int first, unsigned int last, unsigned int level);
+  unsigned int compact_node(const std::vector<BvhNode>& build_nodes, unsigned int build_idx);
+  void subdivide_spatial(std::vector<AccObj*>& refs, unsigned int level);
+  bool split_space(std::vector<AccObj*>& refs, const AABB& bbox, float object_cost, 
+                   std::vector<AccObj*>& left, std::vector<AccObj*>& right, unsigned int& split_axis);
+  void refit_node(unsigned int node_idx);
+  unsigned int update_visibility(unsigned int node_idx);
+  bool check_nodes() const;
+  bool intersect_nodes(Ray& r, unsigned int& hit_idx) const;
+  bool occlude_nodes(const Ray& r, unsigned int& hit_idx) const;
+  virtual void collect_hits(const Ray& r, HitList& hits) const;
+
+  // Binary nodes and the objects referenced by their leaves
+  std::vector<BvhNode> nodes;
+  std::vector<AccObj*> tree_objects;
+  unsigned int max_objects;
+  unsigned int max_level;
+
+  // Spatial split settings and the state of a build using them
+  bool spatial_splits;
+  float split_overlap;
+  float split_growth;
+  unsigned int split_budget;
+  float root_area;
+
+  BvhBuildTimes build_times;
+};
+
+#endif // BVHTREE_H
@@ -10,6 +10,7 @@
 #include "CGLA/Vec2f.h"
 #include "CGLA/Vec3f.h"
 #include "Ray.h"
+#include "Simd.h"
 
 const float NEAR_PLANE = 1.0e-3f;
 const float FAR_PLANE = 1.0e5f;
@@ -80,6 +81,36 @@ public:
     return Ray(eye, normalize(get_ray_dir(coords))); 
   }
 
+  /// Fill an array with the rays corresponding to an array of image coords.
+  /// With SSE, four ray directions are computed at a time.
+  void get_rays(const CGLA::Vec2f* coords, Ray* rays, unsigned int no_of_rays) const
+  {
+    unsigned int i = 0;
+#ifdef USE_SSE
+    for(; i + 4 <= no_of_rays; i += 4)
+    {
+      __m128 x = _mm_setr_ps(coords[i][0], coords[i + 1][0], coords[i + 2][0], coords[i + 3][0]);
+      __m128 y = _mm_setr_ps(coords[i][1], coords[i + 1][1], coords[i + 2][1], coords[i + 3][1]);
+      __m128 dir[3];
+      __m128 sqr_length = _mm_setzero_ps();
+      for(unsigned int j = 0; j < 3; ++j)
+      {
+        dir[j] = _mm_add_ps(_mm_add_ps(_mm_set1_ps(ip_normal[j]), _mm_mul_ps(_mm_set1_ps(ip_axes[0][j]), x)),
+                            _mm_mul_ps(_mm_set1_ps(ip_axes[1][j]), y));
+        sqr_length = _mm_add_ps(sqr_length, _mm_mul_ps(dir[j], dir[j]));
+      }
+      __m128 length = _mm_sqrt_ps(sqr_length);
+      float d[3][4];
+      for(unsigned int j = 0; j < 3; ++j)
+        _mm_storeu_ps(d[j], _mm_div_ps(dir[j], length));
+      for(unsigned int k = 0; k < 4; ++k)
+        rays[i + k] = Ray(eye, CGLA::Vec3f(d[0][k], d[1][k], d[2][k]));
+    }
+#endif
+    for(; i < no_of_rays; ++i)
+      rays[i] = get_ray(coords[i]);
+  }
+
   float get_fov() const { return fov; }
   float get_focal_dist() const { return focal_dist; }
   void set_focal_dist(float focal_distance) { set(eye, lookat, up, focal_distance); }
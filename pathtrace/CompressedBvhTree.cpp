@@ -0,0 +1,483 @@
+// 02576 Rendering Framework
+// Four-wide bounding volume hierarchy with quantized child bounds.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "CGLA/Vec3f.h"
+#include "Ray.h"
+#include "RayPacket.h"
+#include "AccObj.h"
+#include "AABB.h"
+#include "Simd.h"
+#include "AcceleratorCache.h"
+#include "Bvh4Tree.h"
+#include "CompressedBvhTree.h"
+
+using namespace std;
+using namespace CGLA;
+
+namespace
+{
+  const unsigned int STACK_SIZE = 256;       // Traversal stack size (three entries per level plus one)
+  const unsigned int MAX_LEAF_COUNT = 255;   // Largest number of triangles in a leaf child
+
+  struct StackEntry
+  {
+    unsigned int idx;     // node index, or first triangle of a leaf
+    unsigned int count;   // number of triangles in a leaf, 0 for nodes
+    float t;              // distance at which the ray enters the bounds
+  };
+
+  inline float power_of_two(int exponent)
+  {
+    int bits = (exponent + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof(float));
+    return f;
+  }
+
+  // Child bounds of a node in the layout used by intersect_boxes
+  inline void dequantize(const CompressedBvhNode& node, float bounds[2][3][4])
+  {
+    for(unsigned int i = 0; i < 3; ++i)
+    {
+      float scale = power_of_two(node.exponent[i]);
+#ifdef USE_SSE2
+      __m128 origin = _mm_set1_ps(node.origin[i]);
+      __m128 cell = _mm_set1_ps(scale);
+      __m128i zero = _mm_setzero_si128();
+      for(unsigned int side = 0; side < 2; ++side)
+      {
+        int q;
+        memcpy(&q, node.bounds[side][i], sizeof(int));
+        __m128i q_int = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(q), zero), zero);
+        _mm_storeu_ps(bounds[side][i], _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(q_int), cell)));
+      }
+#else
+      for(unsigned int side = 0; side < 2; ++side)
+        for(unsigned int c = 0; c < 4; ++c)
+          bounds[side][i][c] = node.origin[i] + node.bounds[side][i][c]*scale;
+#endif
+    }
+  }
+
+  inline AABB get_child_bbox(const float bounds[2][3][4], unsigned int c)
+  {
+    return AABB(Vec3f(bounds[0][0][c], bounds[0][1][c], bounds[0][2][c]),
+                Vec3f(bounds[1][0][c], bounds[1][1][c], bounds[1][2][c]));
+  }
+}
+
+void CompressedBvhTree::init(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes)
+{
+  compressed_nodes.clear();
+  objects = geometry;
+  Bvh4Tree::init(geometry, scene_planes);
+  if(!wide_nodes.empty())
+  {
+    // Compressed nodes have the indices of the wide nodes. Nodes for
+    // splitting leaves with too many triangles are added at the end.
+    compressed_nodes.resize(wide_nodes.size());
+    for(unsigned int i = 0; i < wide_nodes.size(); ++i)
+      compress_node(i);
+    vector<CompressedBvhNode>(compressed_nodes).swap(compressed_nodes);
+    update_compressed_visibility(0);
+  }
+  built_sah_cost = get_sah_cost();
+
+  // Traversal only needs the compressed nodes and the triangle store
+  vector<Bvh4Node>().swap(wide_nodes);
+  vector<AccObj*>().swap(primitives);
+  prim_pool.clear();
+  vector<AccObj*>().swap(tree_objects);
+}
+
+bool CompressedBvhTree::closest_primitive(Ray& r, unsigned int& hit_idx) const
+{
+  return intersect_compressed_nodes(r, hit_idx);
+}
+
+bool CompressedBvhTree::occluded(const Ray& r, unsigned int* occluder) const
+{
+  if(any_plane(r) || hits_occluder(r, occluder))
+    return true;
+  unsigned int hit_idx;
+  if(!occlude_compressed_nodes(r, hit_idx))
+    return false;
+  if(occluder)
+    *occluder = hit_idx;
+  return true;
+}
+
+void CompressedBvhTree::closest_hits(RayPacket& packet) const
+{
+  // Packets are traced one ray at a time
+  Accelerator::closest_hits(packet);
+}
+
+void CompressedBvhTree::refit()
+{
+  // The primitives needed for refitting are released after building
+  vector<const Object3D*> geometry = objects;
+  vector<const Plane*> scene_planes = planes;
+  init(geometry, scene_planes);
+}
+
+float CompressedBvhTree::get_sah_cost() const
+{
+  if(compressed_nodes.empty())
+    return Bvh4Tree::get_sah_cost();
+
+  float cost = 0.0f;
+  float root_area = 0.0f;
+  for(unsigned int i = 0; i < compressed_nodes.size(); ++i)
+  {
+    const CompressedBvhNode& node = compressed_nodes[i];
+    float bounds[2][3][4];
+    dequantize(node, bounds);
+    AABB bbox;
+    for(unsigned int c = 0; c < node.no_of_children; ++c)
+    {
+      AABB child_bbox = get_child_bbox(bounds, c);
+      bbox.add_AABB(child_bbox);
+      if(node.count[c] > 0)
+        cost += SAH_INTERSECTION_COST*node.count[c]*child_bbox.area();
+    }
+    cost += SAH_TRAVERSAL_COST*bbox.area();
+    if(i == 0)
+      root_area = bbox.area();
+  }
+  return cost/root_area;
+}
+
+size_t CompressedBvhTree::get_memory_usage() const
+{
+  return Bvh4Tree::get_memory_usage() + compressed_nodes.capacity()*sizeof(CompressedBvhNode) + objects.capacity()*sizeof(const Object3D*);
+}
+
+void CompressedBvhTree::save(CacheWriter& out) const
+{
+  // The objects of the triangle store are stored by their position in the geometry given to init
+  const vector<const Object3D*>& table = triangles.get_object_table();
+  vector<unsigned int> table_idx(table.size());
+  for(unsigned int i = 0; i < table.size(); ++i)
+    table_idx[i] = find(objects.begin(), objects.end(), table[i]) - objects.begin();
+  out.write(compressed_nodes);
+  out.write(table_idx);
+  out.write(triangles.get_object_ids());
+  out.write(triangles.get_prim_indices());
+}
+
+bool CompressedBvhTree::load(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes, CacheReader& in)
+{
+  // The triangle store is restored directly, so no primitives are created
+  objects = geometry;
+  planes = scene_planes;
+  vector<unsigned int> table_idx, object_ids, prim_idx;
+  if(!in.read(compressed_nodes) || !in.read(table_idx) || !in.read(object_ids) || !in.read(prim_idx) || object_ids.size() != prim_idx.size())
+    return false;
+
+  vector<const Object3D*> table(table_idx.size());
+  vector<unsigned int> no_of_prims(table_idx.size());
+  for(unsigned int i = 0; i < table_idx.size(); ++i)
+  {
+    if(table_idx[i] >= geometry.size())
+      return false;
+    table[i] = geometry[table_idx[i]];
+    no_of_prims[i] = table[i]->get_no_of_primitives();
+  }
+  for(unsigned int i = 0; i < object_ids.size(); ++i)
+    if(object_ids[i] >= table.size() || prim_idx[i] >= no_of_prims[object_ids[i]])
+      return false;
+  if(!check_compressed_nodes(object_ids.size()))
+    return false;
+  triangles.build(table, object_ids, prim_idx);
+  if(!compressed_nodes.empty())
+    update_compressed_visibility(0);
+  built_sah_cost = get_sah_cost();
+  return true;
+}
+
+bool CompressedBvhTree::check_compressed_nodes(unsigned int no_of_triangles) const
+{
+  // As Bvh4Tree::check_wide_nodes
+  if(compressed_nodes.empty())
+    return true;
+  vector< pair<unsigned int, unsigned int> > stack(1, make_pair(0u, 0u));
+  unsigned int visited = 0;
+  while(!stack.empty())
+  {
+    unsigned int node_idx = stack.back().first;
+    unsigned int level = stack.back().second;
+    stack.pop_back();
+    if(++visited > compressed_nodes.size())
+      return false;
+    const CompressedBvhNode& node = compressed_nodes[node_idx];
+    if(node.no_of_children < 1 || node.no_of_children > 4 || 3*(level + 1) + 1 > STACK_SIZE)
+      return false;
+    for(unsigned int c = 0; c < node.no_of_children; ++c)
+    {
+      if(node.count[c] > 0)
+      {
+        if(node.child[c] > no_of_triangles || node.count[c] > no_of_triangles - node.child[c])
+          return false;
+      }
+      else if(node.child[c] <= node_idx || node.child[c] >= compressed_nodes.size())
+        return false;
+      else
+        stack.push_back(make_pair(node.child[c], level + 1));
+    }
+  }
+  return true;
+}
+
+void CompressedBvhTree::compress_node(unsigned int wide_idx)
+{
+  const Bvh4Node& wide = wide_nodes[wide_idx];
+  CompressedBvhNode node;
+  memset(&node, 0, sizeof(CompressedBvhNode));
+  node.no_of_children = wide.no_of_children;
+  AABB child_bbox[4];
+  for(unsigned int c = 0; c < wide.no_of_children; ++c)
+  {
+    child_bbox[c] = get_child_bbox(wide.bounds, c);
+    if(wide.count[c] > MAX_LEAF_COUNT)
+      node.child[c] = add_leaf_node(wide.child[c], wide.count[c]);
+    else
+    {
+      node.child[c] = wide.child[c];
+      node.count[c] = wide.count[c];
+    }
+  }
+  compressed_nodes[wide_idx] = node;
+  set_node_bounds(wide_idx, child_bbox);
+}
+
+unsigned int CompressedBvhTree::add_leaf_node(unsigned int first, unsigned int count)
+{
+  // Split the triangles of the leaf into up to four children
+  unsigned int node_idx = compressed_nodes.size();
+  compressed_nodes.push_back(CompressedBvhNode());
+  CompressedBvhNode node;
+  memset(&node, 0, sizeof(CompressedBvhNode));
+  AABB child_bbox[4];
+  unsigned int chunk = (count + 3)/4;
+  for(unsigned int c = 0; c < 4 && c*chunk < count; ++c)
+  {
+    unsigned int child_first = first + c*chunk;
+    unsigned int child_count = min(chunk, count - c*chunk);
+    for(unsigned int i = 0; i < child_count; ++i)
+      child_bbox[c].add_AABB(tree_objects[child_first + i]->bbox);
+    if(child_count > MAX_LEAF_COUNT)
+      node.child[c] = add_leaf_node(child_first, child_count);
+    else
+    {
+      node.child[c] = child_first;
+      node.count[c] = child_count;
+    }
+    ++node.no_of_children;
+  }
+  compressed_nodes[node_idx] = node;
+  set_node_bounds(node_idx, child_bbox);
+  return node_idx;
+}
+
+unsigned int CompressedBvhTree::update_compressed_visibility(unsigned int node_idx)
+{
+  CompressedBvhNode& node = compressed_nodes[node_idx];
+  unsigned int visibility = 0;
+  unsigned int packed = 0;
+  for(unsigned int c = 0; c < node.no_of_children; ++c)
+  {
+    unsigned int child_visibility = node.count[c] > 0 ? triangles.get_visibility(node.child[c], node.count[c])
+                                                       : update_compressed_visibility(node.child[c]);
+    packed |= pack_visibility(child_visibility, c);
+    visibility |= child_visibility;
+  }
+  node.visibility = packed;
+  return visibility;
+}
+
+void CompressedBvhTree::set_node_bounds(unsigned int node_idx, const AABB* child_bbox)
+{
+  CompressedBvhNode& node = compressed_nodes[node_idx];
+  AABB bbox;
+  for(unsigned int c = 0; c < node.no_of_children; ++c)
+    bbox.add_AABB(child_bbox[c]);
+
+  for(unsigned int i = 0; i < 3; ++i)
+  {
+    // Use the smallest cells for which the grid covers the node
+    int exponent;
+    frexp((bbox.p_max[i] - bbox.p_min[i])/MAX_LEAF_COUNT, &exponent);
+    exponent = max(exponent, -126);
+    while(exponent < 127 && bbox.p_min[i] + 255.0f*power_of_two(exponent) < bbox.p_max[i])
+      ++exponent;
+    float scale = power_of_two(exponent);
+    node.origin[i] = bbox.p_min[i];
+    node.exponent[i] = exponent;
+
+    // Round outward, checking the grid points as they are computed in traversal
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      if(c >= node.no_of_children)
+      {
+        node.bounds[0][i][c] = 255;
+        node.bounds[1][i][c] = 0;
+        continue;
+      }
+      int q_min = static_cast<int>(floor((child_bbox[c].p_min[i] - node.origin[i])/scale));
+      int q_max = static_cast<int>(ceil((child_bbox[c].p_max[i] - node.origin[i])/scale));
+      q_min = min(max(q_min, 0), 255);
+      q_max = min(max(q_max, 0), 255);
+      while(q_min > 0 && node.origin[i] + q_min*scale > child_bbox[c].p_min[i])
+        --q_min;
+      while(q_max < 255 && node.origin[i] + q_max*scale < child_bbox[c].p_max[i])
+        ++q_max;
+      node.bounds[0][i][c] = q_min;
+      node.bounds[1][i][c] = q_max;
+    }
+  }
+}
+
+bool CompressedBvhTree::intersect_compressed_nodes(Ray& r, unsigned int& hit_idx) const
+{
+  if(compressed_nodes.empty())
+    return false;
+
+  RayBoxData ray_data(r);
+  StackEntry stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  stack[stack_size].idx = 0;
+  stack[stack_size].count = 0;
+  stack[stack_size].t = r.tmin;
+  ++stack_size;
+
+  bool found = false;
+  while(stack_size > 0)
+  {
+    const StackEntry entry = stack[--stack_size];
+    if(entry.t > r.tmax)
+      continue;
+
+    if(entry.count > 0)
+    {
+      if(triangles.intersect_range(r, entry.idx, entry.count, hit_idx))
+        found = true;
+      continue;
+    }
+
+    const CompressedBvhNode& node = compressed_nodes[entry.idx];
+    float bounds[2][3][4];
+    float t_near[4];
+    dequantize(node, bounds);
+    unsigned int mask = intersect_boxes(bounds, ray_data, r.tmin, r.tmax, t_near) & get_visible_lanes(node.visibility, r.type);
+
+    // Push the children that were hit sorted so that the nearest is on top
+    unsigned int first = stack_size;
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      if(!(mask & (1u << c)))
+        continue;
+      StackEntry child;
+      child.idx = node.child[c];
+      child.count = node.count[c];
+      child.t = t_near[c];
+      unsigned int j = stack_size++;
+      while(j > first && stack[j - 1].t < child.t)
+      {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      stack[j] = child;
+    }
+  }
+  return found;
+}
+
+bool CompressedBvhTree::occlude_compressed_nodes(const Ray& r, unsigned int& hit_idx) const
+{
+  if(compressed_nodes.empty())
+    return false;
+
+  // Any hit will do, so leaves are tested as soon as their bounds are hit
+  // and interior children are pushed without sorting
+  RayBoxData ray_data(r);
+  unsigned int stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  stack[stack_size++] = 0;
+  while(stack_size > 0)
+  {
+    const CompressedBvhNode& node = compressed_nodes[stack[--stack_size]];
+    float bounds[2][3][4];
+    float t_near[4];
+    dequantize(node, bounds);
+    unsigned int mask = intersect_boxes(bounds, ray_data, r.tmin, r.tmax, t_near) & get_visible_lanes(node.visibility, r.type);
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      if(!(mask & (1u << c)))
+        continue;
+      if(node.count[c] == 0)
+      {
+        stack[stack_size++] = node.child[c];
+        continue;
+      }
+      if(triangles.occludes_range(r, node.child[c], node.count[c], hit_idx))
+        return true;
+    }
+  }
+  return false;
+}
+
+void CompressedBvhTree::collect_hits(const Ray& r, HitList& hits) const
+{
+  if(compressed_nodes.empty())
+    return;
+
+  RayBoxData ray_data(r);
+  StackEntry stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  stack[stack_size].idx = 0;
+  stack[stack_size].count = 0;
+  stack[stack_size].t = r.tmin;
+  ++stack_size;
+  while(stack_size > 0)
+  {
+    const StackEntry entry = stack[--stack_size];
+    if(entry.t > hits.get_tmax())
+      continue;
+
+    if(entry.count > 0)
+    {
+      for(unsigned int i = 0; i < entry.count; ++i)
+        triangles.add_hits(r, entry.idx + i, hits);
+      continue;
+    }
+
+    const CompressedBvhNode& node = compressed_nodes[entry.idx];
+    float bounds[2][3][4];
+    float t_near[4];
+    dequantize(node, bounds);
+    unsigned int mask = intersect_boxes(bounds, ray_data, r.tmin, hits.get_tmax(), t_near) & get_visible_lanes(node.visibility, r.type);
+    unsigned int first = stack_size;
+    for(unsigned int c = 0; c < 4; ++c)
+    {
+      if(!(mask & (1u << c)))
+        continue;
+      StackEntry child;
+      child.idx = node.child[c];
+      child.count = node.count[c];
+      child.t = t_near[c];
+      unsigned int j = stack_size++;
+      while(j > first && stack[j - 1].t < child.t)
+      {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      stack[j] = child;
+    }
+  }
+}
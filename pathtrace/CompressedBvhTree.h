@@ -0,0 +1,65 @@
+// 02576 Rendering Framework
+// Four-wide bounding volume hierarchy with quantized child bounds.
+// Copyright (c) DTU Compute 2013
+
+#ifndef COMPRESSEDBVHTREE_H
+#define COMPRESSEDBVHTREE_H
+
+#include <vector>
+#include "Ray.h"
+#include "Plane.h"
+#include "Bvh4Tree.h"
+
+/// Four-wide node padded to a cache line. The child bounds are stored with
+/// 8 bits per coordinate on a grid that has its origin in the lower corner
+/// of the node and cells of power of two size. Child bounds are rounded
+/// outward to the grid points.
+struct CompressedBvhNode
+{
+  float origin[3];                // lower corner of the grid
+  signed char exponent[3];        // grid cell size is 2^exponent along each axis
+  unsigned char no_of_children;
+  unsigned char count[4];         // number of triangles in leaf child (0 for interior children)
+  unsigned char bounds[2][3][4];  // [min/max][axis][child] in grid cells
+  unsigned int child[4];          // node index of interior child, first triangle of leaf child
+  unsigned short visibility;      // ray types that can hit objects in each child, packed as in TriangleStore
+  unsigned short padding;
+};
+
+/// The hierarchy is built as a Bvh4Tree and then compressed. Only the
+/// compressed nodes and the triangle store are kept, so the primitives
+/// used for building are released and refitting rebuilds the tree.
+class CompressedBvhTree : public Bvh4Tree
+{
+public:
+  CompressedBvhTree(unsigned int max_objects_in_leaf = 4, unsigned int max_levels_in_tree = 64)
+    : Bvh4Tree(max_objects_in_leaf, max_levels_in_tree)
+  { }
+
+  virtual void init(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes);
+  virtual bool closest_primitive(Ray& r, unsigned int& hit_idx) const;
+  virtual bool occluded(const Ray& r, unsigned int* occluder = 0) const;
+  virtual void closest_hits(RayPacket& packet) const;
+  virtual void refit();
+  virtual float get_sah_cost() const;
+  virtual size_t get_memory_usage() const;
+  virtual void save(CacheWriter& out) const;
+  virtual bool load(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes, CacheReader& in);
+
+  unsigned int get_no_of_compressed_nodes() const { return compressed_nodes.size(); }
+
+protected:
+  void compress_node(unsigned int wide_idx);
+  unsigned int add_leaf_node(unsigned int first, unsigned int count);
+  void set_node_bounds(unsigned int node_idx, const AABB* child_bbox);
+  unsigned int update_compressed_visibility(unsigned int node_idx);
+  bool check_compressed_nodes(unsigned int no_of_triangles) const;
+  bool intersect_compressed_nodes(Ray& r, unsigned int& hit_idx) const;
+  bool occlude_compressed_nodes(const Ray& r, unsigned int& hit_idx) const;
+  virtual void collect_hits(const Ray& r, HitList& hits) const;
+
+  std::vector<CompressedBvhNode> compressed_nodes;
+  std::vector<const Object3D*> objects;   // geometry given to init
+};
+
+#endif // COMPRESSEDBVHTREE_H
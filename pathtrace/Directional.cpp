@@ -37,10 +37,11 @@ bool Directional::sample(const Vec3f& pos, Vec3f& dir, Vec3f& L) const
 
   // test for shadow
   Ray shadowRay(pos, -light_dir);
+  shadowRay.type = ray_shadow;
   bool inShadow = false;
 
   if (shadows)
-    inShadow = tracer->trace(shadowRay);
+    inShadow = tracer->trace_shadow(shadowRay, get_occluder());
 
   return !inShadow;
 }
@@ -0,0 +1,494 @@
+// 02576 Rendering Framework
+// Bounding volume hierarchy that objects can be inserted into and removed from.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include "CGLA/Vec3f.h"
+#include "Ray.h"
+#include "AABB.h"
+#include "HitList.h"
+#include "DynamicBvhTree.h"
+
+using namespace std;
+using namespace CGLA;
+
+namespace
+{
+  const unsigned int STACK_SIZE = 128;   // Traversal stack size (deeper trees use a stack on the heap)
+
+  float get_union_area(const AABB& a, const AABB& b)
+  {
+    AABB u = a;
+    u.add_AABB(b);
+    return u.area();
+  }
+
+  // Node waiting on the traversal stack and the distance where the ray enters it
+  struct StackEntry
+  {
+    unsigned int node_idx;
+    float t_near;
+  };
+}
+
+void DynamicBvhTree::init(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes)
+{
+  nodes.clear();
+  object_leaves.clear();
+  free_handles.clear();
+  root = free_nodes = NO_NODE;
+  planes = scene_planes;
+  for(unsigned int i = 0; i < geometry.size(); ++i)
+    insert(geometry[i]);
+  built_sah_cost = get_sah_cost();
+}
+
+bool DynamicBvhTree::closest_primitive(Ray& r, unsigned int& hit_idx) const
+{
+  return intersect_nodes(r, hit_idx);
+}
+
+bool DynamicBvhTree::occluded(const Ray& r, unsigned int* occluder) const
+{
+  if(any_plane(r))
+    return true;
+
+  // The occluder is the index of a leaf
+  if(occluder && *occluder < nodes.size())
+  {
+    const DynamicBvhNode& node = nodes[*occluder];
+    Ray shadow = r;
+    if(node.is_leaf() && node.geometry && ((node.visibility >> r.type) & 1) && node.geometry->occludes(shadow, node.prim_idx))
+      return true;
+  }
+  unsigned int hit_idx;
+  if(!occlude_nodes(r, hit_idx))
+    return false;
+  if(occluder)
+    *occluder = hit_idx;
+  return true;
+}
+
+void DynamicBvhTree::refit()
+{
+  if(root != NO_NODE)
+    refit_node(root);
+}
+
+float DynamicBvhTree::get_sah_cost() const
+{
+  if(root == NO_NODE || nodes[root].bbox.area() <= 0.0f)
+    return Accelerator::get_sah_cost();
+  return get_sah_cost(root)/nodes[root].bbox.area();
+}
+
+size_t DynamicBvhTree::get_memory_usage() const
+{
+  size_t size = Accelerator::get_memory_usage() + nodes.capacity()*sizeof(DynamicBvhNode) + free_handles.capacity()*sizeof(unsigned int);
+  for(unsigned int i = 0; i < object_leaves.size(); ++i)
+    size += sizeof(vector<unsigned int>) + object_leaves[i].capacity()*sizeof(unsigned int);
+  return size;
+}
+
+unsigned int DynamicBvhTree::insert(const Object3D* object)
+{
+  unsigned int handle;
+  if(free_handles.empty())
+  {
+    handle = object_leaves.size();
+    object_leaves.push_back(vector<unsigned int>());
+  }
+  else
+  {
+    handle = free_handles.back();
+    free_handles.pop_back();
+  }
+  vector<unsigned int>& leaves = object_leaves[handle];
+  leaves.resize(object->get_no_of_primitives());
+  for(unsigned int i = 0; i < leaves.size(); ++i)
+  {
+    unsigned int leaf = allocate_node();
+    nodes[leaf].geometry = object;
+    nodes[leaf].prim_idx = i;
+    set_leaf(leaf);
+    insert_leaf(leaf);
+    leaves[i] = leaf;
+  }
+  return handle;
+}
+
+void DynamicBvhTree::remove(unsigned int handle)
+{
+  vector<unsigned int>& leaves = object_leaves[handle];
+  for(unsigned int i = 0; i < leaves.size(); ++i)
+  {
+    remove_leaf(leaves[i]);
+    free_node(leaves[i]);
+  }
+  vector<unsigned int>().swap(leaves);
+  free_handles.push_back(handle);
+}
+
+void DynamicBvhTree::update(unsigned int handle)
+{
+  const vector<unsigned int>& leaves = object_leaves[handle];
+  for(unsigned int i = 0; i < leaves.size(); ++i)
+  {
+    remove_leaf(leaves[i]);
+    set_leaf(leaves[i]);
+    insert_leaf(leaves[i]);
+  }
+}
+
+unsigned int DynamicBvhTree::allocate_node()
+{
+  unsigned int node_idx = free_nodes;
+  if(node_idx == NO_NODE)
+  {
+    node_idx = nodes.size();
+    nodes.push_back(DynamicBvhNode());
+  }
+  else
+    free_nodes = nodes[node_idx].parent;
+  DynamicBvhNode& node = nodes[node_idx];
+  node.geometry = 0;
+  node.prim_idx = 0;
+  node.parent = node.child[0] = node.child[1] = NO_NODE;
+  node.height = 0;
+  node.visibility = 0;
+  return node_idx;
+}
+
+void DynamicBvhTree::free_node(unsigned int node_idx)
+{
+  DynamicBvhNode& node = nodes[node_idx];
+  node.geometry = 0;
+  node.child[0] = node.child[1] = NO_NODE;
+  node.parent = free_nodes;
+  free_nodes = node_idx;
+}
+
+void DynamicBvhTree::set_leaf(unsigned int leaf)
+{
+  DynamicBvhNode& node = nodes[leaf];
+  node.bbox = node.geometry->get_primitive_bbox(node.prim_idx);
+  node.visibility = node.geometry->get_visibility();
+}
+
+void DynamicBvhTree::insert_leaf(unsigned int leaf)
+{
+  if(root == NO_NODE)
+  {
+    root = leaf;
+    nodes[leaf].parent = NO_NODE;
+    return;
+  }
+
+  // The new parent takes the place of the sibling
+  unsigned int sibling = find_sibling(nodes[leaf].bbox);
+  unsigned int old_parent = nodes[sibling].parent;
+  unsigned int parent = allocate_node();
+  nodes[parent].parent = old_parent;
+  nodes[parent].child[0] = sibling;
+  nodes[parent].child[1] = leaf;
+  nodes[sibling].parent = parent;
+  nodes[leaf].parent = parent;
+  if(old_parent == NO_NODE)
+    root = parent;
+  else
+  {
+    DynamicBvhNode& node = nodes[old_parent];
+    node.child[node.child[0] == sibling ? 0 : 1] = parent;
+  }
+  update_path(parent);
+}
+
+void DynamicBvhTree::remove_leaf(unsigned int leaf)
+{
+  if(leaf == root)
+  {
+    root = NO_NODE;
+    return;
+  }
+
+  // The sibling takes the place of the parent
+  unsigned int parent = nodes[leaf].parent;
+  unsigned int sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+  unsigned int grandparent = nodes[parent].parent;
+  nodes[sibling].parent = grandparent;
+  nodes[leaf].parent = NO_NODE;
+  free_node(parent);
+  if(grandparent == NO_NODE)
+    root = sibling;
+  else
+  {
+    DynamicBvhNode& node = nodes[grandparent];
+    node.child[node.child[0] == parent ? 0 : 1] = sibling;
+    update_path(grandparent);
+  }
+}
+
+unsigned int DynamicBvhTree::find_sibling(const AABB& bbox) const
+{
+  // Placing the leaf next to a node adds the area of their union and the
+  // growth of all the ancestors of the node. The growth of the ancestors
+  // plus the area of the leaf bounds the cost within a subtree.
+  float leaf_area = bbox.area();
+  unsigned int best = root;
+  float best_cost = get_union_area(nodes[root].bbox, bbox);
+  vector< pair<unsigned int, float> > stack(1, make_pair(root, 0.0f));
+  while(!stack.empty())
+  {
+    unsigned int node_idx = stack.back().first;
+    float inherited = stack.back().second;
+    stack.pop_back();
+    const DynamicBvhNode& node = nodes[node_idx];
+    float direct = get_union_area(node.bbox, bbox);
+    if(direct + inherited < best_cost)
+    {
+      best_cost = direct + inherited;
+      best = node_idx;
+    }
+    if(node.is_leaf())
+      continue;
+    inherited += direct - node.bbox.area();
+    if(leaf_area + inherited < best_cost)
+    {
+      stack.push_back(make_pair(node.child[0], inherited));
+      stack.push_back(make_pair(node.child[1], inherited));
+    }
+  }
+  return best;
+}
+
+void DynamicBvhTree::update_node(unsigned int node_idx)
+{
+  DynamicBvhNode& node = nodes[node_idx];
+  const DynamicBvhNode& left = nodes[node.child[0]];
+  const DynamicBvhNode& right = nodes[node.child[1]];
+  node.bbox = left.bbox;
+  node.bbox.add_AABB(right.bbox);
+  node.height = max(left.height, right.height) + 1;
+  node.visibility = left.visibility | right.visibility;
+}
+
+void DynamicBvhTree::update_path(unsigned int node_idx)
+{
+  while(node_idx != NO_NODE)
+  {
+    update_node(node_idx);
+    rotate(node_idx);
+    node_idx = nodes[node_idx].parent;
+  }
+}
+
+void DynamicBvhTree::rotate(unsigned int node_idx)
+{
+  // Swapping a child with a grandchild on the other side only changes the
+  // bounds of the child that receives the other one
+  DynamicBvhNode& node = nodes[node_idx];
+  float best_gain = 0.0f;
+  unsigned int best_side = 2, best_k = 0;
+  for(unsigned int side = 0; side < 2; ++side)
+  {
+    const DynamicBvhNode& moved = nodes[node.child[side]];
+    const DynamicBvhNode& other = nodes[node.child[1 - side]];
+    if(other.is_leaf())
+      continue;
+    for(unsigned int k = 0; k < 2; ++k)
+    {
+      const DynamicBvhNode& raised = nodes[other.child[k]];
+      const DynamicBvhNode& kept = nodes[other.child[1 - k]];
+      unsigned int other_height = max(moved.height, kept.height) + 1;
+      unsigned int height = max(static_cast<unsigned int>(raised.height), other_height) + 1;
+      float gain = other.bbox.area() - get_union_area(moved.bbox, kept.bbox);
+      if(height <= node.height && gain > best_gain)
+      {
+        best_gain = gain;
+        best_side = side;
+        best_k = k;
+      }
+    }
+  }
+  if(best_side == 2)
+    return;
+
+  unsigned int moved = node.child[best_side];
+  unsigned int other = node.child[1 - best_side];
+  unsigned int raised = nodes[other].child[best_k];
+  node.child[best_side] = raised;
+  nodes[raised].parent = node_idx;
+  nodes[other].child[best_k] = moved;
+  nodes[moved].parent = other;
+  update_node(other);
+  update_node(node_idx);
+}
+
+void DynamicBvhTree::refit_node(unsigned int node_idx)
+{
+  DynamicBvhNode& node = nodes[node_idx];
+  if(node.is_leaf())
+  {
+    set_leaf(node_idx);
+    return;
+  }
+  refit_node(node.child[0]);
+  refit_node(node.child[1]);
+  update_node(node_idx);
+}
+
+bool DynamicBvhTree::occlude_nodes(const Ray& r, unsigned int& hit_idx) const
+{
+  if(root == NO_NODE)
+    return false;
+
+  // Each level pushes at most one node
+  unsigned int local_stack[STACK_SIZE];
+  vector<unsigned int> heap_stack;
+  unsigned int* stack = local_stack;
+  if(nodes[root].height >= STACK_SIZE)
+  {
+    heap_stack.resize(nodes[root].height + 1);
+    stack = &heap_stack[0];
+  }
+  unsigned int stack_size = 0;
+
+  // Any hit will do, so children are visited in storage order
+  Vec3f inv_dir(1.0f/r.direction[0], 1.0f/r.direction[1], 1.0f/r.direction[2]);
+  unsigned int node_idx = root;
+  for(;;)
+  {
+    const DynamicBvhNode& node = nodes[node_idx];
+    float t_near = r.tmin;
+    if(((node.visibility >> r.type) & 1) && node.bbox.intersects(r.origin, inv_dir, t_near, r.tmax))
+    {
+      if(!node.is_leaf())
+      {
+        stack[stack_size++] = node.child[1];
+        node_idx = node.child[0];
+        continue;
+      }
+      Ray shadow = r;
+      if(node.geometry->occludes(shadow, node.prim_idx))
+      {
+        hit_idx = node_idx;
+        return true;
+      }
+    }
+    if(stack_size == 0)
+      return false;
+    node_idx = stack[--stack_size];
+  }
+}
+
+bool DynamicBvhTree::intersect_nodes(Ray& r, unsigned int& hit_idx) const
+{
+  if(root == NO_NODE)
+    return false;
+
+  // Each level pushes at most one node
+  StackEntry local_stack[STACK_SIZE];
+  vector<StackEntry> heap_stack;
+  StackEntry* stack = local_stack;
+  if(nodes[root].height >= STACK_SIZE)
+  {
+    heap_stack.resize(nodes[root].height + 1);
+    stack = &heap_stack[0];
+  }
+  unsigned int stack_size = 0;
+
+  Vec3f inv_dir(1.0f/r.direction[0], 1.0f/r.direction[1], 1.0f/r.direction[2]);
+  unsigned int node_idx = root;
+  float t_near = r.tmin;
+  if(!((nodes[root].visibility >> r.type) & 1) || !nodes[root].bbox.intersects(r.origin, inv_dir, t_near, r.tmax))
+    return false;
+  bool found = false;
+  for(;;)
+  {
+    const DynamicBvhNode& node = nodes[node_idx];
+    if(node.is_leaf())
+    {
+      if(node.geometry->intersect(r, node.prim_idx))
+      {
+        hit_idx = node_idx;
+        r.tmax = r.dist;
+        found = true;
+      }
+    }
+    else
+    {
+      // Visit the child that the ray enters first and keep the other
+      float t[2] = { r.tmin, r.tmin };
+      bool hit[2];
+      for(unsigned int k = 0; k < 2; ++k)
+      {
+        const DynamicBvhNode& child = nodes[node.child[k]];
+        hit[k] = ((child.visibility >> r.type) & 1) && child.bbox.intersects(r.origin, inv_dir, t[k], r.tmax);
+      }
+      if(hit[0] && hit[1])
+      {
+        unsigned int first = t[1] < t[0] ? 1 : 0;
+        stack[stack_size].node_idx = node.child[1 - first];
+        stack[stack_size].t_near = t[1 - first];
+        ++stack_size;
+        node_idx = node.child[first];
+        continue;
+      }
+      if(hit[0] || hit[1])
+      {
+        node_idx = node.child[hit[0] ? 0 : 1];
+        continue;
+      }
+    }
+
+    // Nodes entered beyond the closest hit found so far are skipped
+    do
+    {
+      if(stack_size == 0)
+        return found;
+      --stack_size;
+    }
+    while(stack[stack_size].t_near > r.tmax);
+    node_idx = stack[stack_size].node_idx;
+  }
+}
+
+void DynamicBvhTree::collect_hits(const Ray& r, HitList& hits) const
+{
+  if(root == NO_NODE)
+    return;
+
+  vector<unsigned int> stack(1, root);
+  Vec3f inv_dir(1.0f/r.direction[0], 1.0f/r.direction[1], 1.0f/r.direction[2]);
+  while(!stack.empty())
+  {
+    const DynamicBvhNode& node = nodes[stack.back()];
+    stack.pop_back();
+    float t_near = r.tmin;
+    if(!((node.visibility >> r.type) & 1) || !node.bbox.intersects(r.origin, inv_dir, t_near, hits.get_tmax()))
+      continue;
+    if(!node.is_leaf())
+    {
+      stack.push_back(node.child[0]);
+      stack.push_back(node.child[1]);
+      continue;
+    }
+    Ray tmp = r;
+    tmp.tmax = hits.get_tmax();
+    if(!node.geometry->add_hits(tmp, node.prim_idx, hits) && node.geometry->intersect(tmp, node.prim_idx))
+    {
+      node.geometry->finalize_hit(tmp, node.prim_idx);
+      hits.add(tmp);
+    }
+  }
+}
+
+float DynamicBvhTree::get_sah_cost(unsigned int node_idx) const
+{
+  const DynamicBvhNode& node = nodes[node_idx];
+  if(node.is_leaf())
+    return SAH_INTERSECTION_COST*node.bbox.area();
+  return SAH_TRAVERSAL_COST*node.bbox.area() + get_sah_cost(node.child[0]) + get_sah_cost(node.child[1]);
+}
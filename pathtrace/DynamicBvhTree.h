@@ -0,0 +1,93 @@
+// 02576 Rendering Framework
+// Bounding volume hierarchy that objects can be inserted into and removed from.
+// Copyright (c) DTU Compute 2013
+
+#ifndef DYNAMICBVHTREE_H
+#define DYNAMICBVHTREE_H
+
+#include <vector>
+#include "Ray.h"
+#include "AABB.h"
+#include "Object3D.h"
+#include "Plane.h"
+#include "Accelerator.h"
+
+const unsigned int NO_NODE = 0xffffffff;
+
+/// Node of a dynamic BVH. Leaves hold a single primitive. Nodes that are
+/// not in use are linked through their parent index.
+struct DynamicBvhNode
+{
+  AABB bbox;
+  const Object3D* geometry;    // leaves only
+  unsigned int prim_idx;
+  unsigned int parent;         // NO_NODE at the root
+  unsigned int child[2];       // NO_NODE in leaves
+  unsigned short height;       // 0 for leaves
+  unsigned short visibility;   // ray types that can hit something in the subtree
+
+  bool is_leaf() const { return child[0] == NO_NODE; }
+};
+
+/// Binary BVH with explicit links between the nodes, meant for the top
+/// level over a changing set of objects, such as the instances of a scene
+/// being edited. An object is inserted as one leaf per primitive next to
+/// the node where it adds the least surface area to the tree, found by a
+/// branch and bound search. Removal replaces the parent of a leaf by its
+/// sibling. The nodes on the path to the root are refitted, and rotations
+/// that swap a child with a grandchild are applied along the path when
+/// they lower the area of the tree without making it deeper. The tree
+/// must not be changed while rays are traced through it.
+class DynamicBvhTree : public Accelerator
+{
+public:
+  DynamicBvhTree() : root(NO_NODE), free_nodes(NO_NODE) { }
+
+  // Inserts the objects in the given order. Object i gets handle i.
+  virtual void init(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes);
+  virtual bool closest_primitive(Ray& r, unsigned int& hit_idx) const;
+  virtual void finalize_hit(Ray& r, unsigned int hit_idx) const { nodes[hit_idx].geometry->finalize_hit(r, nodes[hit_idx].prim_idx); }
+  virtual bool occluded(const Ray& r, unsigned int* occluder = 0) const;
+  virtual void refit();
+  virtual float get_sah_cost() const;
+  virtual size_t get_memory_usage() const;
+
+  // Dynamic trees are not stored in cache files
+  virtual bool load(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes, CacheReader& in) { return false; }
+
+  // Incremental updates. insert returns a handle that refers to the object
+  // until it is removed. Handles of removed objects are reused. After an
+  // object has been transformed or its visibility has changed, update
+  // reinserts its leaves, whereas refit only adjusts the bounds. None of
+  // them move the reference cost of get_sah_cost_growth. reset_sah_cost
+  // makes the current tree the reference, e.g. after a batch of inserts.
+  unsigned int insert(const Object3D* object);
+  void remove(unsigned int handle);
+  void update(unsigned int handle);
+  void reset_sah_cost() { built_sah_cost = get_sah_cost(); }
+  unsigned int get_no_of_objects() const { return object_leaves.size() - free_handles.size(); }
+
+private:
+  unsigned int allocate_node();
+  void free_node(unsigned int node_idx);
+  void set_leaf(unsigned int leaf);
+  void insert_leaf(unsigned int leaf);
+  void remove_leaf(unsigned int leaf);
+  unsigned int find_sibling(const AABB& bbox) const;
+  void update_node(unsigned int node_idx);
+  void update_path(unsigned int node_idx);
+  void rotate(unsigned int node_idx);
+  void refit_node(unsigned int node_idx);
+  bool occlude_nodes(const Ray& r, unsigned int& hit_idx) const;
+  bool intersect_nodes(Ray& r, unsigned int& hit_idx) const;
+  virtual void collect_hits(const Ray& r, HitList& hits) const;
+  float get_sah_cost(unsigned int node_idx) const;
+
+  std::vector<DynamicBvhNode> nodes;
+  unsigned int root;
+  unsigned int free_nodes;                                  // first node of the free list
+  std::vector< std::vector<unsigned int> > object_leaves;   // leaves of each handle
+  std::vector<unsigned int> free_handles;
+};
+
+#endif // DYNAMICBVHTREE_H
@@ -0,0 +1,58 @@
+// 02576 Rendering Framework
+// Hits along a ray collected by a multi-hit query.
+// Copyright (c) DTU Compute 2013
+
+#ifndef HITLIST_H
+#define HITLIST_H
+
+#include <vector>
+#include "Ray.h"
+
+const unsigned int HIT_FINALIZED = 0xffffffff;   // Primitive index of hits that need no finalize_hit
+
+/// Hits found along a ray in a single traversal, kept sorted by distance.
+/// If a maximum number of hits is given, only the closest are kept, and
+/// get_tmax tells how far along the ray new hits can still be added.
+/// Hits that still need finalize_hit carry the index of their primitive
+/// in the triangle store of the accelerator.
+class HitList
+{
+public:
+  HitList(float tmax, unsigned int max_hits = 0) : t_max(tmax), max_size(max_hits) { }
+
+  float get_tmax() const { return t_max; }
+  unsigned int get_max_hits() const { return max_size; }
+  unsigned int size() const { return hits.size(); }
+  const Ray& operator[](unsigned int i) const { return hits[i]; }
+  unsigned int get_primitive(unsigned int i) const { return prims[i]; }
+
+  // An object referenced by several leaves may report the same hit more
+  // than once. Such duplicates are recognized by their distance and face.
+  void add(const Ray& hit, unsigned int prim = HIT_FINALIZED)
+  {
+    if(hit.dist > t_max)
+      return;
+    unsigned int j = hits.size();
+    while(j > 0 && hits[j - 1].dist > hit.dist)
+      --j;
+    for(unsigned int k = j; k > 0 && hits[k - 1].dist == hit.dist; --k)
+      if(hits[k - 1].hit_object == hit.hit_object && hits[k - 1].hit_face_id == hit.hit_face_id)
+        return;
+    hits.insert(hits.begin() + j, hit);
+    prims.insert(prims.begin() + j, prim);
+    if(max_size > 0 && hits.size() >= max_size)
+    {
+      hits.resize(max_size);
+      prims.resize(max_size);
+      t_max = hits.back().dist;
+    }
+  }
+
+private:
+  std::vector<Ray> hits;
+  std::vector<unsigned int> prims;
+  float t_max;
+  unsigned int max_size;
+};
+
+#endif // HITLIST_H
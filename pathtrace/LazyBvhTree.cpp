@@ -0,0 +1,366 @@
+// 02576 Rendering Framework
+// Bounding volume hierarchy built on demand as rays reach its nodes.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include <algorithm>
+#include "CGLA/Vec3f.h"
+#include "Ray.h"
+#include "AccObj.h"
+#include "AABB.h"
+#include "BinnedSah.h"
+#include "LazyBvhTree.h"
+
+using namespace std;
+using namespace CGLA;
+
+namespace
+{
+  const unsigned int STACK_SIZE = 128;        // Traversal stack size (bounds the tree depth)
+  const unsigned int MAX_LEVEL = 96;          // Deeper nodes are split at the median
+  const unsigned int NO_OF_LOCKS = 64;        // Locks shared by the nodes being expanded
+
+  // Applies a predicate on objects to the indices of the objects
+  template<class Predicate>
+  struct ByIndex
+  {
+    ByIndex(const vector<AccObj*>& objects, const Predicate& predicate) : prims(objects), pred(predicate) { }
+
+    bool operator()(unsigned int i) const { return pred(prims[i]); }
+    bool operator()(unsigned int a, unsigned int b) const { return pred(prims[a], prims[b]); }
+
+    const vector<AccObj*>& prims;
+    Predicate pred;
+  };
+
+  template<class Predicate>
+  ByIndex<Predicate> by_index(const vector<AccObj*>& objects, const Predicate& predicate)
+  {
+    return ByIndex<Predicate>(objects, predicate);
+  }
+
+  // A node is marked as expanded after its children are written. The state
+  // is stored with release and read with acquire semantics, so a thread that
+  // sees the node expanded also sees its children.
+  unsigned int load_state(const volatile unsigned int& state)
+  {
+#ifdef __GNUC__
+    return __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+#else
+    unsigned int s = state;
+    #pragma omp flush
+    return s;
+#endif
+  }
+
+  void store_state(volatile unsigned int& state, unsigned int s)
+  {
+#ifdef __GNUC__
+    __atomic_store_n(&state, s, __ATOMIC_RELEASE);
+#else
+    #pragma omp flush
+    state = s;
+#endif
+  }
+}
+
+LazyBvhTree::LazyBvhTree(unsigned int max_objects_in_leaf)
+  : max_objects(max(max_objects_in_leaf, 1u))
+{
+#ifdef _OPENMP
+  locks.resize(NO_OF_LOCKS);
+  for(unsigned int i = 0; i < locks.size(); ++i)
+    omp_init_lock(&locks[i]);
+#endif
+}
+
+LazyBvhTree::~LazyBvhTree()
+{
+#ifdef _OPENMP
+  for(unsigned int i = 0; i < locks.size(); ++i)
+    omp_destroy_lock(&locks[i]);
+#endif
+}
+
+void LazyBvhTree::init(const vector<const Object3D*>& geometry, const vector<const Plane*>& scene_planes)
+{
+  // The triangle store keeps the primitives in their original order, and
+  // the leaves refer to them through a permutation of their indices
+  nodes.clear();
+  Accelerator::init(geometry, scene_planes);
+  tree_objects.resize(primitives.size());
+  for(unsigned int i = 0; i < tree_objects.size(); ++i)
+    tree_objects[i] = i;
+  reset();
+}
+
+bool LazyBvhTree::closest_primitive(Ray& r, unsigned int& hit_idx) const
+{
+  return intersect_nodes(r, false, hit_idx);
+}
+
+bool LazyBvhTree::occluded(const Ray& r, unsigned int* occluder) const
+{
+  if(any_plane(r) || hits_occluder(r, occluder))
+    return true;
+  Ray shadow = r;
+  unsigned int hit_idx;
+  if(!intersect_nodes(shadow, true, hit_idx))
+    return false;
+  if(occluder)
+    *occluder = hit_idx;
+  return true;
+}
+
+void LazyBvhTree::refit()
+{
+  // Splits chosen for the old geometry are dropped along with the bounds
+  Accelerator::refit();
+  reset();
+}
+
+float LazyBvhTree::get_sah_cost() const
+{
+  if(nodes.empty())
+    return Accelerator::get_sah_cost();
+  return get_sah_cost(0)/nodes[0].bbox.area();
+}
+
+size_t LazyBvhTree::get_memory_usage() const
+{
+  return Accelerator::get_memory_usage() + nodes.capacity()*sizeof(LazyBvhNode) + tree_objects.capacity()*sizeof(unsigned int);
+}
+
+unsigned int LazyBvhTree::get_no_of_expanded_nodes() const
+{
+  return nodes.empty() ? 0 : count_expanded_nodes(0);
+}
+
+void LazyBvhTree::reset()
+{
+  // Slots for the largest possible tree are allocated up front. Only the
+  // root is initialized, the other slots are written when their parent is
+  // expanded.
+  nodes.clear();
+  if(tree_objects.empty())
+    return;
+  nodes.resize(2*tree_objects.size() - 1);
+  LazyBvhNode& root = nodes[0];
+  root.bbox.reset();
+  for(unsigned int i = 0; i < primitives.size(); ++i)
+    root.bbox.add_AABB(primitives[i]->bbox);
+  root.first = 0;
+  root.count = tree_objects.size();
+  root.right = 0;
+  root.axis = 0;
+  root.level = 0;
+  root.state = root.count <= max_objects ? lazy_leaf : lazy_unexpanded;
+
+  // The cost changes as the tree grows, so there is no reference cost
+  built_sah_cost = 0.0f;
+}
+
+void LazyBvhTree::expand_node(unsigned int node_idx) const
+{
+  // Another thread may have expanded the node while this one waited for the lock
+#ifdef _OPENMP
+  omp_lock_t& lock = locks[node_idx%locks.size()];
+  omp_set_lock(&lock);
+#endif
+  if(nodes[node_idx].state == lazy_unexpanded)
+    split_node(node_idx);
+#ifdef _OPENMP
+  omp_unset_lock(&lock);
+#endif
+}
+
+void LazyBvhTree::split_node(unsigned int node_idx) const
+{
+  LazyBvhNode& node = nodes[node_idx];
+  unsigned int first = node.first;
+  unsigned int last = first + node.count;
+  unsigned int count = node.count;
+
+  AABB centroid_bbox;
+  for(unsigned int i = first; i < last; ++i)
+    centroid_bbox.add_point(primitives[tree_objects[i]]->bbox.get_center());
+  Vec3f extent = centroid_bbox.get_diagonal();
+
+  // Find the split with the lowest SAH cost among the bin boundaries of all three axes
+  ObjectSplit split;
+  if(node.level < MAX_LEVEL)
+  {
+    SahBin bins[3][SAH_BINS];
+    for(unsigned int i = first; i < last; ++i)
+      add_to_bins(primitives[tree_objects[i]], centroid_bbox, extent, bins);
+    find_object_split(bins, extent, split);
+  }
+  int best_axis = split.axis;
+
+  unsigned int middle;
+  if(best_axis >= 0)
+  {
+    InLeftBins in_left(best_axis, split.bin, centroid_bbox.p_min[best_axis], SAH_BINS/extent[best_axis]);
+    middle = partition(tree_objects.begin() + first, tree_objects.begin() + last, by_index(primitives, in_left)) - tree_objects.begin();
+  }
+  else
+  {
+    // No useful split (coincident centroids or too deep), split at the median along the longest axis
+    unsigned int axis = extent[1] > extent[0] ? 1 : 0;
+    axis = extent[2] > extent[axis] ? 2 : axis;
+    best_axis = axis;
+    middle = first + count/2;
+    nth_element(tree_objects.begin() + first, tree_objects.begin() + middle, tree_objects.begin() + last, by_index(primitives, CentroidLess(axis)));
+  }
+
+  // The left subtree takes the slots following its parent and the right
+  // subtree the slots after the 2m - 1 slots of the left subtree
+  unsigned int child_idx[2] = { node_idx + 1, node_idx + 2*(middle - first) };
+  unsigned int child_first[2] = { first, middle };
+  unsigned int child_last[2] = { middle, last };
+  for(unsigned int k = 0; k < 2; ++k)
+  {
+    LazyBvhNode& child = nodes[child_idx[k]];
+    child.bbox.reset();
+    for(unsigned int i = child_first[k]; i < child_last[k]; ++i)
+      child.bbox.add_AABB(primitives[tree_objects[i]]->bbox);
+    child.first = child_first[k];
+    child.count = child_last[k] - child_first[k];
+    child.right = 0;
+    child.axis = 0;
+    child.level = node.level + 1;
+    child.state = child.count <= max_objects ? lazy_leaf : lazy_unexpanded;
+  }
+  node.axis = best_axis;
+  node.right = child_idx[1];
+
+  // Threads that find the node expanded read its children without taking the lock
+  store_state(node.state, lazy_interior);
+}
+
+bool LazyBvhTree::intersect_nodes(Ray& r, bool stop_at_any_hit, unsigned int& hit_idx) const
+{
+  if(nodes.empty())
+    return false;
+
+  Vec3f inv_dir(1.0f/r.direction[0], 1.0f/r.direction[1], 1.0f/r.direction[2]);
+  unsigned int stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  unsigned int node_idx = 0;
+  bool found = false;
+  for(;;)
+  {
+    const LazyBvhNode& node = nodes[node_idx];
+    float t_near = r.tmin;
+    if(node.bbox.intersects(r.origin, inv_dir, t_near, r.tmax))
+    {
+      unsigned int state = load_state(node.state);
+      if(state == lazy_unexpanded)
+      {
+        expand_node(node_idx);
+        state = load_state(node.state);
+      }
+      if(state == lazy_leaf)
+      {
+        for(unsigned int i = node.first; i < node.first + node.count; ++i)
+        {
+          unsigned int prim_idx = tree_objects[i];
+          if(triangles.intersect(r, prim_idx))
+          {
+            if(stop_at_any_hit)
+            {
+              hit_idx = prim_idx;
+              return true;
+            }
+            r.tmax = r.dist;
+            hit_idx = prim_idx;
+            found = true;
+          }
+        }
+      }
+      else
+      {
+        // Descend into the child on the near side of the split first
+        if(r.direction[node.axis] < 0.0f)
+        {
+          stack[stack_size++] = node_idx + 1;
+          node_idx = node.right;
+        }
+        else
+        {
+          stack[stack_size++] = node.right;
+          node_idx = node_idx + 1;
+        }
+        continue;
+      }
+    }
+    if(stack_size == 0)
+      break;
+    node_idx = stack[--stack_size];
+  }
+  return found;
+}
+
+void LazyBvhTree::collect_hits(const Ray& r, HitList& hits) const
+{
+  if(nodes.empty())
+    return;
+
+  Vec3f inv_dir(1.0f/r.direction[0], 1.0f/r.direction[1], 1.0f/r.direction[2]);
+  unsigned int stack[STACK_SIZE];
+  unsigned int stack_size = 0;
+  unsigned int node_idx = 0;
+  for(;;)
+  {
+    const LazyBvhNode& node = nodes[node_idx];
+    float t_near = r.tmin;
+    if(node.bbox.intersects(r.origin, inv_dir, t_near, hits.get_tmax()))
+    {
+      unsigned int state = load_state(node.state);
+      if(state == lazy_unexpanded)
+      {
+        expand_node(node_idx);
+        state = load_state(node.state);
+      }
+      if(state == lazy_leaf)
+      {
+        for(unsigned int i = node.first; i < node.first + node.count; ++i)
+          triangles.add_hits(r, tree_objects[i], hits);
+      }
+      else
+      {
+        if(r.direction[node.axis] < 0.0f)
+        {
+          stack[stack_size++] = node_idx + 1;
+          node_idx = node.right;
+        }
+        else
+        {
+          stack[stack_size++] = node.right;
+          node_idx = node_idx + 1;
+        }
+        continue;
+      }
+    }
+    if(stack_size == 0)
+      return;
+    node_idx = stack[--stack_size];
+  }
+}
+
+float LazyBvhTree::get_sah_cost(unsigned int node_idx) const
+{
+  // Nodes that have not been expanded count as leaves
+  const LazyBvhNode& node = nodes[node_idx];
+  if(node.state != lazy_interior)
+    return SAH_INTERSECTION_COST*node.count*node.bbox.area();
+  return SAH_TRAVERSAL_COST*node.bbox.area() + get_sah_cost(node_idx + 1) + get_sah_cost(node.right);
+}
+
+unsigned int LazyBvhTree::count_expanded_nodes(unsigned int node_idx) const
+{
+  const LazyBvhNode& node = nodes[node_idx];
+  if(node.state != lazy_interior)
+    return 1;
+  return 1 + count_expanded_nodes(node_idx + 1) + count_expanded_nodes(node.right);
+}
@@ -0,0 +1,80 @@
+// 02576 Rendering Framework
+// Bounding volume hierarchy built on demand as rays reach its nodes.
+// Copyright (c) DTU Compute 2013
+
+#ifndef LAZYBVHTREE_H
+#define LAZYBVHTREE_H
+
+#include <vector>
+#include "Ray.h"
+#include "AccObj.h"
+#include "AABB.h"
+#include "Plane.h"
+#include "Accelerator.h"
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+enum LazyNodeState { lazy_unexpanded, lazy_interior, lazy_leaf };
+
+/// Node of a lazily built BVH. A node over n objects has its left child in
+/// the following slot and its right child after the 2m - 1 slots of a left
+/// subtree over m objects, so expanding a node never moves other nodes.
+struct LazyBvhNode
+{
+  AABB bbox;
+  unsigned int first;            // first object in tree_objects
+  unsigned int count;            // number of objects in the subtree
+  unsigned int right;            // index of the right child (interior nodes)
+  unsigned short axis;           // split axis (interior nodes)
+  unsigned short level;
+  volatile unsigned int state;   // LazyNodeState, written last when a node is expanded
+};
+
+/// Only the root is set up by init. An interior node is split the first
+/// time a ray reaches it, so parts of the scene that no ray visits are
+/// never subdivided. Rays can be traced from several threads while the
+/// tree grows. Expansion takes one of a set of locks selected by the node
+/// index, and a node is only marked as expanded after its children are
+/// written.
+class LazyBvhTree : public Accelerator
+{
+public:
+  LazyBvhTree(unsigned int max_objects_in_leaf = 4);
+  virtual ~LazyBvhTree();
+
+  virtual void init(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes);
+  virtual bool closest_primitive(Ray& r, unsigned int& hit_idx) const;
+  virtual bool occluded(const Ray& r, unsigned int* occluder = 0) const;
+  virtual void refit();
+  virtual float get_sah_cost() const;
+  virtual size_t get_memory_usage() const;
+
+  // Lazily built trees are not stored in cache files
+  virtual bool load(const std::vector<const Object3D*>& geometry, const std::vector<const Plane*>& planes, CacheReader& in) { return false; }
+
+  unsigned int get_no_of_expanded_nodes() const;
+
+private:
+  LazyBvhTree(const LazyBvhTree&);
+  LazyBvhTree& operator=(const LazyBvhTree&);
+
+  void reset();
+  void expand_node(unsigned int node_idx) const;
+  void split_node(unsigned int node_idx) const;
+  bool intersect_nodes(Ray& r, bool stop_at_any_hit, unsigned int& hit_idx) const;
+  virtual void collect_hits(const Ray& r, HitList& hits) const;
+  float get_sah_cost(unsigned int node_idx) const;
+  unsigned int count_expanded_nodes(unsigned int node_idx) const;
+
+  // Expansion changes the tree from within const queries
+  mutable std::vector<LazyBvhNode> nodes;
+  mutable std::vector<unsigned int> tree_objects;
+  unsigned int max_objects;
+#ifdef _OPENMP
+  mutable std::vector<omp_lock_t> locks;
+#endif
+};
+
+#endif // LAZYBVHTREE_H
@@ -5,16 +5,28 @@
 #ifndef LIGHT_H
 #define LIGHT_H
 
+#include <vector>
 #include "CGLA/Vec3f.h"
 #include "Ray.h"
+#include "Threads.h"
 
 class RayTracer;
 
+/// Last object that blocked a shadow ray toward a light, followed by a
+/// cache line of padding so that no line holds the caches of two threads.
+struct OccluderCache
+{
+  OccluderCache() : occluder(~0u) { }
+
+  unsigned int occluder;
+  char padding[CACHE_LINE_SIZE];
+};
+
 class Light
 {
 public:
   Light(RayTracer* ray_tracer, unsigned int no_of_samples = 1) 
-    : tracer(ray_tracer), samples(no_of_samples), shadows(true) 
+    : tracer(ray_tracer), samples(no_of_samples), shadows(true), occluders(get_max_threads())
   { }
 
   virtual bool sample(const CGLA::Vec3f& pos, CGLA::Vec3f& dir, CGLA::Vec3f& L) const = 0;
@@ -27,9 +39,19 @@ public:
   bool generating_shadows() const { return shadows; }
 
 protected:
+  // Occluder cache of the calling thread, which shadow rays test first
+  unsigned int* get_occluder() const
+  {
+    unsigned int thread = get_thread_num();
+    return thread < occluders.size() ? &occluders[thread].occluder : 0;
+  }
+
   bool shadows;
   unsigned int samples;
   RayTracer* tracer;
+
+private:
+  mutable std::vector<OccluderCache> occluders;
 };
 
 #endif // LIGHT_H
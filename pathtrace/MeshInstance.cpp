@@ -0,0 +1,126 @@
+// 02576 Rendering Framework
+// Placement of an accelerator built in object space within the scene.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include "CGLA/Mat4x4f.h"
+#include "CGLA/Vec3f.h"
+#include "Ray.h"
+#include "AABB.h"
+#include "HitList.h"
+#include "Accelerator.h"
+#include "MeshInstance.h"
+
+using namespace std;
+using namespace CGLA;
+
+MeshInstance::MeshInstance(const Accelerator* bottom_level_tree, const AABB& object_bbox, const Mat4x4f& transform)
+  : bottom_level(bottom_level_tree), bbox(object_bbox)
+{
+  set_transform(transform);
+}
+
+bool MeshInstance::intersect(Ray& r, unsigned int prim_idx) const
+{
+  // The object space direction is not normalized, so distances along
+  // the ray are the same in both spaces
+  Ray object_ray = r;
+  object_ray.has_hit = false;
+  if(!is_identity)
+  {
+    object_ray.origin = to_object.mul_3D_point(r.origin);
+    object_ray.direction = to_object.mul_3D_vector(r.direction);
+  }
+  unsigned int hit_idx;
+  if(!bottom_level->closest_primitive(object_ray, hit_idx))
+    return false;
+
+  // Only the closest of the hits with the instances is finalized. Until
+  // then hit_face_id is the primitive hit in the bottom level.
+  r.has_hit = true;
+  r.dist = object_ray.dist;
+  r.u = object_ray.u;
+  r.v = object_ray.v;
+  r.hit_object = object_ray.hit_object;
+  r.hit_face_id = hit_idx;
+  return true;
+}
+
+void MeshInstance::finalize_hit(Ray& r, unsigned int prim_idx) const
+{
+  Ray object_ray = r;
+  if(!is_identity)
+  {
+    object_ray.origin = to_object.mul_3D_point(r.origin);
+    object_ray.direction = to_object.mul_3D_vector(r.direction);
+  }
+  bottom_level->finalize_hit(object_ray, r.hit_face_id);
+  r.u = object_ray.u;
+  r.v = object_ray.v;
+  r.hit_face_id = object_ray.hit_face_id;
+  r.hit_normal = is_identity ? object_ray.hit_normal : normalize(normal_to_world.mul_3D_vector(object_ray.hit_normal));
+}
+
+bool MeshInstance::occludes(Ray& r, unsigned int prim_idx) const
+{
+  if(is_identity)
+    return bottom_level->occluded(r);
+  Ray object_ray(to_object.mul_3D_point(r.origin), to_object.mul_3D_vector(r.direction), r.tmin, r.tmax);
+  object_ray.type = r.type;
+  return bottom_level->occluded(object_ray);
+}
+
+bool MeshInstance::add_hits(const Ray& r, unsigned int prim_idx, HitList& hits) const
+{
+  Ray object_ray = r;
+  object_ray.has_hit = false;
+  if(!is_identity)
+  {
+    object_ray.origin = to_object.mul_3D_point(r.origin);
+    object_ray.direction = to_object.mul_3D_vector(r.direction);
+  }
+  vector<Ray> object_hits;
+  bottom_level->all_hits(object_ray, object_hits, hits.get_max_hits());
+  for(unsigned int i = 0; i < object_hits.size(); ++i)
+  {
+    const Ray& object_hit = object_hits[i];
+    Ray hit = r;
+    hit.has_hit = true;
+    hit.dist = object_hit.dist;
+    hit.u = object_hit.u;
+    hit.v = object_hit.v;
+    hit.hit_object = object_hit.hit_object;
+    hit.hit_face_id = object_hit.hit_face_id;
+    hit.hit_normal = is_identity ? object_hit.hit_normal : normalize(normal_to_world.mul_3D_vector(object_hit.hit_normal));
+    hits.add(hit);
+  }
+  return true;
+}
+
+void MeshInstance::transform(const Mat4x4f& m)
+{
+  set_transform(m*to_world);
+}
+
+AABB MeshInstance::compute_bbox() const
+{
+  if(is_identity)
+    return bbox;
+
+  AABB world_bbox;
+  for(unsigned int i = 0; i < 8; ++i)
+    world_bbox.add_point(to_world.mul_3D_point((bbox.*get_corner[i])()));
+  return world_bbox;
+}
+
+void MeshInstance::set_transform(const Mat4x4f& transform)
+{
+  to_world = transform;
+  to_object = invert_affine(transform);
+  normal_to_world = transpose(to_object);
+  is_identity = true;
+  for(unsigned int i = 0; i < 4; ++i)
+    for(unsigned int j = 0; j < 4; ++j)
+      if(to_world[i][j] != (i == j ? 1.0f : 0.0f))
+        is_identity = false;
+}
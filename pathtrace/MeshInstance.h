@@ -0,0 +1,44 @@
+// 02576 Rendering Framework
+// Placement of an accelerator built in object space within the scene.
+// Copyright (c) DTU Compute 2013
+
+#ifndef MESHINSTANCE_H
+#define MESHINSTANCE_H
+
+#include "CGLA/Mat4x4f.h"
+#include "AABB.h"
+#include "Object3D.h"
+
+class Accelerator;
+
+/// An instance is a single primitive in the top level of a two level
+/// accelerator. Rays are transformed into the object space of the
+/// bottom level structure of the instance, which is shared by all
+/// instances of the same geometry.
+class MeshInstance : public Object3D
+{
+public:
+  MeshInstance(const Accelerator* bottom_level, const AABB& object_bbox, const CGLA::Mat4x4f& transform = CGLA::identity_Mat4x4f());
+
+  virtual bool intersect(Ray& r, unsigned int prim_idx) const;
+  virtual void finalize_hit(Ray& r, unsigned int prim_idx) const;
+  virtual bool occludes(Ray& r, unsigned int prim_idx) const;
+  virtual bool add_hits(const Ray& r, unsigned int prim_idx, HitList& hits) const;
+  virtual void transform(const CGLA::Mat4x4f& m);
+  virtual AABB compute_bbox() const;
+
+  void set_transform(const CGLA::Mat4x4f& transform);
+  void set_object_bbox(const AABB& object_bbox) { bbox = object_bbox; }
+  const CGLA::Mat4x4f& get_transform() const { return to_world; }
+  const Accelerator* get_bottom_level() const { return bottom_level; }
+
+private:
+  const Accelerator* bottom_level;
+  AABB bbox;                     // bounds of the geometry in object space
+  CGLA::Mat4x4f to_world;
+  CGLA::Mat4x4f to_object;
+  CGLA::Mat4x4f normal_to_world; // transposed inverse of the world transform
+  bool is_identity;
+};
+
+#endif // MESHINSTANCE_H
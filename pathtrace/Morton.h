@@ -0,0 +1,48 @@
+// 02576 Rendering Framework
+// Morton codes of points quantized to a grid over a bounding box.
+// Copyright (c) DTU Compute 2013
+
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "CGLA/Vec3f.h"
+#include "AABB.h"
+
+inline unsigned int spread_bits(unsigned int x)
+{
+  // Insert two zero bits after each of the lower ten bits
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+/// Grid with 2^bits cells per axis over a bounding box, for up to ten
+/// bits. The code of a point interleaves the bits of the coordinates of
+/// its cell, so points with nearby codes lie close together.
+class MortonGrid
+{
+public:
+  MortonGrid(const AABB& bbox, unsigned int bits) : p_min(bbox.p_min)
+  {
+    CGLA::Vec3f extent = bbox.get_diagonal();
+    for(unsigned int j = 0; j < 3; ++j)
+      scale[j] = extent[j] > 0.0f ? ((1 << bits) - 1)/extent[j] : 0.0f;
+  }
+
+  unsigned int get_code(const CGLA::Vec3f& p) const
+  {
+    unsigned int code = 0;
+    for(unsigned int j = 0; j < 3; ++j)
+      code |= spread_bits(static_cast<unsigned int>((p[j] - p_min[j])*scale[j] + 0.5f)) << j;
+    return code;
+  }
+
+private:
+  CGLA::Vec3f p_min;
+  CGLA::Vec3f scale;
+};
+
+#endif // MORTON_H
@@ -9,11 +9,36 @@
 #include "AABB.h"
 
 struct Ray;
+class HitList;
+class CacheHash;
+
+// Kinds of rays. An object is only hit by the rays whose type has its bit
+// (1 << type) set in the visibility mask of the object.
+enum RayType { ray_camera, ray_shadow, ray_indirect, ray_photon, NO_OF_RAY_TYPES };
+const unsigned int VISIBLE_TO_ALL = (1u << NO_OF_RAY_TYPES) - 1;
 
 class Object3D
 {
 public:
+  Object3D() : visibility(VISIBLE_TO_ALL) { }
+  virtual ~Object3D() { }
+
   virtual bool intersect(Ray& r, unsigned int prim_idx) const = 0;
+
+  // Compute the hit attributes that intersect leaves out. Called by the
+  // accelerators for the closest hit only. An object may keep what it
+  // needs for this in hit_face_id, so finalize_hit sets it again.
+  virtual void finalize_hit(Ray& r, unsigned int prim_idx) const { }
+
+  // Test for any hit between tmin and tmax. The hit attributes of r may be
+  // overwritten, so callers pass a copy of rays they need to keep.
+  virtual bool occludes(Ray& r, unsigned int prim_idx) const { return intersect(r, prim_idx); }
+
+  // Multi-hit queries. Objects with several surfaces along a ray, such as
+  // instances, add all their finalized hits between r.tmin and r.tmax to
+  // the list and return true. Other objects are intersected once.
+  virtual bool add_hits(const Ray& r, unsigned int prim_idx, HitList& hits) const { return false; }
+
   virtual void transform(const CGLA::Mat4x4f& m) = 0;
   virtual AABB compute_bbox() const = 0;
   virtual void compute_bsphere(CGLA::Vec3f& center, float& radius) const
@@ -24,6 +49,20 @@ public:
   }
   virtual AABB get_primitive_bbox(unsigned int prim_idx) const { return compute_bbox(); }
   virtual unsigned int get_no_of_primitives() const { return 1; }
+
+  // Add everything that determines the shape of the object to a cache
+  // hash. Objects that cannot be hashed, such as instances, which refer to
+  // accelerators in memory, return false, and structures over them are not
+  // cached.
+  virtual bool add_to_hash(CacheHash& hash) const { return false; }
+
+  // Accelerators copy the mask when they are built or refitted
+  unsigned int get_visibility() const { return visibility; }
+  void set_visibility(unsigned int mask) { visibility = mask & VISIBLE_TO_ALL; }
+  bool is_visible_to(RayType type) const { return (visibility >> type) & 1; }
+
+private:
+  unsigned int visibility;
 };
 
 #endif // OBJECT3D_H
\ No newline at end of file
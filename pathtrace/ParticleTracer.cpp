@@ -166,48 +166,18 @@ void ParticleTracer::build_maps(int no_of_caustic_particles,
   global.balance();
 }
 
-Vec3f ParticleTracer::compute_pixel(unsigned int x, unsigned int y) const
+Vec3f ParticleTracer::shade_view_ray(Ray& r, const Vec2f& pixel_pos) const
 {
-  Vec3f result(0.0);
-  Vec2f vp_pos = Vec2f(x, y)*win_to_vp + lower_left;
-
-  for(unsigned int i = 0; i < jitter.size(); ++i)
-  {
-    Ray r = scene->get_camera()->get_ray(vp_pos + jitter[i]);
-    if(scene->intersect(r))
-    {
-      const Shader* s = get_shader(r);
-      if(s)
-        result += s->shade(r);
-      if(render_tex.has_texture())
-      {
-        Vec2f pixel_pos = vp_pos - lower_left;
-        result += render_tex.sample_nearest(pixel_pos[0], 1.0f - pixel_pos[1] - win_to_vp[1]);
-      }
-    }
-    else
-      result += get_background(r.direction);
-  }
-  return result/static_cast<float>(jitter.size());
-}
-
-void ParticleTracer::update_pixel(unsigned int x, unsigned int y, float sample_number, Vec3f& L) const
-{
-  Vec2f vp_pos = Vec2f(x + mt_random(), y + mt_random())*win_to_vp;
-  Ray r = scene->get_camera()->get_ray(vp_pos + lower_left);
-
-  L *= sample_number;
-  if(trace(r))
-  {
-    const Shader* s = get_shader(r);
-    if(s)
-      L += s->shade(r);
-    if(render_tex.has_texture())
-      L += render_tex.sample_nearest(vp_pos[0], 1.0f - vp_pos[1] - win_to_vp[1]);
-  }
-  else
-    L += get_background(r.direction);
-	L /= sample_number + 1.0f;
+  if(!r.has_hit)
+    return get_background(r.direction);
+
+  Vec3f result(0.0f);
+  const Shader* s = get_shader(r);
+  if(s)
+    result += s->shade(r);
+  if(render_tex.has_texture())
+    result += render_tex.sample_nearest(pixel_pos[0], 1.0f - pixel_pos[1] - win_to_vp[1]);
+  return result;
 }
 
 Vec3f ParticleTracer::caustics_irradiance(const Ray& r, float max_distance, int no_of_particles) const
@@ -342,7 +312,11 @@ void ParticleTracer::trace_particle(const Light* light, const unsigned int caust
     // Continue tracing if not absorbed
     if(mt_random() < prob)
     {
-      r = Ray(r.hit_pos, sample_cosine_weighted(r.hit_normal));
+      Ray diffuse(r.hit_pos, sample_cosine_weighted(r.hit_normal));
+      diffuse.trace_depth = r.trace_depth + 1;
+      diffuse.did_hit_diffuse = true;
+      diffuse.type = ray_photon;
+      r = diffuse;
       if(!trace(r))
         return;
       Phi *= rho_d/prob;
@@ -29,9 +29,6 @@ public:
   void draw_caustics_map();
   void draw_global_map();
 
-  virtual CGLA::Vec3f compute_pixel(unsigned int x, unsigned int y) const;
-	virtual void update_pixel(unsigned int x, unsigned int y, float sample_number, CGLA::Vec3f& L) const;
-
   CGLA::Vec3f caustics_irradiance(const Ray& r, float max_distance, int no_of_particles) const;
   CGLA::Vec3f global_irradiance(const Ray& r, float max_distance, int no_of_particles) const;
 
@@ -44,6 +41,7 @@ public:
   void set_use_textures_in_splat(bool use_textures_in_splat) { use_textures = use_textures_in_splat; } 
 
 protected:
+  virtual CGLA::Vec3f shade_view_ray(Ray& r, const CGLA::Vec2f& pixel_pos) const;
   void trace_particle(const Light* light, const unsigned int caustics_done, const unsigned int global_done);
   bool disperse_particle(Ray& r, const ObjMaterial*& m, int& color_band, CGLA::Vec3f& Phi) const;
   CGLA::Vec3f get_diffuse(const Ray& r) const;
@@ -2,30 +2,57 @@
 // Written by Jeppe Revall Frisvad, 2013
 // Copyright (c) DTU Compute 2013
 
+#include <algorithm>
 #include "CGLA/Vec3f.h"
 #include "CGLA/Vec2f.h"
 #include "Ray.h"
+#include "RayPacket.h"
 #include "mt_random.h"
 #include "sampler.h"
 #include "PathTracer.h"
 
+using namespace std;
 using namespace CGLA;
 
+namespace
+{
+  // Scattered photons are still photons. Other scattered rays are indirect.
+  RayType get_scattered_type(const Ray& in)
+  {
+    return in.type == ray_photon ? ray_photon : ray_indirect;
+  }
+}
+
 void PathTracer::update_pixel(unsigned int x, unsigned int y, float sample_number, Vec3f& L) const
 {
   Vec2f vp_pos = Vec2f(x + mt_random(), y + mt_random())*win_to_vp + lower_left;
   Ray r = scene->get_camera()->get_ray(vp_pos);
 
 	L *= sample_number;
-  if(trace(r))
+  trace(r);
+  L += shade_view_ray(r, vp_pos - lower_left);
+	L /= sample_number + 1.0f;
+}
+
+void PathTracer::update_tile(unsigned int x, unsigned int y, float sample_number, Vec3f* image) const
+{
+  unsigned int tile_width = min(PACKET_WIDTH, width - x);
+  unsigned int tile_height = min(PACKET_WIDTH, height - y);
+  Vec2f vp_pos[PACKET_SIZE];
+  RayPacket packet;
+  packet.size = tile_width*tile_height;
+  for(unsigned int k = 0; k < packet.size; ++k)
+    vp_pos[k] = Vec2f(x + k%tile_width + mt_random(), y + k/tile_width + mt_random())*win_to_vp + lower_left;
+  scene->get_camera()->get_rays(vp_pos, packet.rays, packet.size);
+  scene->intersect(packet);
+
+  for(unsigned int k = 0; k < packet.size; ++k)
   {
-    const Shader* s = get_shader(r);
-    if(s)
-      L += s->shade(r);
+    Vec3f& L = image[x + k%tile_width + (y + k/tile_width)*width];
+    L *= sample_number;
+    L += shade_view_ray(packet.rays[k], vp_pos[k] - lower_left);
+    L /= sample_number + 1.0f;
   }
-  else
-    L += get_background(r.direction);
-	L /= sample_number + 1.0f;
 }
 
 bool PathTracer::trace_cosine_weighted(const Ray& in, Ray& out) const
@@ -34,6 +61,7 @@ bool PathTracer::trace_cosine_weighted(const Ray& in, Ray& out) const
   out.direction = sample_cosine_weighted(in.hit_normal);
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = get_scattered_type(in);
   return trace(out);
 }
 
@@ -43,6 +71,7 @@ bool PathTracer::trace_hemisphere(const Ray& in, Ray& out) const
   out.direction = sample_hemisphere(in.hit_normal);
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = get_scattered_type(in);
   return trace(out);  
 }
 
@@ -52,6 +81,7 @@ bool PathTracer::trace_isotropic(const Ray& in, Ray& out, double distance) const
 
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = get_scattered_type(in);
   return trace(out);
 }
 
@@ -61,6 +91,7 @@ bool PathTracer::trace_HG(const Ray& in, Ray& out, double distance, double g) co
 
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = get_scattered_type(in);
   return trace(out);
 }
 
@@ -70,6 +101,7 @@ bool PathTracer::trace_Phong_distribution(const Ray& in, Ray& out) const
   out.direction = sample_Phong_distribution(in.hit_normal, -in.direction, in.get_hit_material()->shininess);
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = get_scattered_type(in);
   return trace(out);
 }
 
@@ -79,5 +111,6 @@ bool PathTracer::trace_Blinn_distribution(const Ray& in, Ray& out) const
   out.direction = sample_Blinn_distribution(in.hit_normal, -in.direction, in.get_hit_material()->shininess);
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = get_scattered_type(in);
   return trace(out);
 }
@@ -17,6 +17,7 @@ public:
   { }  
 
 	void update_pixel(unsigned int x, unsigned int y, float sample_number, CGLA::Vec3f& L) const;
+  void update_tile(unsigned int x, unsigned int y, float sample_number, CGLA::Vec3f* image) const;
 
   bool trace_cosine_weighted(const Ray& in, Ray& out) const;
   bool trace_hemisphere(const Ray& in, Ray& out) const;
@@ -0,0 +1,314 @@
+// 02576 Rendering Framework
+// Analytic sphere, disk, and cylinder primitives.
+// Copyright (c) DTU Compute 2013
+
+#include <cmath>
+#include <algorithm>
+#include <GL/glut.h>
+#include "CGLA/Vec3f.h"
+#include "CGLA/Vec3i.h"
+#include "CGLA/Mat4x4f.h"
+#include "Ray.h"
+#include "AABB.h"
+#include "HitList.h"
+#include "AcceleratorCache.h"
+#include "Quadric.h"
+
+using namespace std;
+using namespace CGLA;
+
+namespace
+{
+  const unsigned int SLICES = 48;   // Subdivision used for drawing
+  const unsigned int STACKS = 24;
+
+  // Tells the shapes apart in cache hashes
+  enum QuadricShape { shape_sphere, shape_disk, shape_cylinder };
+
+  // Roots of a*t^2 + 2*b*t + c = 0 in increasing order. The root further
+  // from zero is computed first and the other one from their product,
+  // which avoids cancellation when b*b is much larger than a*c.
+  bool solve_quadratic(float a, float b, float c, float t[2])
+  {
+    float disc = b*b - a*c;
+    if(disc < 0.0f)
+      return false;
+    float q = b < 0.0f ? sqrt(disc) - b : -b - sqrt(disc);
+    if(q == 0.0f)
+      return false;
+    t[0] = q/a;
+    t[1] = c/q;
+    if(t[0] > t[1])
+      swap(t[0], t[1]);
+    return true;
+  }
+
+  // Rotate the z-axis of the GLU shapes to the given frame
+  void mult_frame(const Vec3f& origin, const Vec3f& x, const Vec3f& y, const Vec3f& z)
+  {
+    GLfloat m[16] = { x[0], x[1], x[2], 0.0f,
+                      y[0], y[1], y[2], 0.0f,
+                      z[0], z[1], z[2], 0.0f,
+                      origin[0], origin[1], origin[2], 1.0f };
+    glMultMatrixf(m);
+  }
+
+  float get_angle(const Vec3f& d, const Vec3f& x, const Vec3f& y)
+  {
+    float phi = atan2(dot(d, y), dot(d, x));
+    return 0.5f + phi*static_cast<float>(0.5/M_PI);
+  }
+}
+
+Quadric::Quadric(const ObjMaterial& material)
+{
+  mesh.geometry.add_vertex(Vec3f(0.0f));
+  mesh.geometry.add_face(Vec3i(0, 0, 0));
+  mesh.texcoords.add_vertex(Vec3f(0.0f));
+  mesh.texcoords.add_vertex(Vec3f(1.0f, 0.0f, 0.0f));
+  mesh.texcoords.add_vertex(Vec3f(0.0f, 1.0f, 0.0f));
+  mesh.texcoords.add_face(Vec3i(0, 1, 2));
+  mesh.materials.push_back(material);
+  mesh.mat_idx.push_back(0);
+}
+
+bool Quadric::intersect(Ray& r, unsigned int prim_idx) const
+{
+  float t[2];
+  if(find_hits(r, t) == 0)
+    return false;
+  r.has_hit = true;
+  r.dist = t[0];
+  r.hit_object = &mesh;
+  r.hit_face_id = prim_idx;
+  return true;
+}
+
+void Quadric::finalize_hit(Ray& r, unsigned int prim_idx) const
+{
+  r.hit_face_id = prim_idx;
+  r.hit_pos = r.origin + r.dist*r.direction;
+  compute_hit(r.hit_pos, r.hit_normal, r.u, r.v);
+}
+
+bool Quadric::add_hits(const Ray& r, unsigned int prim_idx, HitList& hits) const
+{
+  float t[2];
+  unsigned int no_of_hits = find_hits(r, t);
+  for(unsigned int i = 0; i < no_of_hits; ++i)
+  {
+    Ray hit = r;
+    hit.has_hit = true;
+    hit.dist = t[i];
+    hit.hit_object = &mesh;
+    hit.hit_face_id = prim_idx;
+    finalize_hit(hit, prim_idx);
+    hits.add(hit);
+  }
+  return true;
+}
+
+float Quadric::get_scale(const Mat4x4f& m)
+{
+  return length(m.mul_3D_vector(Vec3f(1.0f, 0.0f, 0.0f)));
+}
+
+Sphere::Sphere(const Vec3f& c, float r, const ObjMaterial& material)
+  : Quadric(material), center(c), radius(r)
+{
+  mesh.geometry.vertex_rw(0) = center;
+}
+
+unsigned int Sphere::find_hits(const Ray& r, float t[2]) const
+{
+  Vec3f oc = r.origin - center;
+  float roots[2];
+  if(!solve_quadratic(dot(r.direction, r.direction), dot(oc, r.direction), dot(oc, oc) - radius*radius, roots))
+    return 0;
+  unsigned int no_of_hits = 0;
+  for(unsigned int i = 0; i < 2; ++i)
+    if(roots[i] >= r.tmin && roots[i] <= r.tmax)
+      t[no_of_hits++] = roots[i];
+  return no_of_hits;
+}
+
+void Sphere::compute_hit(const Vec3f& p, Vec3f& n, float& u, float& v) const
+{
+  n = (p - center)/radius;
+  u = get_angle(n, Vec3f(1.0f, 0.0f, 0.0f), Vec3f(0.0f, 0.0f, -1.0f));
+  v = acos(max(-1.0f, min(n[1], 1.0f)))*static_cast<float>(1.0/M_PI);
+}
+
+void Sphere::transform(const Mat4x4f& m)
+{
+  radius *= get_scale(m);
+  center = m.mul_3D_point(center);
+  mesh.geometry.vertex_rw(0) = center;
+}
+
+AABB Sphere::compute_bbox() const
+{
+  return AABB(center - Vec3f(radius), center + Vec3f(radius));
+}
+
+bool Sphere::add_to_hash(CacheHash& hash) const
+{
+  hash.add(static_cast<unsigned int>(shape_sphere));
+  hash.add(center);
+  hash.add(radius);
+  return true;
+}
+
+void Sphere::draw() const
+{
+  glPushMatrix();
+  glTranslatef(center[0], center[1], center[2]);
+  glutSolidSphere(radius, SLICES, STACKS);
+  glPopMatrix();
+}
+
+Disk::Disk(const Vec3f& c, const Vec3f& n, float r, const ObjMaterial& material)
+  : Quadric(material), center(c), normal(normalize(n)), radius(r)
+{
+  onb(normal, tangent, binormal);
+  mesh.geometry.vertex_rw(0) = center;
+}
+
+unsigned int Disk::find_hits(const Ray& r, float t[2]) const
+{
+  float cos_theta = dot(r.direction, normal);
+  if(fabs(cos_theta) < 1.0e-12f)
+    return 0;
+  t[0] = dot(center - r.origin, normal)/cos_theta;
+  if(t[0] < r.tmin || t[0] > r.tmax)
+    return 0;
+  return sqr_length(r.origin + t[0]*r.direction - center) <= radius*radius ? 1 : 0;
+}
+
+void Disk::compute_hit(const Vec3f& p, Vec3f& n, float& u, float& v) const
+{
+  Vec3f d = p - center;
+  n = normal;
+  u = get_angle(d, tangent, binormal);
+  v = length(d)/radius;
+}
+
+void Disk::transform(const Mat4x4f& m)
+{
+  radius *= get_scale(m);
+  center = m.mul_3D_point(center);
+  normal = normalize(m.mul_3D_vector(normal));
+  onb(normal, tangent, binormal);
+  mesh.geometry.vertex_rw(0) = center;
+}
+
+AABB Disk::compute_bbox() const
+{
+  Vec3f extent;
+  for(unsigned int i = 0; i < 3; ++i)
+    extent[i] = radius*sqrt(max(0.0f, 1.0f - normal[i]*normal[i]));
+  return AABB(center - extent, center + extent);
+}
+
+bool Disk::add_to_hash(CacheHash& hash) const
+{
+  hash.add(static_cast<unsigned int>(shape_disk));
+  hash.add(center);
+  hash.add(normal);
+  hash.add(radius);
+  return true;
+}
+
+void Disk::draw() const
+{
+  GLUquadric* q = gluNewQuadric();
+  glPushMatrix();
+  mult_frame(center, tangent, binormal, normal);
+  gluDisk(q, 0.0, radius, SLICES, 1);
+  glPopMatrix();
+  gluDeleteQuadric(q);
+}
+
+Cylinder::Cylinder(const Vec3f& b, const Vec3f& a, float r, float h, const ObjMaterial& material)
+  : Quadric(material), base(b), axis(normalize(a)), radius(r), height(h)
+{
+  onb(axis, tangent, binormal);
+  mesh.geometry.vertex_rw(0) = base;
+}
+
+unsigned int Cylinder::find_hits(const Ray& r, float t[2]) const
+{
+  // Intersect the infinite cylinder in the plane orthogonal to the axis
+  // and then clip the hits to the height of the cylinder
+  Vec3f o = r.origin - base;
+  float o_axis = dot(o, axis);
+  float d_axis = dot(r.direction, axis);
+  Vec3f o_perp = o - o_axis*axis;
+  Vec3f d_perp = r.direction - d_axis*axis;
+  float a = dot(d_perp, d_perp);
+  if(a < 1.0e-12f)
+    return 0;
+  float roots[2];
+  if(!solve_quadratic(a, dot(o_perp, d_perp), dot(o_perp, o_perp) - radius*radius, roots))
+    return 0;
+  unsigned int no_of_hits = 0;
+  for(unsigned int i = 0; i < 2; ++i)
+  {
+    if(roots[i] < r.tmin || roots[i] > r.tmax)
+      continue;
+    float s = o_axis + roots[i]*d_axis;
+    if(s >= 0.0f && s <= height)
+      t[no_of_hits++] = roots[i];
+  }
+  return no_of_hits;
+}
+
+void Cylinder::compute_hit(const Vec3f& p, Vec3f& n, float& u, float& v) const
+{
+  Vec3f d = p - base;
+  float s = dot(d, axis);
+  n = (d - s*axis)/radius;
+  u = get_angle(n, tangent, binormal);
+  v = s/height;
+}
+
+void Cylinder::transform(const Mat4x4f& m)
+{
+  Vec3f top = m.mul_3D_point(base + height*axis);
+  radius *= get_scale(m);
+  base = m.mul_3D_point(base);
+  axis = top - base;
+  height = length(axis);
+  axis /= height;
+  onb(axis, tangent, binormal);
+  mesh.geometry.vertex_rw(0) = base;
+}
+
+AABB Cylinder::compute_bbox() const
+{
+  Vec3f extent;
+  for(unsigned int i = 0; i < 3; ++i)
+    extent[i] = radius*sqrt(max(0.0f, 1.0f - axis[i]*axis[i]));
+  Vec3f top = base + height*axis;
+  return AABB(v_min(base, top) - extent, v_max(base, top) + extent);
+}
+
+bool Cylinder::add_to_hash(CacheHash& hash) const
+{
+  hash.add(static_cast<unsigned int>(shape_cylinder));
+  hash.add(base);
+  hash.add(axis);
+  hash.add(radius);
+  hash.add(height);
+  return true;
+}
+
+void Cylinder::draw() const
+{
+  GLUquadric* q = gluNewQuadric();
+  glPushMatrix();
+  mult_frame(base, tangent, binormal, axis);
+  gluCylinder(q, radius, radius, height, SLICES, 1);
+  glPopMatrix();
+  gluDeleteQuadric(q);
+}
@@ -0,0 +1,112 @@
+// 02576 Rendering Framework
+// Analytic sphere, disk, and cylinder primitives.
+// Copyright (c) DTU Compute 2013
+
+#ifndef QUADRIC_H
+#define QUADRIC_H
+
+#include "CGLA/Vec3f.h"
+#include "CGLA/Mat4x4f.h"
+#include "Ray.h"
+#include "TriMesh.h"
+#include "ObjMaterial.h"
+#include "Object3D.h"
+#include "AABB.h"
+
+/// Base of the analytic primitives. Like a plane, a quadric owns a mesh
+/// with a single face that carries its material, so hits refer to it as
+/// hit_object and are shaded like triangle hits. The hit texture
+/// coordinates (u, v) interpolate the face texcoords to (u, v) itself.
+/// intersect only finds the distance. The position, normal, and texture
+/// coordinates are computed by finalize_hit. A ray can cross a quadric
+/// twice, and multi-hit queries get both hits. Transformations are
+/// assumed to be rigid motions with uniform scaling.
+class Quadric : public Object3D
+{
+public:
+  Quadric(const ObjMaterial& material);
+
+  virtual bool intersect(Ray& r, unsigned int prim_idx) const;
+  virtual void finalize_hit(Ray& r, unsigned int prim_idx) const;
+  virtual bool add_hits(const Ray& r, unsigned int prim_idx, HitList& hits) const;
+
+  // Draw the surface with OpenGL in the current color
+  virtual void draw() const = 0;
+
+  const TriMesh* get_mesh() const { return &mesh; }
+
+protected:
+  // Store the distances to the hits between r.tmin and r.tmax in
+  // increasing order and return their number
+  virtual unsigned int find_hits(const Ray& r, float t[2]) const = 0;
+  virtual void compute_hit(const CGLA::Vec3f& p, CGLA::Vec3f& normal, float& u, float& v) const = 0;
+  static float get_scale(const CGLA::Mat4x4f& m);
+
+  TriMesh mesh;
+};
+
+class Sphere : public Quadric
+{
+public:
+  Sphere(const CGLA::Vec3f& center, float radius, const ObjMaterial& material);
+
+  virtual void transform(const CGLA::Mat4x4f& m);
+  virtual AABB compute_bbox() const;
+  virtual void compute_bsphere(CGLA::Vec3f& c, float& r) const { c = center; r = radius; }
+  virtual bool add_to_hash(CacheHash& hash) const;
+  virtual void draw() const;
+
+  const CGLA::Vec3f& get_center() const { return center; }
+  float get_radius() const { return radius; }
+
+protected:
+  virtual unsigned int find_hits(const Ray& r, float t[2]) const;
+  virtual void compute_hit(const CGLA::Vec3f& p, CGLA::Vec3f& normal, float& u, float& v) const;
+
+  CGLA::Vec3f center;
+  float radius;
+};
+
+class Disk : public Quadric
+{
+public:
+  Disk(const CGLA::Vec3f& center, const CGLA::Vec3f& normal, float radius, const ObjMaterial& material);
+
+  virtual void transform(const CGLA::Mat4x4f& m);
+  virtual AABB compute_bbox() const;
+  virtual bool add_to_hash(CacheHash& hash) const;
+  virtual void draw() const;
+
+protected:
+  virtual unsigned int find_hits(const Ray& r, float t[2]) const;
+  virtual void compute_hit(const CGLA::Vec3f& p, CGLA::Vec3f& normal, float& u, float& v) const;
+
+  CGLA::Vec3f center;
+  CGLA::Vec3f normal;
+  CGLA::Vec3f tangent, binormal;
+  float radius;
+};
+
+/// Open cylinder around the axis from base to base + height*axis.
+class Cylinder : public Quadric
+{
+public:
+  Cylinder(const CGLA::Vec3f& base, const CGLA::Vec3f& axis, float radius, float height, const ObjMaterial& material);
+
+  virtual void transform(const CGLA::Mat4x4f& m);
+  virtual AABB compute_bbox() const;
+  virtual bool add_to_hash(CacheHash& hash) const;
+  virtual void draw() const;
+
+protected:
+  virtual unsigned int find_hits(const Ray& r, float t[2]) const;
+  virtual void compute_hit(const CGLA::Vec3f& p, CGLA::Vec3f& normal, float& u, float& v) const;
+
+  CGLA::Vec3f base;
+  CGLA::Vec3f axis;
+  CGLA::Vec3f tangent, binormal;
+  float radius;
+  float height;
+};
+
+#endif // QUADRIC_H
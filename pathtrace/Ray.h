@@ -16,13 +16,13 @@ struct Ray
   // Constructor
   Ray() 
     : has_hit(false), inside(false), did_hit_diffuse(false),
-      ior(1.0f), tmin(1.0e-4f), tmax(CGLA::BIG), trace_depth(0), hit_object(0)
+      ior(1.0f), tmin(1.0e-4f), tmax(CGLA::BIG), trace_depth(0), type(ray_camera), hit_object(0)
   { }
 
   Ray(const CGLA::Vec3f& _origin, const CGLA::Vec3f& _direction, float min_dist = 1.0e-4f, float max_dist = CGLA::BIG) 
     : origin(_origin), direction(_direction),
       has_hit(false), inside(false), did_hit_diffuse(false),
-      ior(1.0f), tmin(min_dist), tmax(max_dist), trace_depth(0), hit_object(0)
+      ior(1.0f), tmin(min_dist), tmax(max_dist), trace_depth(0), type(ray_camera), hit_object(0)
   { }
 
   CGLA::Vec3f origin;
@@ -41,6 +41,7 @@ struct Ray
 
   int trace_depth;       // Current recursion depth (path length)
   unsigned int hit_face_id;
+  RayType type;          // Objects hidden from this type of ray are skipped
 
   const TriMesh* hit_object;
 
@@ -58,6 +59,7 @@ struct Ray
     tmin = 0.0f;
     tmax = CGLA::BIG;
     trace_depth = 0;
+    type = ray_camera;
     hit_object = 0;
   }
 };
@@ -3,9 +3,11 @@
 // Copyright (c) DTU Compute 2013
 
 #include <iostream>
+#include <algorithm>
 #include "CGLA/Vec3d.h"
 #include "CGLA/Vec2f.h"
 #include "Ray.h"
+#include "RayPacket.h"
 #include "mt_random.h"
 #include "Shader.h"
 #include "RayCaster.h"
@@ -52,18 +54,51 @@ Vec3f RayCaster::compute_pixel(unsigned int x, unsigned int y) const
   for(unsigned int i = 0; i < jitter.size(); ++i)
   {
     Ray r = scene->get_camera()->get_ray(vp_pos + jitter[i]);
-    if(scene->intersect(r))
-    {
-      const Shader* s = get_shader(r);
-      if(s)
-        result += s->shade(r);
-    }
-    else
-      result += get_background(r.direction);
+    scene->intersect(r);
+    result += shade_view_ray(r, vp_pos - lower_left);
   }
   return result/static_cast<float>(jitter.size());
 }
 
+void RayCaster::compute_tile(unsigned int x, unsigned int y, Vec3f* image) const
+{
+  unsigned int tile_width = min(PACKET_WIDTH, width - x);
+  unsigned int tile_height = min(PACKET_WIDTH, height - y);
+  Vec2f vp_pos[PACKET_SIZE];
+  Vec2f coords[PACKET_SIZE];
+  Vec3f result[PACKET_SIZE];
+  RayPacket packet;
+  packet.size = tile_width*tile_height;
+  for(unsigned int k = 0; k < packet.size; ++k)
+  {
+    vp_pos[k] = Vec2f(x + k%tile_width, y + k/tile_width)*win_to_vp + lower_left;
+    result[k] = Vec3f(0.0f);
+  }
+
+  // Trace the rays with the same jitter offset as one packet
+  for(unsigned int i = 0; i < jitter.size(); ++i)
+  {
+    for(unsigned int k = 0; k < packet.size; ++k)
+      coords[k] = vp_pos[k] + jitter[i];
+    scene->get_camera()->get_rays(coords, packet.rays, packet.size);
+    scene->intersect(packet);
+    for(unsigned int k = 0; k < packet.size; ++k)
+      result[k] += shade_view_ray(packet.rays[k], vp_pos[k] - lower_left);
+  }
+  for(unsigned int k = 0; k < packet.size; ++k)
+    image[x + k%tile_width + (y + k/tile_width)*width] = result[k]/static_cast<float>(jitter.size());
+}
+
+Vec3f RayCaster::shade_view_ray(Ray& r, const Vec2f& pixel_pos) const
+{
+  if(r.has_hit)
+  {
+    const Shader* s = get_shader(r);
+    return s ? s->shade(r) : Vec3f(0.0f);
+  }
+  return get_background(r.direction);
+}
+
 Vec3f RayCaster::get_background(const Vec3f& dir) const
 { 
   if(sphere_tex)
@@ -8,6 +8,7 @@
 #include <vector>
 #include "CGLA/Vec2f.h"
 #include "CGLA/Vec3f.h"
+#include "Ray.h"
 #include "SphereTexture.h"
 #include "SunSky.h"
 #include "Tracer.h"
@@ -30,9 +31,17 @@ public:
   void decrement_pixel_subdivs();
   virtual CGLA::Vec3f compute_pixel(unsigned int x, unsigned int y) const;
 
+  // Computes the packet of pixels with lower left corner (x, y) and stores
+  // the results in an image with the resolution of the tracer
+  virtual void compute_tile(unsigned int x, unsigned int y, CGLA::Vec3f* image) const;
+
 protected:
   void compute_jitters();
 
+  // Radiance along a traced eye ray. The pixel position is the viewport
+  // position of the ray relative to the lower left corner of the viewport.
+  virtual CGLA::Vec3f shade_view_ray(Ray& r, const CGLA::Vec2f& pixel_pos) const;
+
   unsigned int subdivs;
   std::vector<CGLA::Vec2f> jitter;
   CGLA::Vec2f win_to_vp;
@@ -0,0 +1,21 @@
+// 02576 Rendering Framework
+// Packet of coherent rays traced together through the accelerator.
+// Copyright (c) DTU Compute 2013
+
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+#include "Ray.h"
+
+const unsigned int PACKET_WIDTH = 4;                        // Side length of a square packet of camera rays
+const unsigned int PACKET_SIZE = PACKET_WIDTH*PACKET_WIDTH;  // Maximum number of rays in a packet
+
+struct RayPacket
+{
+  RayPacket() : size(0) { }
+
+  Ray rays[PACKET_SIZE];
+  unsigned int size;     // Number of rays in use
+};
+
+#endif // RAYPACKET_H
@@ -19,6 +19,7 @@ bool RayTracer::trace_reflected(const Ray& in, Ray& out) const
   out.ior = in.ior;
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = in.type;
   return trace(out);
 }
 
@@ -33,6 +34,7 @@ bool RayTracer::trace_reflected(const Ray& in, Ray& out, double& R) const
   out.ior = in.ior;
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = in.type;
   return trace(out);  
 }
 
@@ -59,6 +61,7 @@ bool RayTracer::trace_reflected(const Ray& in, Ray& out, Vec3f& R) const
   out.ior = in.ior;
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = in.type;
   return trace(out);  
 }
 
@@ -77,6 +80,7 @@ bool RayTracer::trace_refracted(const Ray& in, Ray& out) const
   out.direction = eta*(normal*cos_theta_in - direction) - normal*cos_theta_out;
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = in.type;
   return trace(out);
 }
 
@@ -98,6 +102,7 @@ bool RayTracer::trace_refracted(const Ray& in, Ray& out, double& R) const
   out.direction = eta*(normal*cos_theta_in - direction) - normal*cos_theta_out;
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = in.type;
   R = fresnel_R(cos_theta_in, cos_theta_out, in.ior, out.ior);
   return trace(out);
 }
@@ -120,6 +125,7 @@ bool RayTracer::trace_dispersive(const Ray& in, Ray& out, double& R, unsigned in
   out.direction = eta*(normal*cos_theta_in - direction) - normal*cos_theta_out;
   out.trace_depth = in.trace_depth + 1;
   out.did_hit_diffuse = in.did_hit_diffuse;
+  out.type = in.type;
   R = fresnel_R(cos_theta_in, cos_theta_out, in.ior, out.ior);
   return trace(out);
 }
@@ -19,6 +19,7 @@ public:
   { }
 
   bool trace(Ray& r) const { return scene->intersect(r); }
+  bool trace_shadow(const Ray& r, unsigned int* occluder = 0) const { return scene->occluded(r, occluder); }
   bool trace_reflected(const Ray& in, Ray& out) const;
   bool trace_reflected(const Ray& in, Ray& out, double& fresnel_R) const;
   bool trace_reflected(const Ray& in, Ray& out, CGLA::Vec3f& fresnel_R) const;
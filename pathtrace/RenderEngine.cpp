@@ -3,6 +3,7 @@
 // Copyright (c) DTU Compute 2013
 
 #include <iostream>
+#include <cstdlib>
 #include <algorithm>
 #include <list>
 #include <map>
@@ -25,6 +26,7 @@
 #include "mt_random.h"
 #include "ImageCompare.h"
 #include "TriMesh.h"
+#include "RayPacket.h"
 #include "RenderEngine.h"
 
 #ifdef _OPENMP
@@ -50,6 +52,22 @@ namespace
   {
     for_each(s.begin(), s.end(), lower_case);
   }
+
+  // Cache files can be large, so built accelerators are only kept on disk
+  // when this environment variable names a directory for them
+  const char* const CACHE_DIR_VARIABLE = "PATHTRACE_CACHE_DIR";
+
+  void enable_accelerator_cache(Scene& scene)
+  {
+    const char* dir = getenv(CACHE_DIR_VARIABLE);
+    if(!dir || *dir == '\0')
+      return;
+    string cache_dir = dir;
+    char last = cache_dir[cache_dir.size() - 1];
+    if(last != '/' && last != '\\')
+      cache_dir += '/';
+    scene.enable_accelerator_cache(cache_dir);
+  }
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -163,12 +181,18 @@ void RenderEngine::load_files(int argc, char** argv)
         transform = translation_Mat4x4f(Vec3f(0.0f, -0.05655f, 0.0f));
       else if(char_traits<char>::compare(filename.c_str(), "glass", 5) == 0)
         transform = scaling_Mat4x4f(Vec3f(100.0f));
-      scene.load_mesh(argv[i], transform);
+
+      // The Cornell box spheres are traced as analytic spheres
+      if(char_traits<char>::compare(filename.c_str(), "cornell", 7) == 0 && filename.find("sphere") != string::npos)
+        scene.load_sphere(argv[i], transform);
+      else
+        scene.load_mesh(argv[i], transform);
     }
   }
   else
   {
-    cout << "Usage: pathtrace any_object.obj [another.obj ...]" << endl;
+    cout << "Usage: pathtrace any_object.obj [another.obj ...]" << endl
+         << "Set " << CACHE_DIR_VARIABLE << " to keep built acceleration structures in that directory." << endl;
     exit(0);
   }
 }
@@ -306,6 +330,7 @@ void RenderEngine::init_tracer()
   Timer timer;
   cout << "Building acceleration structure...";
   timer.start();
+  enable_accelerator_cache(scene);
   scene.build_bsptree();
   timer.stop();
   cout << "(time: " << timer.get_time() << ")" << endl; 
@@ -411,11 +436,11 @@ void RenderEngine::raytrace()
 
   init_sample_to_volume();
   #pragma omp parallel for private(randomizer)
-  for(int j = 0; j < static_cast<int>(resy); ++j)
+  for(int j = 0; j < static_cast<int>(resy); j += PACKET_WIDTH)
   {
-    for(unsigned int i = 0; i < resx; ++i)
-      image[i + j*resx] = tracer.compute_pixel(i, j);
-    if(((j + 1) % 50) == 0) 
+    for(unsigned int i = 0; i < resx; i += PACKET_WIDTH)
+      tracer.compute_tile(i, j, &image[0]);
+    if(((j/PACKET_WIDTH + 1) % 12) == 0) 
       cerr << ".";
   }
 
@@ -440,11 +465,11 @@ void RenderEngine::pathtrace()
 
   init_sample_to_volume();
   #pragma omp parallel for private(randomizer)
-  for(int j = 0; j < static_cast<int>(resy); ++j)
+  for(int j = 0; j < static_cast<int>(resy); j += PACKET_WIDTH)
   {
-    for(unsigned int i = 0; i < resx; ++i)
-      tracer.update_pixel(i, j, sample_number, image[i + j*resx]);
-    if(((j + 1) % 50) == 0) 
+    for(unsigned int i = 0; i < resx; i += PACKET_WIDTH)
+      tracer.update_tile(i, j, sample_number, &image[0]);
+    if(((j/PACKET_WIDTH + 1) % 12) == 0) 
       cerr << ".";
   }
   
@@ -3,22 +3,39 @@
 // Copyright (c) DTU Compute 2013
 
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
 #include <GL/glut.h>
+#include "CGLA/Vec2f.h"
 #include "CGLA/Vec3f.h"
 #include "../optprops/Interface.h"
 #include "../optprops/Medium.h"
 #include "../optprops/load_mpml.h"
 #include "TriMesh.h"
 #include "obj_load.h"
-#include "BSPTree.h"
+#include "decimate.h"
+#include "BspTree.h"
+#include "BvhTree.h"
+#include "Bvh4Tree.h"
+#include "CompressedBvhTree.h"
+#include "LazyBvhTree.h"
+#include "DynamicBvhTree.h"
 #include "ObjMaterial.h"
 #include "Ray.h"
 #include "AreaLight.h"
 #include "RayTracer.h"
 #include "Plane.h"
+#include "Quadric.h"
+#include "MeshInstance.h"
+#include "AcceleratorCache.h"
 #include "Texture.h"
+#include "Timer.h"
+#include "mt_random.h"
+#include "sampler.h"
 #include "Scene.h"
 
 using namespace std;
@@ -28,10 +45,176 @@ namespace
 {
   const int MAX_OBJECTS = 4;   // Maximum number of triangles in a BSP tree node
   const int MAX_LEVEL = 20;    // Maximum number of BSP tree subdivisions
+  const int MAX_BVH_LEVEL = 64; // Maximum depth of the bounding volume hierarchy
+  const int MAX_KD_LEVEL = 40;  // Maximum depth of the kd-tree built by sweeping the SAH
+
+  // Auto-tuning. Every type is built with each leaf size in turn. Leaf
+  // sizes with a SAH cost close to the best so far for their type are
+  // timed on the probe.
+  const AcceleratorType TUNED_TYPES[] = { acc_bvh, acc_bvh4, acc_compressed_bvh, acc_sbvh4, acc_kd_tree, acc_bsp_tree };
+  const unsigned int TUNED_LEAF_SIZES[] = { 2, 4, 8 };
+  const float TUNING_SAH_SLACK = 1.1f;      // Timed leaf sizes are within this factor of the best SAH cost so far
+  const unsigned int PROBE_RESOLUTION = 48; // Camera rays per side of the image
+  const unsigned int PROBE_BOUNCES = 2;     // Diffuse rays from each camera ray hit
+  const unsigned int PROBE_RANDOM_RAYS = 2048;
+  const unsigned int PROBE_REPEATS = 3;     // The fastest of the repeated timings is used
+
+  const char* get_accelerator_name(AcceleratorType type)
+  {
+    const char* names[] = { "BSP tree", "BVH", "4-wide BVH", "compressed BVH", "4-wide SBVH", "SAH kd-tree", "lazy BVH" };
+    return names[type];
+  }
+
+  unsigned int get_default_max_level(AcceleratorType type)
+  {
+    if(type == acc_bsp_tree)
+      return MAX_LEVEL;
+    return type == acc_kd_tree ? MAX_KD_LEVEL : MAX_BVH_LEVEL;
+  }
+
+  Accelerator* new_accelerator(AcceleratorType type, unsigned int max_objects, unsigned int max_level)
+  {
+    if(type == acc_lazy_bvh)
+      return new LazyBvhTree(max_objects);
+    else if(type == acc_kd_tree)
+    {
+      BspTree* tree = new BspTree(max_objects, max_level);
+      tree->enable_event_sweep();
+      return tree;
+    }
+    else if(type == acc_sbvh4)
+    {
+      Bvh4Tree* tree = new Bvh4Tree(max_objects, max_level);
+      tree->enable_spatial_splits();
+      return tree;
+    }
+    else if(type == acc_compressed_bvh)
+      return new CompressedBvhTree(max_objects, max_level);
+    else if(type == acc_bvh4)
+      return new Bvh4Tree(max_objects, max_level);
+    else if(type == acc_bvh)
+      return new BvhTree(max_objects, max_level);
+    else
+      return new BspTree(max_objects, max_level);
+  }
+
+  // Space subdivisions need depth to separate the primitives of large
+  // scenes. The usual estimate 8 + 1.3 log2(n) is used. BVHs are limited
+  // by their traversal stacks only.
+  unsigned int get_tuned_max_level(AcceleratorType type, unsigned int no_of_prims)
+  {
+    if(type != acc_bsp_tree && type != acc_kd_tree)
+      return MAX_BVH_LEVEL;
+    float level = 8.0f + 1.3f*log(static_cast<float>(max(no_of_prims, 1u)))/log(2.0f);
+    return static_cast<unsigned int>(level + 0.5f);
+  }
+
+  // Rays resembling those of rendering: camera rays through a coarse image
+  // grid, diffuse bounces from their hits, and rays between random points
+  // of the scene bounding box
+  void make_probe_rays(const Accelerator* acc, const Camera* cam, const AABB& bbox, vector<Ray>& rays)
+  {
+    for(unsigned int y = 0; cam && y < PROBE_RESOLUTION; ++y)
+      for(unsigned int x = 0; x < PROBE_RESOLUTION; ++x)
+      {
+        Vec2f coords((x + 0.5f)/PROBE_RESOLUTION - 0.5f, (y + 0.5f)/PROBE_RESOLUTION - 0.5f);
+        Ray r = cam->get_ray(coords);
+        rays.push_back(r);
+        if(!acc->closest_hit(r))
+          continue;
+        Vec3f normal = dot(r.hit_normal, r.direction) > 0.0f ? -r.hit_normal : r.hit_normal;
+        for(unsigned int i = 0; i < PROBE_BOUNCES; ++i)
+        {
+          Ray bounce(r.hit_pos, sample_cosine_weighted(normal));
+          bounce.type = ray_indirect;
+          rays.push_back(bounce);
+        }
+      }
+    Vec3f extent = bbox.get_diagonal();
+    for(unsigned int i = 0; i < PROBE_RANDOM_RAYS; ++i)
+    {
+      Vec3f p, q;
+      for(unsigned int j = 0; j < 3; ++j)
+      {
+        p[j] = bbox.p_min[j] + extent[j]*mt_random();
+        q[j] = bbox.p_min[j] + extent[j]*mt_random();
+      }
+      if(p == q)
+        continue;
+      Ray r(p, normalize(q - p));
+      r.type = ray_indirect;
+      rays.push_back(r);
+    }
+  }
+
+  // Seconds spent finding the closest hits of the probe rays and testing
+  // them for occlusion as shadow rays
+  double time_probe(const Accelerator* acc, const vector<Ray>& rays)
+  {
+    double best_time = BIG;
+    for(unsigned int k = 0; k < PROBE_REPEATS; ++k)
+    {
+      Timer timer;
+      timer.start();
+      for(unsigned int i = 0; i < rays.size(); ++i)
+      {
+        Ray r = rays[i];
+        acc->closest_hit(r);
+        Ray shadow = rays[i];
+        shadow.type = ray_shadow;
+        acc->occluded(shadow);
+      }
+      timer.stop();
+      best_time = min(best_time, timer.get_time());
+    }
+    return best_time;
+  }
+
+  ObjMaterial load_material(const string& mtl_file, unsigned int mtl_idx)
+  {
+    vector<ObjMaterial> m;
+    if(!mtl_file.empty())
+      mtl_load(mtl_file, m);
+    if(m.size() == 0)
+      m.push_back(ObjMaterial());
+    return mtl_idx < m.size() ? m[mtl_idx] : m.back();
+  }
+
+  // Memory per primitive of the geometry, not per slot of the structure
+  void print_memory_usage(const Accelerator* acc, const vector<const Object3D*>& objects)
+  {
+    size_t no_of_prims = 0;
+    for(unsigned int i = 0; i < objects.size(); ++i)
+      no_of_prims += objects[i]->get_no_of_primitives();
+    if(no_of_prims > 0)
+      cout << "[" << acc->get_memory_usage()/no_of_prims << " bytes/primitive]";
+  }
+
+  void print_build_times(const Accelerator* acc)
+  {
+    const BvhTree* bvh = dynamic_cast<const BvhTree*>(acc);
+    if(!bvh || bvh->get_build_times().threads == 0)
+      return;
+    const BvhBuildTimes& times = bvh->get_build_times();
+    cout << "[primitives: " << times.primitives << ", hierarchy: " << times.hierarchy 
+         << ", compaction: " << times.compaction << ", threads: " << times.threads << "]";
+  }
 }
 
 Scene::~Scene()
 {
+  delete tree;
+  delete mesh_tree;
+  delete mesh_tree_instance;
+  delete proxy_tree;
+  for(unsigned int i = 0; i < proxy_meshes.size(); ++i)
+    delete proxy_meshes[i];
+  for(unsigned int i = 0; i < instances.size(); ++i)
+    delete instances[i];
+  for(map<const TriMesh*, Accelerator*>::iterator i = bottom_levels.begin(); i != bottom_levels.end(); ++i)
+    delete i->second;
+  for(unsigned int i = 0; i < instanced_meshes.size(); ++i)
+    delete instanced_meshes[i];
   for(unsigned int i = 0; i < meshes.size(); ++i)
     delete meshes[i];
   for(unsigned int i = 0; i < light_meshes.size(); ++i)
@@ -42,12 +225,15 @@ Scene::~Scene()
     delete i->second;
   for(unsigned int i = 0; i < planes.size(); ++i)
     delete planes[i];
+  for(unsigned int i = 0; i < quadrics.size(); ++i)
+    delete quadrics[i];
 }
 
-void Scene::load_mesh(const string& filename, const Mat4x4f& transform)
+void Scene::load_mesh(const string& filename, const Mat4x4f& transform, unsigned int visibility)
 {
   cout << "Loading " << filename << endl;
   TriMesh* mesh = load_background_mesh(filename, transform);
+  mesh->set_visibility(visibility);
 
   // Correct scene bounding box
   AABB mesh_bbox = mesh->compute_bbox();
@@ -70,6 +256,78 @@ TriMesh* Scene::load_background_mesh(const string& filename, const Mat4x4f& tran
   return mesh;
 }
 
+const TriMesh* Scene::load_instanced_mesh(const string& filename)
+{
+  cout << "Loading " << filename << " for instancing" << endl;
+  TriMesh* mesh = new TriMesh; 
+  obj_load(filename, *mesh);
+  if(!mesh->has_normals())
+  {
+    cout << "Computing normals" << endl;
+    mesh->compute_normals();
+  }
+  mesh->compute_areas();
+  cout << "No. of triangles: " << mesh->geometry.no_faces() << endl;
+  instanced_meshes.push_back(mesh);
+  return mesh;
+}
+
+unsigned int Scene::add_instance(const TriMesh* mesh, const Mat4x4f& transform)
+{
+  // The bottom level of a mesh is built the first time it is instanced
+  Accelerator*& bottom_level = bottom_levels[mesh];
+  if(!bottom_level)
+  {
+    bottom_level = build_accelerator(vector<const Object3D*>(1, mesh), vector<const Plane*>());
+  }
+  MeshInstance* instance = new MeshInstance(bottom_level, mesh->compute_bbox(), transform);
+  bbox.add_AABB(instance->compute_bbox());
+  instances.push_back(instance);
+
+  // Built scenes are updated in place. The cost growth is measured
+  // against the new set of instances, but moves are not folded in.
+  if(top_level)
+  {
+    instance_handles.push_back(top_level->insert(instance));
+    top_level->reset_sah_cost();
+  }
+  else if(tree)
+    build_bsptree();
+  return instances.size() - 1;
+}
+
+void Scene::remove_instance(unsigned int instance)
+{
+  if(instance >= instances.size() || !instances[instance])
+    return;
+  if(top_level)
+  {
+    top_level->remove(instance_handles[instance]);
+    top_level->reset_sah_cost();
+  }
+  delete instances[instance];
+  instances[instance] = 0;
+}
+
+void Scene::set_instance_transform(unsigned int instance, const Mat4x4f& transform)
+{
+  if(instance >= instances.size() || !instances[instance])
+    return;
+  instances[instance]->set_transform(transform);
+  bbox.add_AABB(instances[instance]->compute_bbox());
+  if(top_level)
+    top_level->update(instance_handles[instance]);
+}
+
+void Scene::set_instance_visibility(unsigned int instance, unsigned int visibility)
+{
+  if(instance >= instances.size() || !instances[instance])
+    return;
+  instances[instance]->set_visibility(visibility);
+  if(top_level)
+    top_level->update(instance_handles[instance]);
+}
+
 void Scene::load_media(const string& filename)
 {
   Medium air;
@@ -81,6 +339,9 @@ void Scene::load_media(const string& filename)
 
   for(unsigned int i = 0; i < planes.size(); ++i)
     meshes.push_back(planes[i]->get_mesh());
+  for(unsigned int i = 0; i < quadrics.size(); ++i)
+    meshes.push_back(quadrics[i]->get_mesh());
+  meshes.insert(meshes.end(), instanced_meshes.begin(), instanced_meshes.end());
   load_mpml(filename, media, interfaces);
   for(unsigned int i = 0; i < meshes.size(); ++i)
     for(unsigned int j = 0; j < meshes[i]->materials.size(); ++j)
@@ -123,18 +384,52 @@ void Scene::load_media(const string& filename)
         tex->load(path_and_name.c_str());
       }
     }
-  for(unsigned int i = 0; i < planes.size(); ++i)
-    meshes.pop_back();
+  meshes.resize(meshes.size() - planes.size() - quadrics.size() - instanced_meshes.size());
 }
 
 void Scene::add_plane(const Vec3f& position, const Vec3f& normal, const string& mtl_file, unsigned int mtl_idx, float tex_scale)
 {
-  vector<ObjMaterial> m;
-  if(!mtl_file.empty())
-    mtl_load(mtl_file, m);
-  if(m.size() == 0)
-	  m.push_back(ObjMaterial());
-  planes.push_back(new Plane(position, normal, mtl_idx < m.size() ? m[mtl_idx] : m.back(), tex_scale));
+  planes.push_back(new Plane(position, normal, load_material(mtl_file, mtl_idx), tex_scale));
+}
+
+void Scene::add_sphere(const Vec3f& center, float radius, const string& mtl_file, unsigned int mtl_idx)
+{
+  add_quadric(new Sphere(center, radius, load_material(mtl_file, mtl_idx)));
+}
+
+void Scene::add_disk(const Vec3f& center, const Vec3f& normal, float radius, const string& mtl_file, unsigned int mtl_idx)
+{
+  add_quadric(new Disk(center, normal, radius, load_material(mtl_file, mtl_idx)));
+}
+
+void Scene::add_cylinder(const Vec3f& base, const Vec3f& axis, float radius, float height, const string& mtl_file, unsigned int mtl_idx)
+{
+  add_quadric(new Cylinder(base, axis, radius, height, load_material(mtl_file, mtl_idx)));
+}
+
+void Scene::load_sphere(const string& filename, const Mat4x4f& transform)
+{
+  cout << "Loading " << filename << " as a sphere" << endl;
+  TriMesh mesh; 
+  obj_load(filename, mesh);
+  if(mesh.geometry.no_vertices() == 0)
+    return;
+  mesh.transform(transform);
+
+  // The vertices of a tessellated sphere lie on the sphere
+  Vec3f center = mesh.compute_bbox().get_center();
+  float radius = 0.0f;
+  for(unsigned int i = 0; i < mesh.geometry.no_vertices(); ++i)
+    radius += length(mesh.geometry.vertex(i) - center);
+  radius /= mesh.geometry.no_vertices();
+  cout << "Center: " << center << " radius: " << radius << endl;
+  add_quadric(new Sphere(center, radius, mesh.mat_idx.empty() ? ObjMaterial() : mesh.materials[mesh.mat_idx[0]]));
+}
+
+void Scene::add_quadric(Quadric* quadric)
+{
+  bbox.add_AABB(quadric->compute_bbox());
+  quadrics.push_back(quadric);
 }
 
 unsigned int Scene::extract_area_lights(RayTracer* tracer, unsigned int samples_per_light)
@@ -203,6 +498,296 @@ unsigned int Scene::extract_area_lights(RayTracer* tracer, unsigned int samples_
   return lights.size();
 }
 
+void Scene::build_bsptree()
+{
+  delete tree;
+  delete mesh_tree;
+  delete mesh_tree_instance;
+  tree = mesh_tree = 0;
+  top_level = 0;
+  mesh_tree_instance = 0;
+  vector<const Object3D*> objects(meshes.begin(), meshes.end());
+  objects.insert(objects.end(), quadrics.begin(), quadrics.end());
+  if(auto_tune && !objects.empty())
+    tune_accelerator(objects);
+  if(instances.empty())
+  {
+    tree = build_accelerator(objects, planes);
+    print_build_times(tree);
+    build_proxies();
+    return;
+  }
+
+  // The meshes that are not instanced become one more instance
+  if(!objects.empty())
+  {
+    AABB mesh_bbox;
+    for(unsigned int i = 0; i < objects.size(); ++i)
+      mesh_bbox.add_AABB(objects[i]->compute_bbox());
+    mesh_tree = build_accelerator(objects, vector<const Plane*>());
+    print_build_times(mesh_tree);
+    mesh_tree_instance = new MeshInstance(mesh_tree, mesh_bbox);
+  }
+  clear_proxies();
+  build_instance_tree();
+}
+
+void Scene::enable_proxies(float reduction, int min_depth, unsigned int min_faces)
+{
+  use_proxies = true;
+  proxy_reduction = reduction;
+  proxy_depth = min_depth;
+  proxy_min_faces = min_faces;
+}
+
+void Scene::clear_proxies()
+{
+  delete proxy_tree;
+  proxy_tree = 0;
+  for(unsigned int i = 0; i < proxy_meshes.size(); ++i)
+    delete proxy_meshes[i];
+  proxy_meshes.clear();
+  proxy_offsets.clear();
+}
+
+void Scene::build_proxies()
+{
+  clear_proxies();
+  if(!use_proxies)
+    return;
+
+  // Volumes keep their meshes, since their shaders look up data by mesh
+  vector<const Object3D*> objects;
+  for(unsigned int i = 0; i < meshes.size(); ++i)
+  {
+    const TriMesh* mesh = meshes[i];
+    unsigned int faces = mesh->geometry.no_faces();
+    const ObjMaterial* m = mesh->mat_idx.size() > 0 ? &mesh->materials[mesh->mat_idx[0]] : 0;
+    if(faces < proxy_min_faces || (m && m->illum > 13 && m->illum <= 17))
+    {
+      objects.push_back(mesh);
+      continue;
+    }
+    TriMesh* proxy = new TriMesh;
+    proxy_offsets[proxy] = decimate(*mesh, *proxy, static_cast<unsigned int>(faces*proxy_reduction));
+    proxy->set_visibility(mesh->get_visibility());
+    proxy_meshes.push_back(proxy);
+    objects.push_back(proxy);
+    cout << "Proxy of " << faces << " triangles: " << proxy->geometry.no_faces() << " triangles" << endl;
+  }
+  if(proxy_meshes.empty())
+    return;
+  objects.insert(objects.end(), quadrics.begin(), quadrics.end());
+  proxy_tree = build_accelerator(objects, planes);
+}
+
+bool Scene::intersect(Ray& r) const
+{
+  if(!proxy_tree || !r.did_hit_diffuse || r.trace_depth < proxy_depth)
+    return tree->closest_hit(r);
+  if(!proxy_tree->closest_hit(r))
+    return false;
+
+  // Move the hit to the side of the original surface that the ray came
+  // from, so that rays leaving it are not blocked by the original mesh
+  map<const TriMesh*, float>::const_iterator i = proxy_offsets.find(r.hit_object);
+  if(i != proxy_offsets.end())
+    r.hit_pos += (dot(r.direction, r.hit_normal) > 0.0f ? -i->second : i->second)*r.hit_normal;
+  return true;
+}
+
+void Scene::set_accelerator(AcceleratorType type)
+{
+  set_accelerator(type, MAX_OBJECTS, get_default_max_level(type));
+}
+
+void Scene::tune_accelerator(const vector<const Object3D*>& objects)
+{
+  // The chosen configuration is kept with the cached accelerators
+  string filename;
+  if(use_cache)
+  {
+    CacheHash hash;
+    hash.add(ACC_CACHE_VERSION);
+    bool cacheable = true;
+    for(unsigned int i = 0; i < objects.size() && cacheable; ++i)
+      cacheable = objects[i]->add_to_hash(hash);
+    if(cacheable)
+      filename = cache_dir + "tuning_" + hash.get_string() + ".txt";
+  }
+  if(!filename.empty())
+  {
+    ifstream in(filename.c_str());
+    int type;
+    unsigned int max_objects, max_level;
+    if(in >> type >> max_objects >> max_level && type >= 0 && type < acc_lazy_bvh)
+    {
+      set_accelerator(static_cast<AcceleratorType>(type), max_objects, max_level);
+      cout << "[tuned: " << get_accelerator_name(acc_type) << ", leaf size " << acc_max_objects << ", depth " << acc_max_level << "]";
+      return;
+    }
+  }
+
+  unsigned int no_of_prims = 0;
+  AABB objects_bbox;
+  for(unsigned int i = 0; i < objects.size(); ++i)
+  {
+    no_of_prims += objects[i]->get_no_of_primitives();
+    objects_bbox.add_AABB(objects[i]->compute_bbox());
+  }
+
+  // The trees are built without planes, since planes are tested separately
+  cout << endl << "Tuning accelerator for " << no_of_prims << " primitives" << endl;
+  vector<Ray> probe;
+  double best_time = BIG;
+  const unsigned int no_of_types = sizeof(TUNED_TYPES)/sizeof(TUNED_TYPES[0]);
+  const unsigned int no_of_sizes = sizeof(TUNED_LEAF_SIZES)/sizeof(TUNED_LEAF_SIZES[0]);
+  for(unsigned int i = 0; i < no_of_types; ++i)
+  {
+    // Each candidate is freed before the next is built. A leaf size is
+    // timed unless its cost is well above that of a smaller leaf size.
+    AcceleratorType type = TUNED_TYPES[i];
+    unsigned int max_level = get_tuned_max_level(type, no_of_prims);
+    float min_cost = BIG;
+    for(unsigned int j = 0; j < no_of_sizes; ++j)
+    {
+      Timer timer;
+      timer.start();
+      Accelerator* candidate = new_accelerator(type, TUNED_LEAF_SIZES[j], max_level);
+      candidate->init(objects, vector<const Plane*>());
+      timer.stop();
+      float cost = candidate->get_sah_cost();
+      min_cost = min(min_cost, cost);
+      cout << endl << "  " << get_accelerator_name(type) << ", leaf size " << TUNED_LEAF_SIZES[j] << ", depth " << max_level
+           << ": SAH cost " << cost << ", build " << timer.get_time() << " s";
+      if(cost <= TUNING_SAH_SLACK*min_cost)
+      {
+        if(probe.empty())
+          make_probe_rays(candidate, cam, objects_bbox, probe);
+        double time = time_probe(candidate, probe);
+        cout << ", probe " << time << " s";
+        if(time < best_time)
+        {
+          best_time = time;
+          set_accelerator(type, TUNED_LEAF_SIZES[j], max_level);
+        }
+      }
+      delete candidate;
+    }
+  }
+  cout << endl;
+  cout << "Chose " << get_accelerator_name(acc_type) << " with leaf size " << acc_max_objects << " and depth " << acc_max_level 
+       << " (" << probe.size() << " probe rays in " << best_time << " s)" << endl;
+  if(!filename.empty())
+  {
+    string temp_filename = get_temp_filename(filename);
+    {
+      ofstream out(temp_filename.c_str());
+      out << acc_type << " " << acc_max_objects << " " << acc_max_level << endl;
+    }
+    replace_file(temp_filename, filename);
+  }
+}
+
+void Scene::build_instance_tree()
+{
+  delete tree;
+  top_level = new DynamicBvhTree;
+  top_level->init(vector<const Object3D*>(), planes);
+  vector<const Object3D*> objects;
+  instance_handles.resize(instances.size());
+  for(unsigned int i = 0; i < instances.size(); ++i)
+    if(instances[i])
+    {
+      instance_handles[i] = top_level->insert(instances[i]);
+      objects.push_back(instances[i]);
+    }
+  if(mesh_tree_instance)
+  {
+    top_level->insert(mesh_tree_instance);
+    objects.push_back(mesh_tree_instance);
+  }
+  top_level->reset_sah_cost();
+  print_memory_usage(top_level, objects);
+  tree = top_level;
+}
+
+Accelerator* Scene::build_accelerator(const vector<const Object3D*>& objects, const vector<const Plane*>& planes) const
+{
+  // Only structures over meshes and quadrics are cached, since instances
+  // refer to accelerators in memory. The planes are not part of the
+  // structure. Lazily built trees are incomplete until rendering and never
+  // cached.
+  Accelerator* acc = new_accelerator(acc_type, acc_max_objects, acc_max_level);
+  CacheHash hash;
+  hash.add(acc_type);
+  hash.add(acc_max_objects);
+  hash.add(acc_max_level);
+  bool cacheable = use_cache && acc_type != acc_lazy_bvh;
+  for(unsigned int i = 0; i < objects.size() && cacheable; ++i)
+    cacheable = objects[i]->add_to_hash(hash);
+  if(!cacheable)
+  {
+    acc->init(objects, planes);
+    print_memory_usage(acc, objects);
+    return acc;
+  }
+
+  string filename = cache_dir + "accelerator_" + hash.get_string() + ".acc";
+  if(load_accelerator(filename, hash.get(), acc, objects, planes))
+  {
+    cout << "[loaded " << filename << "]";
+    print_memory_usage(acc, objects);
+    return acc;
+  }
+  delete acc;
+  acc = new_accelerator(acc_type, acc_max_objects, acc_max_level);
+  acc->init(objects, planes);
+  print_memory_usage(acc, objects);
+  if(!save_accelerator(filename, hash.get(), acc))
+    cout << "[could not write " << filename << "]";
+  return acc;
+}
+
+float Scene::refit_bsptree()
+{
+  // Proxies do not follow deformations
+  delete proxy_tree;
+  proxy_tree = 0;
+
+  if(instances.empty())
+  {
+    tree->refit();
+    return tree->get_sah_cost_growth();
+  }
+
+  // Refit the bottom levels before the top level that bounds them
+  float growth = 1.0f;
+  map<const Accelerator*, AABB> object_bboxes;
+  for(map<const TriMesh*, Accelerator*>::iterator it = bottom_levels.begin(); it != bottom_levels.end(); ++it)
+  {
+    it->second->refit();
+    object_bboxes[it->second] = it->first->compute_bbox();
+    growth = max(growth, it->second->get_sah_cost_growth());
+  }
+  for(unsigned int i = 0; i < instances.size(); ++i)
+    if(instances[i])
+      instances[i]->set_object_bbox(object_bboxes[instances[i]->get_bottom_level()]);
+  if(mesh_tree)
+  {
+    AABB mesh_bbox;
+    for(unsigned int i = 0; i < meshes.size(); ++i)
+      mesh_bbox.add_AABB(meshes[i]->compute_bbox());
+    for(unsigned int i = 0; i < quadrics.size(); ++i)
+      mesh_bbox.add_AABB(quadrics[i]->compute_bbox());
+    mesh_tree->refit();
+    mesh_tree_instance->set_object_bbox(mesh_bbox);
+    growth = max(growth, mesh_tree->get_sah_cost_growth());
+  }
+  tree->refit();
+  return max(growth, tree->get_sah_cost_growth());
+}
+
 void Scene::toggle_shadows()
 {
   for(unsigned int i = 0; i < lights.size(); ++i)
@@ -373,6 +958,26 @@ void Scene::draw_plane(const Plane* plane)
     tex->disable();
 }
 
+void Scene::draw_quadric(const Quadric* quadric)
+{
+  // Shade the whole surface as seen from the camera at its closest point
+  Vec3f shade(0.5f);
+  Vec3f c;
+  float rad;
+  quadric->compute_bsphere(c, rad);
+  Vec3f ray_vec = c - cam->get_position();
+  Ray r(cam->get_position(), normalize(ray_vec));
+  if(quadric->intersect(r, 0))
+  {
+    quadric->finalize_hit(r, 0);
+    unsigned int model = r.get_hit_material()->illum;
+    if(model < shaders.size() && shaders[model])
+      shade = shaders[model]->shade(r);
+  }
+  glColor3fv(shade.get());
+  quadric->draw();
+}
+
 void Scene::draw()
 {
   static unsigned int disp_list = 0;
@@ -389,6 +994,8 @@ void Scene::draw()
       draw_mesh(meshes[i]);
     for(unsigned int i = 0; i < planes.size(); ++i)
       draw_plane(planes[i]);
+    for(unsigned int i = 0; i < quadrics.size(); ++i)
+      draw_quadric(quadrics[i]);
 
     glEndList();
     redraw = false;
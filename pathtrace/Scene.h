@@ -13,22 +13,33 @@
 #include "../optprops/Interface.h"
 #include "../optprops/Medium.h"
 #include "TriMesh.h"
-#include "BSPTree.h"
+#include "Accelerator.h"
 #include "Ray.h"
+#include "RayPacket.h"
 #include "ObjMaterial.h"
 #include "Light.h"
 #include "Camera.h"
 #include "Shader.h"
 #include "AABB.h"
 #include "Plane.h"
+#include "Quadric.h"
+#include "MeshInstance.h"
+#include "DynamicBvhTree.h"
 #include "Texture.h"
 
 class RayTracer;
 
+enum AcceleratorType { acc_bsp_tree, acc_bvh, acc_bvh4, acc_compressed_bvh, acc_sbvh4, acc_kd_tree, acc_lazy_bvh };
+
 class Scene
 {
 public:
-  Scene(const Camera* c) : planes(0), light_tracer(0), cam(c), shaders(10, static_cast<Shader*>(0)), redraw(true), do_textures(false) { }
+  Scene(const Camera* c) 
+    : planes(0), light_tracer(0), tree(0), top_level(0), mesh_tree(0), mesh_tree_instance(0), proxy_tree(0), auto_tune(false), use_cache(false), 
+      use_proxies(false), proxy_reduction(0.1f), proxy_depth(2), proxy_min_faces(10000), cam(c), shaders(10, static_cast<Shader*>(0)), redraw(true), do_textures(false) 
+  { 
+    set_accelerator(acc_bvh4);
+  }
   ~Scene();
 
   // Accessors
@@ -47,12 +58,53 @@ public:
   std::map<std::string, Texture*>& get_textures() { return textures; }
   std::map<const TriMesh*, const Interface*> get_volumes();
 
-  // Loaders
-  void load_mesh(const std::string& filename, const CGLA::Mat4x4f& transform = CGLA::identity_Mat4x4f());
+  // Loaders. The visibility of a mesh is a mask of the ray types that can
+  // hit it (see Object3D.h). Hiding light fixtures from shadow rays or
+  // background geometry from photons lets the accelerators skip the
+  // subtrees holding them for those rays. Masks set after building take
+  // effect when the accelerators are built or refitted.
+  void load_mesh(const std::string& filename, const CGLA::Mat4x4f& transform = CGLA::identity_Mat4x4f(), 
+                 unsigned int visibility = VISIBLE_TO_ALL);
   TriMesh* load_background_mesh(const std::string& filename, const CGLA::Mat4x4f& transform = CGLA::identity_Mat4x4f());
   void load_media(const std::string& filename);
   void add_plane(const CGLA::Vec3f& position, const CGLA::Vec3f& normal, const std::string& mtl_file, unsigned int mtl_idx = 1, float tex_scale = 1.0f);
 
+  // Analytic primitives. They are intersected exactly instead of through
+  // a tessellation. load_sphere replaces a tessellated sphere in an OBJ
+  // file by the sphere through its vertices with the material of its
+  // first face.
+  void add_sphere(const CGLA::Vec3f& center, float radius, const std::string& mtl_file, unsigned int mtl_idx = 1);
+  void add_disk(const CGLA::Vec3f& center, const CGLA::Vec3f& normal, float radius, const std::string& mtl_file, unsigned int mtl_idx = 1);
+  void add_cylinder(const CGLA::Vec3f& base, const CGLA::Vec3f& axis, float radius, float height, const std::string& mtl_file, unsigned int mtl_idx = 1);
+  void load_sphere(const std::string& filename, const CGLA::Mat4x4f& transform = CGLA::identity_Mat4x4f());
+
+  // Instancing. An instanced mesh is loaded once in object space and gets
+  // its own accelerator. Instances place it in the scene with a transform.
+  // Rays of a type that an instance is hidden from skip its whole bottom
+  // level. The top level is a dynamic BVH. Once it is built, adding,
+  // removing, moving, or hiding an instance reinserts only the leaf of
+  // that instance, so editing one object does not rebuild the others.
+  // Adding the first instance to a scene built without instances rebuilds
+  // it once as a two level structure. build_instance_tree rebuilds the top
+  // level from scratch. Removed instances keep their index, which is
+  // counted by get_no_of_instances but never reused. Changes to removed
+  // or unknown instances are ignored.
+  const TriMesh* load_instanced_mesh(const std::string& filename);
+  unsigned int add_instance(const TriMesh* mesh, const CGLA::Mat4x4f& transform = CGLA::identity_Mat4x4f());
+  void remove_instance(unsigned int instance);
+  void set_instance_transform(unsigned int instance, const CGLA::Mat4x4f& transform);
+  void set_instance_visibility(unsigned int instance, unsigned int visibility);
+  unsigned int get_no_of_instances() const { return instances.size(); }
+  void build_instance_tree();
+
+  // Proxies. Diffuse bounces cannot resolve fine geometric detail. Rays
+  // on paths that have hit a diffuse surface are traced against decimated
+  // copies of the meshes with at least min_faces triangles once their
+  // trace depth reaches min_depth. The proxies have their own accelerator
+  // and are made by build_bsptree for scenes without instances. Refitting
+  // discards them until the next build.
+  void enable_proxies(float reduction = 0.1f, int min_depth = 2, unsigned int min_faces = 10000);
+
   // Light handling
   void add_light(Light* light) { if(light) lights.push_back(light); }
   unsigned int extract_area_lights(RayTracer* tracer, unsigned int samples_per_light = 1);
@@ -66,8 +118,39 @@ public:
   bool is_redoing_display_list() { return redraw; }
 
   // Ray intersection
-  void build_bsptree() { tree.init(meshes, planes); }
-  bool intersect(Ray& r) const { return tree.closest_hit(r); }
+  void set_accelerator(AcceleratorType type);
+  void set_accelerator(AcceleratorType type, unsigned int max_objects_in_leaf, unsigned int max_levels_in_tree)
+  {
+    acc_type = type;
+    acc_max_objects = max_objects_in_leaf;
+    acc_max_level = max_levels_in_tree;
+  }
+
+  // Auto-tuning, off by default. build_bsptree first builds each
+  // accelerator type with a few leaf sizes and a depth limit suited to the
+  // number of primitives. The builds with the lowest SAH costs for their
+  // type are timed on a probe of camera, bounce, and shadow rays, and the
+  // fastest becomes the configuration used for all accelerators of the
+  // scene. The lazy BVH is not considered, since its cost depends on how
+  // much of it is expanded. With the accelerator cache enabled, the choice
+  // is stored and later runs skip the tuning builds.
+  void enable_auto_tuning() { auto_tune = true; }
+  void enable_accelerator_cache(const std::string& directory = "") { use_cache = true; cache_dir = directory; }
+  void build_bsptree();
+
+  // Refitting. After meshes have been transformed or deformed, the
+  // accelerators can be refitted to the new vertex positions instead of
+  // being rebuilt. The returned value is the largest growth in expected
+  // ray cost relative to the last build. Call build_bsptree when it
+  // becomes too large for refitting to pay off.
+  float refit_bsptree();
+
+  bool intersect(Ray& r) const;
+  void intersect(RayPacket& packet) const { tree->closest_hits(packet); }
+  bool occluded(const Ray& r, unsigned int* occluder = 0) const { return tree->occluded(r, occluder); }
+  void intersect_batch(std::vector<Ray>& rays) const { tree->intersect_batch(rays); }
+  void occluded_batch(const std::vector<Ray>& rays, std::vector<bool>& hits) const { tree->occluded_batch(rays, hits); }
+  unsigned int all_hits(const Ray& r, std::vector<Ray>& hits, unsigned int max_hits = 0) const { return tree->all_hits(r, hits, max_hits); }
   bool intersect_light(const Ray& r, CGLA::Vec3f& L) { return lights.size() > 0 ? lights[0]->intersect(r, L) : false; }
 
   // ObjMaterial classification
@@ -76,6 +159,12 @@ public:
 private:
   void draw_mesh(const TriMesh* mesh) const;
   void draw_plane(const Plane* plane);
+  void draw_quadric(const Quadric* quadric);
+  void add_quadric(Quadric* quadric);
+  void build_proxies();
+  void clear_proxies();
+  void tune_accelerator(const std::vector<const Object3D*>& objects);
+  Accelerator* build_accelerator(const std::vector<const Object3D*>& objects, const std::vector<const Plane*>& planes) const;
 
   std::map<std::string, Medium> media;
   std::map<std::string, Interface> interfaces;
@@ -85,8 +174,29 @@ private:
   std::vector<unsigned int> extracted_lights;
   std::vector<const TriMesh*> meshes;
   std::vector<const Plane*> planes;
+  std::vector<const Quadric*> quadrics;
+  std::vector<const TriMesh*> instanced_meshes;
+  std::map<const TriMesh*, Accelerator*> bottom_levels;
+  std::vector<MeshInstance*> instances;   // Removed instances are null
+  std::vector<unsigned int> instance_handles;   // Handles of the instances in top_level
   RayTracer* light_tracer;
-  BspTree tree;
+  Accelerator* tree;
+  DynamicBvhTree* top_level;          // The tree if the scene has instances
+  Accelerator* mesh_tree;             // Meshes that are not instanced if the scene has instances
+  MeshInstance* mesh_tree_instance;   // Placement of mesh_tree in the top level
+  std::vector<const TriMesh*> proxy_meshes;
+  std::map<const TriMesh*, float> proxy_offsets;   // Largest vertex displacement of each proxy
+  Accelerator* proxy_tree;
+  AcceleratorType acc_type;
+  unsigned int acc_max_objects;       // Leaf size and depth limit of the accelerators
+  unsigned int acc_max_level;
+  bool auto_tune;
+  bool use_cache;                     // Load and store accelerators over meshes in cache_dir
+  std::string cache_dir;
+  bool use_proxies;
+  float proxy_reduction;              // Fraction of the triangles kept in proxies
+  int proxy_depth;                    // Trace depth from which proxies are used
+  unsigned int proxy_min_faces;       // Smallest mesh that gets a proxy
   AABB bbox;
   const Camera* cam;
   std::vector<Shader*> shaders;
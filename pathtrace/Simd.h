@@ -0,0 +1,18 @@
+// 02576 Rendering Framework
+// Detection of the SSE instructions used by the SIMD code paths.
+// Copyright (c) DTU Compute 2013
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+  #include <xmmintrin.h>
+  #define USE_SSE
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define USE_SSE2
+#endif
+
+#endif // SIMD_H
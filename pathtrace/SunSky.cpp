@@ -33,10 +33,11 @@ bool PreethamSunSky::sample(const Vec3f& pos, Vec3f& dir, Vec3f& L) const
 
   // test for shadow
   Ray shadowRay(pos, dir);
+  shadowRay.type = ray_shadow;
   bool inShadow = false;
 
   if (shadows)
-    inShadow = tracer->trace(shadowRay);
+    inShadow = tracer->trace_shadow(shadowRay, get_occluder());
 
   return !inShadow;
 }
@@ -0,0 +1,35 @@
+// 02576 Rendering Framework
+// Helpers for data kept per OpenMP thread.
+// Copyright (c) DTU Compute 2013
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <algorithm>
+
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+const unsigned int CACHE_LINE_SIZE = 64;
+
+// Number of entries needed to give every thread of a parallel region its own
+inline unsigned int get_max_threads()
+{
+#ifdef _OPENMP
+  return std::max(omp_get_max_threads(), omp_get_num_procs());
+#else
+  return 1;
+#endif
+}
+
+inline unsigned int get_thread_num()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+#endif // THREADS_H
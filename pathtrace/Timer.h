@@ -7,34 +7,49 @@
 
 #include <ctime>
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+// Measures wall clock time when OpenMP is available (std::clock measures
+// processor time summed over all threads on some platforms).
 class Timer
 {
  public:
-  Timer() : t1(0), t2(0) { }
+  Timer() : t1(0.0), t2(0.0) { }
   
   void start(double from_time = 0.0)
   {
-    t1 = static_cast<int>(std::clock() - from_time*static_cast<double>(CLOCKS_PER_SEC));
+    t1 = now() - from_time;
   }
 
   double split()
   {
-    return (std::clock() - t1) / static_cast<double>(CLOCKS_PER_SEC);
+    return now() - t1;
   }
 
   void stop()
   {
-    t2 = std::clock();
+    t2 = now();
   }
   
   double get_time()
   {
-    return (t2 - t1) / static_cast<double>(CLOCKS_PER_SEC);
+    return t2 - t1;
   }
 
  private:
-  int t1;
-  int t2;
+  static double now()
+  {
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return std::clock()/static_cast<double>(CLOCKS_PER_SEC);
+#endif
+  }
+
+  double t1;
+  double t2;
 };
 
 class FrameRateTimer : public Timer
@@ -6,15 +6,66 @@
 #include <iostream>
 #include <cstdio>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
 #include "CGLA/Vec3f.h"
+#include "CGLA/Vec3i.h"
 #include "Ray.h"
 #include "IndexedFaceSet.h"
+#include "Morton.h"
 #include "Object3D.h"
+#include "AcceleratorCache.h"
 #include "TriMesh.h"
 
 using namespace std;
 using namespace CGLA;
 
+namespace
+{
+  const unsigned int MORTON_BITS = 10;   // Bits per axis of the quantized face centroids
+
+  // Put the faces of a face set in the given order and renumber its
+  // vertices by their first use. Faces missing at the end of a set that
+  // is shorter than the geometry are taken to be zero faces, as added by
+  // the OBJ loader. Unused vertices are kept after the used ones.
+  void reorder_face_set(IndexedFaceSet& set, const vector<unsigned int>& order)
+  {
+    if(set.no_faces() == 0)
+      return;
+    vector<int> new_idx(set.no_vertices(), -1);
+    IndexedFaceSet reordered;
+    for(unsigned int i = 0; i < order.size(); ++i)
+    {
+      Vec3i face = order[i] < set.no_faces() ? set.face(order[i]) : Vec3i(0);
+      for(unsigned int j = 0; j < 3; ++j)
+      {
+        if(face[j] < 0 || face[j] >= static_cast<int>(new_idx.size()))
+          continue;
+        int& idx = new_idx[face[j]];
+        if(idx < 0)
+          idx = reordered.add_vertex(set.vertex(face[j]));
+        face[j] = idx;
+      }
+      reordered.add_face(face);
+    }
+    for(unsigned int i = 0; i < new_idx.size(); ++i)
+      if(new_idx[i] < 0)
+        reordered.add_vertex(set.vertex(i));
+    set = reordered;
+  }
+
+  template<class T> void reorder_array(vector<T>& a, const vector<unsigned int>& order)
+  {
+    if(a.size() != order.size())
+      return;
+    vector<T> reordered(a.size());
+    for(unsigned int i = 0; i < order.size(); ++i)
+      reordered[i] = a[order[i]];
+    a.swap(reordered);
+  }
+}
+
 bool intersect_triangle(const Ray& ray, 
                         const Vec3f& v0, 
                         const Vec3f& v1, 
@@ -68,14 +119,6 @@ bool TriMesh::intersect(Ray& r, unsigned int prim_idx) const
     r.dist = t;
     r.u = v;
     r.v = w;
-    if(has_normals())
-    {
-      face = normals.face(prim_idx);
-      r.hit_normal = normalize(normals.vertex(face[0])*(1.0f - v - w) + normals.vertex(face[1])*v + normals.vertex(face[2])*w);
-    }
-    else
-      r.hit_normal = normalize(n);
-    
     r.hit_object = this;
     r.hit_face_id = prim_idx;
     //if(material->has_texture && texcoords.no_faces() > 0)
@@ -88,6 +131,24 @@ bool TriMesh::intersect(Ray& r, unsigned int prim_idx) const
   return false;
 }
 
+void TriMesh::finalize_hit(Ray& r, unsigned int prim_idx) const
+{
+  Vec3i face = geometry.face(prim_idx);
+  const Vec3f& v0 = geometry.vertex(face[0]);
+  Vec3f n = cross(geometry.vertex(face[1]) - v0, v0 - geometry.vertex(face[2]));
+  r.hit_normal = get_shading_normal(prim_idx, r.u, r.v, -n);
+}
+
+Vec3f TriMesh::get_shading_normal(unsigned int prim_idx, float v, float w, const Vec3f& face_normal) const
+{
+  if(has_normals())
+  {
+    Vec3i face = normals.face(prim_idx);
+    return normalize(normals.vertex(face[0])*(1.0f - v - w) + normals.vertex(face[1])*v + normals.vertex(face[2])*w);
+  }
+  return normalize(face_normal);
+}
+
 void TriMesh::transform(const Mat4x4f& m)
 {
   for(unsigned int i = 0; i < geometry.no_vertices(); ++i)
@@ -106,6 +167,12 @@ AABB TriMesh::get_primitive_bbox(unsigned int prim_idx) const
   return bbox;
 }
 
+bool TriMesh::add_to_hash(CacheHash& hash) const
+{
+  hash.add_mesh(this);
+  return true;
+}
+
 AABB TriMesh::compute_bbox() const
 {
   AABB bbox;
@@ -204,3 +271,45 @@ void TriMesh::compute_areas()
     for(int i = 0; i < no_of_faces; ++i)
       face_area_cdf[i] /= surface_area;
 }
+
+void TriMesh::reorder_faces()
+{
+  unsigned int no_of_faces = geometry.no_faces();
+  if(no_of_faces == 0)
+    return;
+
+  // Sort the faces by the Morton code of their centroid in a grid over
+  // the bounding box of the centroids. Ties keep the file order.
+  vector<Vec3f> centroids(no_of_faces);
+  AABB bbox;
+  for(unsigned int i = 0; i < no_of_faces; ++i)
+  {
+    const Vec3i& f = geometry.face(i);
+    centroids[i] = (geometry.vertex(f[0]) + geometry.vertex(f[1]) + geometry.vertex(f[2]))/3.0f;
+    bbox.add_point(centroids[i]);
+  }
+  MortonGrid grid(bbox, MORTON_BITS);
+  vector< pair<unsigned int, unsigned int> > keys(no_of_faces);
+  for(unsigned int i = 0; i < no_of_faces; ++i)
+    keys[i] = make_pair(grid.get_code(centroids[i]), i);
+  sort(keys.begin(), keys.end());
+  vector<unsigned int> order(no_of_faces);
+  for(unsigned int i = 0; i < no_of_faces; ++i)
+    order[i] = keys[i].second;
+
+  reorder_face_set(geometry, order);
+  reorder_face_set(normals, order);
+  reorder_face_set(texcoords, order);
+  reorder_array(mat_idx, order);
+  reorder_array(tex_idx, order);
+  if(face_areas.size() == no_of_faces)
+  {
+    reorder_array(face_areas, order);
+    float area = 0.0f;
+    for(unsigned int i = 0; i < no_of_faces; ++i)
+    {
+      area += face_areas[i];
+      face_area_cdf[i] = surface_area > 0.0f ? area/surface_area : 0.0f;
+    }
+  }
+}
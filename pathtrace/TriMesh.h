@@ -69,9 +69,17 @@ class TriMesh : public Object3D
 
 	// -------- FUNCTIONS -----------
 
-  /// Compute intersection of ray with a triangle in the mesh
+  /// Compute intersection of ray with a triangle in the mesh. Only the
+  /// distance, the barycentric coordinates, and the face are recorded.
   virtual bool intersect(Ray& r, unsigned int prim_idx) const;
 
+  /// Compute the shading normal of a hit recorded by intersect
+  virtual void finalize_hit(Ray& r, unsigned int prim_idx) const;
+
+  /// Normal at barycentric coordinates (v, w) of a triangle. The face normal
+  /// is normalized and used if the mesh has no vertex normals.
+  CGLA::Vec3f get_shading_normal(unsigned int prim_idx, float v, float w, const CGLA::Vec3f& face_normal) const;
+
   /// Apply a transformation matrix to the mesh
   virtual void transform(const CGLA::Mat4x4f& m);
 
@@ -84,6 +92,9 @@ class TriMesh : public Object3D
   /// Get the bounding box of a triangle in the mesh
   virtual AABB get_primitive_bbox(unsigned int prim_idx) const;
 
+  /// Add the vertices and faces to a cache hash
+  virtual bool add_to_hash(CacheHash& hash) const;
+
 	/// Returns true if at least one normal has been defined.
 	bool has_normals() const 
 	{
@@ -101,6 +112,12 @@ class TriMesh : public Object3D
 
   /// Compute areas for all faces and total surface area.
   void compute_areas();
+
+  /// Reorder the faces along a Morton curve through their centroids and
+  /// renumber the vertices of each indexed face set by first use, so that
+  /// triangles close in space are close in memory. The per-face arrays
+  /// follow the faces.
+  void reorder_faces();
 };
 
 #endif // TRIMESH_H
@@ -0,0 +1,278 @@
+// 02576 Rendering Framework
+// Accelerator primitives stored with precomputed triangle edges and normals.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include <map>
+#include <typeinfo>
+#include "CGLA/Vec3f.h"
+#include "CGLA/Vec3i.h"
+#include "AccObj.h"
+#include "TriMesh.h"
+#include "Simd.h"
+#include "TriangleStore.h"
+
+using namespace std;
+using namespace CGLA;
+
+void TriangleStore::build(const vector<AccObj*>& accobjs)
+{
+  // Primitives of the same object are mostly stored next to each other,
+  // so the table is only searched when the object changes
+  map<const Object3D*, unsigned int> table_idx;
+  const Object3D* last_object = 0;
+  unsigned int last_id = 0;
+  geometry.clear();
+  object_ids.resize(accobjs.size());
+  prim_idx.resize(accobjs.size());
+  for(unsigned int i = 0; i < accobjs.size(); ++i)
+  {
+    if(!accobjs[i])
+    {
+      object_ids[i] = NO_PRIMITIVE;
+      prim_idx[i] = 0;
+      continue;
+    }
+    const Object3D* object = accobjs[i]->geometry;
+    if(object != last_object)
+    {
+      map<const Object3D*, unsigned int>::iterator j = table_idx.find(object);
+      if(j == table_idx.end())
+      {
+        j = table_idx.insert(make_pair(object, static_cast<unsigned int>(geometry.size()))).first;
+        geometry.push_back(object);
+      }
+      last_object = object;
+      last_id = j->second;
+    }
+    object_ids[i] = last_id;
+    prim_idx[i] = accobjs[i]->prim_idx;
+  }
+  find_meshes();
+  blocks.assign((prim_idx.size() + 3)/4, TriangleBlock());
+  update();
+}
+
+void TriangleStore::build(const vector<const Object3D*>& object_table, const vector<unsigned int>& primitive_objects, 
+                          const vector<unsigned int>& primitive_indices)
+{
+  geometry = object_table;
+  object_ids = primitive_objects;
+  prim_idx = primitive_indices;
+  find_meshes();
+  blocks.assign((prim_idx.size() + 3)/4, TriangleBlock());
+  update();
+}
+
+void TriangleStore::find_meshes()
+{
+  // Subclasses of TriMesh may intersect differently, so only exact meshes are stored
+  meshes.resize(geometry.size());
+  for(unsigned int i = 0; i < geometry.size(); ++i)
+  {
+    const TriMesh* mesh = dynamic_cast<const TriMesh*>(geometry[i]);
+    meshes[i] = mesh && typeid(*mesh) == typeid(TriMesh) ? mesh : 0;
+  }
+  mesh_lanes.assign((prim_idx.size() + 3)/4, 0);
+  for(unsigned int i = 0; i < prim_idx.size(); ++i)
+    if(object_ids[i] != NO_PRIMITIVE && meshes[object_ids[i]])
+      mesh_lanes[i >> 2] |= 1 << (i & 3);
+}
+
+void TriangleStore::update()
+{
+  visible_lanes.assign(blocks.size(), 0);
+  for(unsigned int i = 0; i < prim_idx.size(); ++i)
+    if(object_ids[i] != NO_PRIMITIVE)
+      visible_lanes[i >> 2] |= pack_visibility(geometry[object_ids[i]]->get_visibility(), i & 3);
+
+  int no_of_prims = prim_idx.size();
+  #pragma omp parallel for
+  for(int i = 0; i < no_of_prims; ++i)
+  {
+    if(object_ids[i] == NO_PRIMITIVE || !meshes[object_ids[i]])
+      continue;
+    const TriMesh* mesh = meshes[object_ids[i]];
+
+    Vec3i face = mesh->geometry.face(prim_idx[i]);
+    const Vec3f& v0 = mesh->geometry.vertex(face[0]);
+    Vec3f e0 = mesh->geometry.vertex(face[1]) - v0;
+    Vec3f e1 = v0 - mesh->geometry.vertex(face[2]);
+    Vec3f n = cross(e0, e1);
+    TriangleBlock& tri = blocks[i >> 2];
+    unsigned int k = i & 3;
+    for(unsigned int j = 0; j < 3; ++j)
+    {
+      tri.v0[j][k] = v0[j];
+      tri.e0[j][k] = e0[j];
+      tri.e1[j][k] = e1[j];
+      tri.n[j][k] = n[j];
+    }
+  }
+}
+
+unsigned int TriangleStore::get_visibility(unsigned int first, unsigned int count) const
+{
+  unsigned int packed = 0;
+  for(unsigned int end = first + count; first < end; first = (first | 3) + 1)
+  {
+    unsigned int lanes = get_lanes(first, end);
+    packed |= visible_lanes[first >> 2] & (lanes*0x1111);
+  }
+  unsigned int mask = 0;
+  for(unsigned int type = 0; type < NO_OF_RAY_TYPES; ++type)
+    if(get_visible_lanes(packed, static_cast<RayType>(type)))
+      mask |= 1u << type;
+  return mask;
+}
+
+void TriangleStore::finalize_hit(Ray& r, unsigned int i) const
+{
+  const TriMesh* mesh = meshes[object_ids[i]];
+  if(!mesh)
+  {
+    geometry[object_ids[i]]->finalize_hit(r, prim_idx[i]);
+    return;
+  }
+
+  const TriangleBlock& tri = blocks[i >> 2];
+  const unsigned int k = i & 3;
+  r.hit_face_id = prim_idx[i];
+  r.hit_normal = mesh->get_shading_normal(prim_idx[i], r.u, r.v, -Vec3f(tri.n[0][k], tri.n[1][k], tri.n[2][k]));
+}
+
+bool TriangleStore::intersect_block(Ray& r, unsigned int block, unsigned int lanes, unsigned int& hit_idx) const
+{
+  // Other objects are tested first, since the triangle test only reports
+  // the closest of the triangles
+  bool found = false;
+  unsigned int first = block << 2;
+  lanes &= get_visible_lanes(visible_lanes[block], r.type);
+  unsigned int other_lanes = lanes & ~mesh_lanes[block];
+  for(unsigned int k = 0; other_lanes; ++k, other_lanes >>= 1)
+    if((other_lanes & 1) && intersect(r, first + k))
+    {
+      r.tmax = r.dist;
+      hit_idx = first + k;
+      found = true;
+    }
+
+  float t, v, w;
+  unsigned int k = intersect_lanes(r, block, lanes & mesh_lanes[block], t, v, w);
+  if(k == 4)
+    return found;
+  unsigned int i = first + k;
+  r.has_hit = true;
+  r.dist = t;
+  r.u = v;
+  r.v = w;
+  r.hit_object = meshes[object_ids[i]];
+  r.hit_face_id = prim_idx[i];
+  r.tmax = t;
+  hit_idx = i;
+  return true;
+}
+
+bool TriangleStore::occludes_block(const Ray& r, unsigned int block, unsigned int lanes, unsigned int& hit_idx) const
+{
+  unsigned int first = block << 2;
+  lanes &= get_visible_lanes(visible_lanes[block], r.type);
+  float t, v, w;
+  unsigned int k = intersect_lanes(r, block, lanes & mesh_lanes[block], t, v, w);
+  if(k < 4)
+  {
+    hit_idx = first + k;
+    return true;
+  }
+  unsigned int other_lanes = lanes & ~mesh_lanes[block];
+  for(k = 0; other_lanes; ++k, other_lanes >>= 1)
+    if((other_lanes & 1) && occludes(r, first + k))
+    {
+      hit_idx = first + k;
+      return true;
+    }
+  return false;
+}
+
+unsigned int TriangleStore::intersect_lanes(const Ray& r, unsigned int block, unsigned int lanes, float& t, float& v, float& w) const
+{
+  if(!lanes)
+    return 4;
+  const TriangleBlock& tri = blocks[block];
+  float t_lanes[4], v_lanes[4], w_lanes[4];
+#ifdef USE_SSE
+  // The test of intersect_triangle with the operations in the same order
+  __m128 d[3], o_to_v0[3], n[3], n_tmp[3];
+  for(unsigned int i = 0; i < 3; ++i)
+  {
+    d[i] = _mm_set1_ps(r.direction[i]);
+    o_to_v0[i] = _mm_sub_ps(_mm_loadu_ps(tri.v0[i]), _mm_set1_ps(r.origin[i]));
+    n[i] = _mm_loadu_ps(tri.n[i]);
+  }
+  __m128 q = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], n[0]), _mm_mul_ps(d[1], n[1])), _mm_mul_ps(d[2], n[2]));
+  __m128 abs_q = _mm_andnot_ps(_mm_set1_ps(-0.0f), q);
+  __m128 valid = _mm_cmpge_ps(abs_q, _mm_set1_ps(1.0e-12f));
+  q = _mm_div_ps(_mm_set1_ps(1.0f), q);
+  __m128 t4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(o_to_v0[0], n[0]), _mm_mul_ps(o_to_v0[1], n[1])), 
+                                    _mm_mul_ps(o_to_v0[2], n[2])), q);
+  valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t4, _mm_set1_ps(r.tmin)), _mm_cmple_ps(t4, _mm_set1_ps(r.tmax))));
+  if(!(_mm_movemask_ps(valid) & lanes))
+    return 4;
+  for(unsigned int i = 0; i < 3; ++i)
+  {
+    unsigned int j = (i + 1)%3, k = (i + 2)%3;
+    n_tmp[i] = _mm_sub_ps(_mm_mul_ps(o_to_v0[j], d[k]), _mm_mul_ps(o_to_v0[k], d[j]));
+  }
+  __m128 e[3];
+  for(unsigned int i = 0; i < 3; ++i)
+    e[i] = _mm_loadu_ps(tri.e1[i]);
+  __m128 v4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(n_tmp[0], e[0]), _mm_mul_ps(n_tmp[1], e[1])), _mm_mul_ps(n_tmp[2], e[2])), q);
+  for(unsigned int i = 0; i < 3; ++i)
+    e[i] = _mm_loadu_ps(tri.e0[i]);
+  __m128 w4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(n_tmp[0], e[0]), _mm_mul_ps(n_tmp[1], e[1])), _mm_mul_ps(n_tmp[2], e[2])), q);
+  __m128 zero = _mm_setzero_ps();
+  valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v4, zero), _mm_cmpge_ps(w4, zero)));
+  valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(v4, w4), _mm_set1_ps(1.0f)));
+  lanes &= _mm_movemask_ps(valid);
+  _mm_storeu_ps(t_lanes, t4);
+  _mm_storeu_ps(v_lanes, v4);
+  _mm_storeu_ps(w_lanes, w4);
+#else
+  unsigned int hit_lanes = 0;
+  for(unsigned int k = 0; k < 4; ++k)
+    if((lanes & (1u << k)) && intersect_triangle(r, (block << 2) + k, t_lanes[k], v_lanes[k], w_lanes[k]))
+      hit_lanes |= 1u << k;
+  lanes = hit_lanes;
+#endif
+
+  // Of hits at the same distance, the last is kept as in a sequential test
+  unsigned int closest = 4;
+  for(unsigned int k = 0; k < 4; ++k)
+    if((lanes & (1u << k)) && (closest == 4 || t_lanes[k] <= t_lanes[closest]))
+      closest = k;
+  if(closest < 4)
+  {
+    t = t_lanes[closest];
+    v = v_lanes[closest];
+    w = w_lanes[closest];
+  }
+  return closest;
+}
+
+void TriangleStore::clear()
+{
+  vector<TriangleBlock>().swap(blocks);
+  vector<unsigned int>().swap(object_ids);
+  vector<unsigned int>().swap(prim_idx);
+  vector<const Object3D*>().swap(geometry);
+  vector<const TriMesh*>().swap(meshes);
+  vector<unsigned char>().swap(mesh_lanes);
+  vector<unsigned short>().swap(visible_lanes);
+}
+
+size_t TriangleStore::get_memory_usage() const
+{
+  return blocks.capacity()*sizeof(TriangleBlock) + (object_ids.capacity() + prim_idx.capacity())*sizeof(unsigned int)
+         + geometry.capacity()*sizeof(const Object3D*) + meshes.capacity()*sizeof(const TriMesh*) + mesh_lanes.capacity()
+         + visible_lanes.capacity()*sizeof(unsigned short);
+}
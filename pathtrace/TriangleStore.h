@@ -0,0 +1,234 @@
+// 02576 Rendering Framework
+// Accelerator primitives stored with precomputed triangle edges and normals.
+// Copyright (c) DTU Compute 2013
+
+#ifndef TRIANGLESTORE_H
+#define TRIANGLESTORE_H
+
+#include <vector>
+#include <cmath>
+#include "CGLA/Vec3f.h"
+#include "Ray.h"
+#include "AccObj.h"
+#include "TriMesh.h"
+#include "HitList.h"
+
+const unsigned int NO_PRIMITIVE = 0xffffffff;   // Object index of unused slots in a store
+
+// Visibility of the four lanes of a block or the four children of a node
+// packed in 16 bits. Bit 4*type + lane is set if rays of the type can hit
+// something in the lane.
+inline unsigned int pack_visibility(unsigned int mask, unsigned int lane)
+{
+  unsigned int packed = 0;
+  for(unsigned int type = 0; type < NO_OF_RAY_TYPES; ++type)
+    if(mask & (1u << type))
+      packed |= 1u << (4*type + lane);
+  return packed;
+}
+
+inline unsigned int get_visible_lanes(unsigned int packed, RayType type)
+{
+  return (packed >> 4*type) & 0xf;
+}
+
+// Lanes visible to any of the ray types in a mask
+inline unsigned int get_lanes_visible_to_any(unsigned int packed, unsigned int mask)
+{
+  unsigned int lanes = 0;
+  for(unsigned int type = 0; type < NO_OF_RAY_TYPES; ++type)
+    if(mask & (1u << type))
+      lanes |= (packed >> 4*type) & 0xf;
+  return lanes;
+}
+
+/// Four triangles stored as structure of arrays. The edges and the normal
+/// are the ones computed by intersect_triangle.
+struct TriangleBlock
+{
+  float v0[3][4];  // [axis][triangle]
+  float e0[3][4];  // v1 - v0
+  float e1[3][4];  // v0 - v2
+  float n[3][4];   // cross(e0, e1)
+};
+
+/// Copy of a list of accelerator objects in which the triangles of meshes
+/// are intersected without virtual calls or lookups in the indexed face
+/// sets. Other objects are intersected through Object3D::intersect.
+/// Intersection only records distance, barycentric coordinates, and the
+/// hit face. The remaining attributes are computed by finalize_hit once
+/// the closest hit is known. Primitives refer to their object by a 32-bit
+/// index into a table of the objects in the store. Primitives stored next
+/// to each other, as in the leaves of a tree, can be intersected as a range
+/// in which the triangles of each block are tested four at a time with
+/// SSE. Builders can pad the store with unused slots (null objects) to
+/// start each leaf at a block boundary. Unused slots must never be tested.
+/// Primitives of objects hidden from the type of a ray are skipped. The
+/// visibility masks of the objects are copied by build and update.
+class TriangleStore
+{
+public:
+  void build(const std::vector<AccObj*>& objects);
+  void build(const std::vector<const Object3D*>& object_table, const std::vector<unsigned int>& primitive_objects, 
+             const std::vector<unsigned int>& primitive_indices);
+  void update();
+  void clear();
+
+  unsigned int size() const { return prim_idx.size(); }
+  size_t get_memory_usage() const;
+
+  // Object table and the object and primitive index of each primitive
+  const std::vector<const Object3D*>& get_object_table() const { return geometry; }
+  const std::vector<unsigned int>& get_object_ids() const { return object_ids; }
+  const std::vector<unsigned int>& get_prim_indices() const { return prim_idx; }
+
+  bool is_visible(const Ray& r, unsigned int i) const
+  {
+    return (visible_lanes[i >> 2] >> (4*r.type + (i & 3))) & 1;
+  }
+
+  // Mask of the ray types that can hit one of the primitives first, ...,
+  // first + count - 1
+  unsigned int get_visibility(unsigned int first, unsigned int count) const;
+
+  bool intersect(Ray& r, unsigned int i) const
+  {
+    if(!is_visible(r, i))
+      return false;
+    const TriMesh* mesh = meshes[object_ids[i]];
+    if(!mesh)
+      return geometry[object_ids[i]]->intersect(r, prim_idx[i]);
+
+    float t, v, w;
+    if(!intersect_triangle(r, i, t, v, w))
+      return false;
+    r.has_hit = true;
+    r.dist = t;
+    r.u = v;
+    r.v = w;
+    r.hit_object = mesh;
+    r.hit_face_id = prim_idx[i];
+    return true;
+  }
+
+  // Closest hit with the primitives first, ..., first + count - 1. Each
+  // hit found moves r.tmax to the hit distance. Returns true and sets
+  // hit_idx if a hit was found.
+  bool intersect_range(Ray& r, unsigned int first, unsigned int count, unsigned int& hit_idx) const
+  {
+    bool found = false;
+    for(unsigned int end = first + count; first < end; first = (first | 3) + 1)
+      found = intersect_block(r, first >> 2, get_lanes(first, end), hit_idx) || found;
+    return found;
+  }
+
+  bool occludes_range(const Ray& r, unsigned int first, unsigned int count, unsigned int& hit_idx) const
+  {
+    for(unsigned int end = first + count; first < end; first = (first | 3) + 1)
+      if(occludes_block(r, first >> 2, get_lanes(first, end), hit_idx))
+        return true;
+    return false;
+  }
+
+  // The same for the primitives of a block selected by a mask of lanes
+  bool intersect_block(Ray& r, unsigned int block, unsigned int lanes, unsigned int& hit_idx) const;
+  bool occludes_block(const Ray& r, unsigned int block, unsigned int lanes, unsigned int& hit_idx) const;
+
+  // Test for a hit without recording anything in the ray. Unused slots
+  // never occlude, so a stale index from an earlier build is harmless.
+  bool occludes(const Ray& r, unsigned int i) const
+  {
+    if(object_ids[i] == NO_PRIMITIVE || !is_visible(r, i))
+      return false;
+    if(!meshes[object_ids[i]])
+    {
+      Ray tmp = r;
+      return geometry[object_ids[i]]->occludes(tmp, prim_idx[i]);
+    }
+    float t, v, w;
+    return intersect_triangle(r, i, t, v, w);
+  }
+
+  // Add the hits with primitive i between r.tmin and the end of the list
+  void add_hits(const Ray& r, unsigned int i, HitList& hits) const
+  {
+    if(!is_visible(r, i))
+      return;
+    const TriMesh* mesh = meshes[object_ids[i]];
+    if(!mesh)
+    {
+      Ray tmp = r;
+      tmp.tmax = hits.get_tmax();
+      const Object3D* obj = geometry[object_ids[i]];
+      if(!obj->add_hits(tmp, prim_idx[i], hits) && obj->intersect(tmp, prim_idx[i]))
+        hits.add(tmp, i);
+      return;
+    }
+
+    float t, v, w;
+    if(!intersect_triangle(r, i, t, v, w) || t > hits.get_tmax())
+      return;
+    Ray hit = r;
+    hit.has_hit = true;
+    hit.dist = t;
+    hit.u = v;
+    hit.v = w;
+    hit.hit_object = mesh;
+    hit.hit_face_id = prim_idx[i];
+    hits.add(hit, i);
+  }
+
+  void finalize_hit(Ray& r, unsigned int i) const;
+
+private:
+  bool intersect_triangle(const Ray& r, unsigned int i, float& t, float& v, float& w) const
+  {
+    const TriangleBlock& tri = blocks[i >> 2];
+    const unsigned int k = i & 3;
+    const CGLA::Vec3f n(tri.n[0][k], tri.n[1][k], tri.n[2][k]);
+
+    // Compute ray-plane intersection
+    float q = dot(r.direction, n);
+    if(std::fabs(q) < 1.0e-12f)
+      return false;
+    q = 1.0f/q;
+    CGLA::Vec3f o_to_v0 = CGLA::Vec3f(tri.v0[0][k], tri.v0[1][k], tri.v0[2][k]) - r.origin;
+    t = dot(o_to_v0, n)*q;
+
+    // Check distance to intersection
+    if(t < r.tmin || t > r.tmax)
+      return false;
+
+    // Find barycentric coordinates
+    CGLA::Vec3f n_tmp = cross(o_to_v0, r.direction);
+    v = dot(n_tmp, CGLA::Vec3f(tri.e1[0][k], tri.e1[1][k], tri.e1[2][k]))*q;
+    if(v < 0.0f)
+      return false;
+    w = dot(n_tmp, CGLA::Vec3f(tri.e0[0][k], tri.e0[1][k], tri.e0[2][k]))*q;
+    return !(w < 0.0f || v + w > 1.0f);
+  }
+
+  // Lanes of the block of primitive first that lie before end
+  static unsigned int get_lanes(unsigned int first, unsigned int end)
+  {
+    unsigned int block_end = (first | 3) + 1;
+    unsigned int lanes = (0xf << (first & 3)) & 0xf;
+    return end < block_end ? lanes & ~(0xf << (end & 3)) : lanes;
+  }
+
+  // Lane of the closest triangle hit among the given lanes of a block or
+  // 4 if there is no hit
+  unsigned int intersect_lanes(const Ray& r, unsigned int block, unsigned int lanes, float& t, float& v, float& w) const;
+
+  void find_meshes();
+
+  std::vector<TriangleBlock> blocks;
+  std::vector<unsigned int> object_ids;    // index into the object table
+  std::vector<unsigned int> prim_idx;
+  std::vector<const Object3D*> geometry;   // object table
+  std::vector<const TriMesh*> meshes;      // objects as triangle meshes, null for other objects
+  std::vector<unsigned char> mesh_lanes;   // lanes of each block that hold triangles of meshes
+  std::vector<unsigned short> visible_lanes;   // packed visibility of each block
+};
+
+#endif // TRIANGLESTORE_H
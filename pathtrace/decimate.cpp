@@ -0,0 +1,173 @@
+// 02576 Rendering Framework
+// Simplification of triangle meshes by vertex clustering.
+// Copyright (c) DTU Compute 2013
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "CGLA/Vec3f.h"
+#include "CGLA/Vec3i.h"
+#include "AABB.h"
+#include "TriMesh.h"
+#include "decimate.h"
+
+using namespace std;
+using namespace CGLA;
+
+namespace
+{
+  const unsigned int MAX_ITERATIONS = 8;    // Maximum number of grid resolutions tried
+  const float FACE_SLACK = 1.25f;           // Accepted excess of faces over the target
+  const unsigned int CELL_BITS = 21;        // Bits per axis in a cell key
+
+  typedef unsigned long long CellKey;
+
+  struct ClusterFace
+  {
+    unsigned int v[3];
+    unsigned int face;
+
+    bool operator<(const ClusterFace& other) const
+    {
+      for(unsigned int i = 0; i < 3; ++i)
+        if(v[i] != other.v[i])
+          return v[i] < other.v[i];
+      return face < other.face;
+    }
+    bool operator==(const ClusterFace& other) const
+    {
+      return v[0] == other.v[0] && v[1] == other.v[1] && v[2] == other.v[2];
+    }
+  };
+
+  CellKey get_cell_key(const Vec3f& p, const Vec3f& p_min, float cell_size)
+  {
+    const CellKey max_cell = (1u << CELL_BITS) - 1;
+    CellKey key = 0;
+    for(unsigned int i = 0; i < 3; ++i)
+      key = (key << CELL_BITS) | min(static_cast<CellKey>((p[i] - p_min[i])/cell_size), max_cell);
+    return key;
+  }
+
+  // Assign the vertices to the occupied grid cells and place the vertex
+  // of each cell at the mean of its vertices.
+  void cluster_vertices(const IndexedFaceSet& geometry, float cell_size, const Vec3f& p_min,
+                        vector<unsigned int>& cluster_ids, vector<Vec3f>& clusters)
+  {
+    unsigned int no_of_vertices = geometry.no_vertices();
+    vector< pair<CellKey, unsigned int> > keys(no_of_vertices);
+    for(unsigned int i = 0; i < no_of_vertices; ++i)
+      keys[i] = make_pair(get_cell_key(geometry.vertex(i), p_min, cell_size), i);
+    sort(keys.begin(), keys.end());
+
+    vector<unsigned int> counts;
+    cluster_ids.resize(no_of_vertices);
+    clusters.clear();
+    for(unsigned int i = 0; i < no_of_vertices; ++i)
+    {
+      if(i == 0 || keys[i].first != keys[i - 1].first)
+      {
+        clusters.push_back(Vec3f(0.0f));
+        counts.push_back(0);
+      }
+      clusters.back() += geometry.vertex(keys[i].second);
+      ++counts.back();
+      cluster_ids[keys[i].second] = clusters.size() - 1;
+    }
+    for(unsigned int i = 0; i < clusters.size(); ++i)
+      clusters[i] /= static_cast<float>(counts[i]);
+  }
+
+  // Faces with three different clusters survive. Faces over the same
+  // clusters are merged. The smallest index is rotated to the front,
+  // which keeps the orientation of the face.
+  void cluster_faces(const IndexedFaceSet& geometry, const vector<unsigned int>& cluster_ids, vector<ClusterFace>& faces)
+  {
+    faces.clear();
+    for(unsigned int i = 0; i < geometry.no_faces(); ++i)
+    {
+      const Vec3i& f = geometry.face(i);
+      unsigned int a = cluster_ids[f[0]], b = cluster_ids[f[1]], c = cluster_ids[f[2]];
+      if(a == b || b == c || c == a)
+        continue;
+      ClusterFace face;
+      unsigned int first = a < b ? (a < c ? 0 : 2) : (b < c ? 1 : 2);
+      unsigned int v[3] = { a, b, c };
+      for(unsigned int j = 0; j < 3; ++j)
+        face.v[j] = v[(first + j)%3];
+      face.face = i;
+      faces.push_back(face);
+    }
+    sort(faces.begin(), faces.end());
+    faces.erase(unique(faces.begin(), faces.end()), faces.end());
+  }
+}
+
+float decimate(const TriMesh& mesh, TriMesh& proxy, unsigned int target_faces)
+{
+  const IndexedFaceSet& geometry = mesh.geometry;
+  AABB bbox = mesh.compute_bbox();
+  float area = 0.0f;
+  for(unsigned int i = 0; i < geometry.no_faces(); ++i)
+  {
+    const Vec3i& f = geometry.face(i);
+    area += 0.5f*length(cross(geometry.vertex(f[1]) - geometry.vertex(f[0]), geometry.vertex(f[2]) - geometry.vertex(f[0])));
+  }
+
+  // A closed mesh has about twice as many faces as vertices. Each
+  // occupied cell becomes a vertex and covers about the square of the
+  // cell size of the surface. Coarsen the grid until the target is met.
+  target_faces = max(target_faces, 1u);
+  float cell_size = sqrt(2.0f*area/target_faces);
+  float min_cell_size = bbox.get_diagonal().max_coord()/(1u << CELL_BITS);
+  vector<unsigned int> cluster_ids;
+  vector<Vec3f> clusters;
+  vector<ClusterFace> faces;
+  for(unsigned int i = 0; i < MAX_ITERATIONS; ++i)
+  {
+    cell_size = max(cell_size, min_cell_size);
+    cluster_vertices(geometry, cell_size, bbox.p_min, cluster_ids, clusters);
+    cluster_faces(geometry, cluster_ids, faces);
+    if(faces.size() <= target_faces*FACE_SLACK)
+      break;
+    cell_size *= sqrt(faces.size()/static_cast<float>(target_faces));
+  }
+
+  float max_displacement = 0.0f;
+  for(unsigned int i = 0; i < geometry.no_vertices(); ++i)
+    max_displacement = max(max_displacement, length(geometry.vertex(i) - clusters[cluster_ids[i]]));
+
+  // Surviving faces refer to the normals and texture coordinates of the
+  // face they came from
+  proxy = TriMesh();
+  proxy.name = mesh.name;
+  proxy.materials = mesh.materials;
+  for(unsigned int i = 0; i < clusters.size(); ++i)
+    proxy.geometry.add_vertex(clusters[i]);
+  for(unsigned int i = 0; i < mesh.normals.no_vertices(); ++i)
+    proxy.normals.add_vertex(mesh.normals.vertex(i));
+  for(unsigned int i = 0; i < mesh.texcoords.no_vertices(); ++i)
+    proxy.texcoords.add_vertex(mesh.texcoords.vertex(i));
+  for(unsigned int i = 0; i < faces.size(); ++i)
+  {
+    unsigned int j = faces[i].face;
+    proxy.geometry.add_face(Vec3i(faces[i].v[0], faces[i].v[1], faces[i].v[2]));
+    const Vec3i& f = geometry.face(j);
+    unsigned int first = cluster_ids[f[0]] == faces[i].v[0] ? 0 : (cluster_ids[f[1]] == faces[i].v[0] ? 1 : 2);
+    if(mesh.normals.no_faces() > j)
+    {
+      const Vec3i& n = mesh.normals.face(j);
+      proxy.normals.add_face(Vec3i(n[first], n[(first + 1)%3], n[(first + 2)%3]));
+    }
+    if(mesh.texcoords.no_faces() > j)
+    {
+      const Vec3i& t = mesh.texcoords.face(j);
+      proxy.texcoords.add_face(Vec3i(t[first], t[(first + 1)%3], t[(first + 2)%3]));
+    }
+    if(mesh.mat_idx.size() > j)
+      proxy.mat_idx.push_back(mesh.mat_idx[j]);
+  }
+  if(!proxy.has_normals())
+    proxy.compute_normals();
+  return max_displacement;
+}
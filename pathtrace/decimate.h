@@ -0,0 +1,16 @@
+// 02576 Rendering Framework
+// Simplification of triangle meshes by vertex clustering.
+// Copyright (c) DTU Compute 2013
+
+#ifndef DECIMATE_H
+#define DECIMATE_H
+
+#include "TriMesh.h"
+
+/// Simplify a mesh to about target_faces triangles by merging the vertices
+/// in each cell of a uniform grid. The remaining faces keep their material,
+/// normals, and texture coordinates. Returns the largest distance that a
+/// vertex was moved.
+float decimate(const TriMesh& mesh, TriMesh& proxy, unsigned int target_faces);
+
+#endif // DECIMATE_H
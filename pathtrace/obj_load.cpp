@@ -261,6 +261,7 @@ void obj_load(const string& filename, TriMesh &mesh)
 {
 	TriMeshObjLoader loader(&mesh);
 	loader.load(filename);
+	mesh.reorder_faces();
 }
     
 /// Load materials from an MTL file
@@ -9,7 +9,8 @@
 #include "ObjMaterial.h"
 #include "TriMesh.h"
 
-/// Load a TriMesh from an OBJ file
+/// Load a TriMesh from an OBJ file. The faces are reordered for locality
+/// (see TriMesh::reorder_faces), so face indices differ from the file.
 void obj_load(const std::string &filename, TriMesh &mesh);
 
 /// Load materials from an MTL file